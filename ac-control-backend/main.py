@@ -460,6 +460,7 @@ class StatusHistoryResponse(BaseModel):
 class ZoneValidation(BaseModel):
     zone_id: uuid.UUID
     customer_id: uuid.UUID
+    ac_brand_name: Optional[str] = Field(None, max_length=32)
 
 
 class DeviceCommand(BaseModel):
@@ -1531,7 +1532,16 @@ async def validate_zone(validation_data: ZoneValidation,
             raise HTTPException(status_code=status.HTTP_403_FORBIDDEN,
                                 detail="Access denied")
         logger.info(f"Zone validated: {validation_data.zone_id}")
-        return {"valid": True, "message": "Zone is valid"}
+        response = {"valid": True, "message": "Zone is valid"}
+        if validation_data.ac_brand_name:
+            # Protocol discovery on the device tries the fleet's most common protocol for the brand first
+            hint_result = await db.execute(select(Device.ac_brand_protocol)
+                                           .where(func.lower(Device.ac_brand_name) == validation_data.ac_brand_name.lower())
+                                           .group_by(Device.ac_brand_protocol)
+                                           .order_by(func.count().desc())
+                                           .limit(1))
+            response["protocol_hint"] = hint_result.scalar_one_or_none()
+        return response
     except HTTPException:
         raise
     except Exception as e:
@@ -0,0 +1,75 @@
+#include "api_client.h"
+
+#include "log.h"
+#include "metrics.h"
+#include "tls_pool.h"
+
+namespace {
+// Write-only stream that collects a response body into a fixed buffer;
+// HTTPClient::writeToStream() decodes chunked bodies into it, and the excess
+// is discarded
+class BufferStream : public Stream {
+ public:
+  BufferStream(char* buffer, size_t size) : _buffer(buffer), _size(size) {
+    _buffer[0] = '\0';
+  }
+
+  size_t write(uint8_t c) override {
+    if (_length + 1 < _size) {
+      _buffer[_length++] = (char)c;
+      _buffer[_length] = '\0';
+    }
+    return 1;
+  }
+
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+
+ private:
+  char* _buffer;
+  size_t _size;
+  size_t _length = 0;
+};
+}
+
+ApiClient::ApiClient(const char* host, uint16_t port, const char* deviceSecret, int timeout)
+  : _host(host), _port(port), _deviceSecret(deviceSecret), _timeout(timeout) {}
+
+int ApiClient::post(const char* path, const char* payload, char* response, size_t responseSize) {
+  response[0] = '\0';
+  BearSSL::WiFiClientSecure* client = tlsPool.acquire(SecureClientPool::Owner::Api);
+  if (client == nullptr) {
+    return HTTPC_ERROR_CONNECTION_FAILED;
+  }
+  client->setSession(&_session);
+  _http.setReuse(true);
+  _http.setTimeout(_timeout);
+  // Connect by hostname so SNI is sent
+  if (!_http.begin(*client, _host, _port, path, true)) {
+    return HTTPC_ERROR_CONNECTION_FAILED;
+  }
+  _http.addHeader("Content-Type", "application/json");
+  _http.addHeader("X-Device-Secret", _deviceSecret);
+
+  bool reused = client->connected();
+  if (!reused) {
+    metricsRecordTlsConnect();
+  }
+  LOG_DEBUG("API", "POST %s, connection %s", path, reused ? "reused" : "new");
+  int httpCode = _http.POST((const uint8_t*)payload, strlen(payload));
+  if (httpCode > 0) {
+    BufferStream body(response, responseSize);
+    _http.writeToStream(&body);
+  }
+  // With reuse enabled this keeps the socket open when the server allows keep-alive
+  _http.end();
+  return httpCode;
+}
+
+void ApiClient::end() {
+  _http.setReuse(false);
+  _http.end();
+  tlsPool.release(SecureClientPool::Owner::Api);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+
+// HTTPS client for the provisioning API. A single TLS connection is kept
+// alive between requests and the BearSSL session is reused when the server
+// closes it. The TLS client is borrowed from tlsPool until end().
+class ApiClient {
+ public:
+  ApiClient(const char* host, uint16_t port, const char* deviceSecret, int timeout);
+
+  // POSTs a JSON body to path and reads the response body into response,
+  // truncated to responseSize - 1 bytes. Returns the HTTP status code, or a
+  // negative HTTPC_ERROR_* code.
+  int post(const char* path, const char* payload, char* response, size_t responseSize);
+
+  // Closes the connection and returns the TLS client to the pool
+  void end();
+
+ private:
+  const char* _host;
+  uint16_t _port;
+  const char* _deviceSecret;
+  int _timeout;
+  BearSSL::Session _session;
+  HTTPClient _http;
+};
@@ -0,0 +1,236 @@
+// Host microbenchmarks for the portable firmware core: time and heap
+// allocations per call. Behaviour is covered by the unit tests in
+// test/test_core, which share this env and skip this file's main().
+//
+//   pio run -e native -t exec
+
+#ifndef PIO_UNIT_TESTING
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/ac_codec.h"
+#include "core/ac_state.h"
+#include "core/command_codec.h"
+#include "core/protocol_search.h"
+#include "core/publish_queue.h"
+#include "core/reconnect_backoff.h"
+#include "core/telemetry_batch.h"
+#include "core/telemetry_format.h"
+#include "core/topics.h"
+
+const unsigned long BENCH_ITERATIONS = 200000;
+const unsigned long BENCH_WARMUP = 1000;
+
+static unsigned long allocationCount = 0;
+static volatile size_t sink = 0; // Keeps results observable so loops are not optimized away
+
+#ifdef __GLIBC__
+// Count every heap allocation, including ArduinoJson's malloc() calls
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+extern "C" void __libc_free(void* pointer);
+
+extern "C" void* malloc(size_t size) {
+  allocationCount++;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  allocationCount++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+  allocationCount++;
+  return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void* pointer) {
+  __libc_free(pointer);
+}
+#endif
+
+template <typename Fn>
+static void bench(const char* name, Fn fn) {
+  for (unsigned long i = 0; i < BENCH_WARMUP; i++) {
+    fn();
+  }
+  unsigned long allocations = allocationCount;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < BENCH_ITERATIONS; i++) {
+    fn();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count();
+  printf("%-28s %10.1f ns/op %8.2f allocs/op\n", name, nanoseconds / BENCH_ITERATIONS,
+         (double)(allocationCount - allocations) / BENCH_ITERATIONS);
+}
+
+// Commands are decoded in place, so every iteration starts from a fresh copy
+// of the payload, as the PubSubClient buffer would hold it
+struct Payload {
+  char buffer[256];
+  size_t length;
+
+  explicit Payload(const char* text) : length(strlen(text)) { memcpy(buffer, text, length + 1); }
+};
+
+static void benchFieldCommand(const char* name, const char* text, CommandType command) {
+  Payload source(text);
+  char buffer[sizeof(source.buffer)];
+  bench(name, [&]() {
+    memcpy(buffer, source.buffer, source.length + 1);
+    size_t length = source.length;
+    ACState next;
+    uint32_t sequence = 0;
+    const char* value = unwrapCommandEnvelope(buffer, length, sequence);
+    sink += value != nullptr && applyFieldCommand(command, value, length, next) ? (size_t)next.mode + sequence : 0;
+  });
+}
+
+static void benchStateCommand() {
+  Payload source("{\"seq\":7,\"power\":\"on\",\"mode\":\"dry\",\"temperature\":21,\"fanspeed\":\"high\"}");
+  char buffer[sizeof(source.buffer)];
+  bench("state command", [&]() {
+    memcpy(buffer, source.buffer, source.length + 1);
+    ACState next;
+    uint32_t sequence = 0;
+    sink += (size_t)decodeStateCommand(buffer, source.length, next, sequence) + sequence;
+  });
+}
+
+static void benchCodec() {
+  stdAc::fanspeed_t fanspeed = stdAc::fanspeed_t::kAuto;
+  bench("fan speed name", [&]() { sink += (size_t)fanSpeedName((stdAc::fanspeed_t)(sink & 3)); });
+  bench("fan speed parse", [&]() {
+    sink += parseFanSpeedValue("medium", 6, fanspeed) ? (size_t)fanspeed : 0;
+  });
+}
+
+static void benchStateRecord() {
+  ACState state;
+  state.power = true;
+  state.mode = stdAc::opmode_t::kHeat;
+  state.degrees = 19;
+  state.fanspeed = stdAc::fanspeed_t::kMin;
+  ACStateRecord record;
+  ACState decoded;
+
+  uint32_t sequence = 0;
+  bench("state record encode", [&]() {
+    encodeStateRecord(state, ++sequence, record);
+    sink += record.crc;
+  });
+  bench("state record decode", [&]() {
+    sink += decodeStateRecord(record, decoded) ? decoded.degrees : 0;
+  });
+}
+
+static void benchTelemetry() {
+  ACState state;
+  state.power = true;
+  char output[640];
+  DeviceDescriptor device = {
+    "AA:BB:CC:DD:EE:FF", "customer-1", "zone-1", "Daikin", "DAIKIN", "1.0.2", "office-wifi", -61
+  };
+
+  bench("full telemetry", [&]() { sink += formatTelemetry(output, sizeof(output), device, state); });
+  bench("state telemetry", [&]() { sink += formatStateTelemetry(output, sizeof(output), state); });
+  bench("command ack", [&]() { sink += formatCommandAck(output, sizeof(output), 9, "ok", 0, state); });
+}
+
+static void benchTelemetryBatch() {
+  static TelemetryBatch batch;
+  char output[768]; // PUBLISH_PAYLOAD_SIZE
+  ACState state;
+  state.power = true;
+
+  batch.begin(0);
+  uint32_t now = 0;
+  bench("batch sample", [&]() { batch.sample(-60 - (int32_t)(sink & 7), 30000, 20000, 1500); });
+  bench("batch record state", [&]() { batch.recordState(++now / 1000, 0, state); });
+  bench("batch format", [&]() { sink += batch.format(output, sizeof(output), now / 1000); });
+}
+
+static void benchTopicRoute() {
+  const uint8_t mac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+  TopicTable topics;
+  buildTopicTable(topics, mac, "customer-1", "zone-1", true);
+
+  const char* device = "node/customer-1/AA:BB:CC:DD:EE:FF/command/state";
+  const char* zone = "node/customer-1/zone/zone-1/command/fanspeed";
+  const char* channel = "node/customer-1/AA:BB:CC:DD:EE:FF/ac/2/command/mode";
+  const char* unknown = "node/customer-2/11:22:33:44:55:66/command/state";
+  bool group = true;
+  uint8_t target = AC_ALL_CHANNELS;
+
+  bench("topic route (device)", [&]() { sink += (size_t)findTopicRoute(topics, device, group, target); });
+  bench("topic route (zone)", [&]() { sink += (size_t)findTopicRoute(topics, zone, group, target); });
+  bench("topic route (channel)", [&]() { sink += (size_t)findTopicRoute(topics, channel, group, target); });
+  bench("topic route (miss)", [&]() { sink += (size_t)findTopicRoute(topics, unknown, group, target); });
+}
+
+static void benchPublishQueue() {
+  static PublishQueue queue; // Too large for a comfortable stack frame on small hosts
+  const char* payload = "{\"rssi\":-61,\"uptime\":123456}";
+  size_t length = strlen(payload);
+  char output[64];
+
+  bench("publish queue push/pop", [&]() {
+    queue.push(1, 0, payload, length);
+    sink += queue.read(output, sizeof(output));
+    queue.pop();
+  });
+}
+
+static void benchProtocolSearch() {
+  const size_t count = 10; // Daikin, the largest brand
+  int16_t candidates[count];
+  for (size_t i = 0; i < count; i++) {
+    candidates[i] = (int16_t)(100 + i);
+  }
+  // Simulated installer: answers yes when the group contains the target
+  int16_t target = 0;
+  bench("protocol search (10)", [&]() {
+    int16_t wanted = candidates[target++ % count];
+    ProtocolSearch search;
+    search.begin(candidates, count, -1);
+    while (search.result() == ProtocolSearch::Result::Pending) {
+      bool responded = false;
+      for (size_t i = search.groupBegin(); i < search.groupEnd(); i++) {
+        responded = responded || search.candidate(i) == wanted;
+      }
+      search.answer(responded);
+    }
+    sink += search.winner();
+  });
+}
+
+static void benchReconnectBackoff() {
+  const uint8_t mac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x01};
+  ReconnectBackoff backoff(5000, 30000);
+  backoff.seed(mac, sizeof(mac));
+  bench("reconnect backoff", [&]() { sink += backoff.next(); });
+}
+
+int main() {
+  printf("%-28s %16s %18s\n", "benchmark", "time", "allocations");
+  benchFieldCommand("field command (bare)", "cool", CommandType::Mode);
+  benchFieldCommand("field command (envelope)", "{\"seq\":42,\"value\":\"heat\"}", CommandType::Mode);
+  benchStateCommand();
+  benchCodec();
+  benchStateRecord();
+  benchTelemetry();
+  benchTelemetryBatch();
+  benchTopicRoute();
+  benchPublishQueue();
+  benchProtocolSearch();
+  benchReconnectBackoff();
+  return 0;
+}
+
+#endif // PIO_UNIT_TESTING
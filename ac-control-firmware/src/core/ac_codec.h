@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ac_state.h"
+
+// Single mode and fan-speed naming used by commands, telemetry, schedules and
+// the legacy state file. Each value's first entry is its canonical name; later
+// entries are aliases that are only accepted on input.
+template <typename T>
+struct EnumName {
+  T value;
+  const char* name;
+};
+
+constexpr EnumName<stdAc::opmode_t> modeNames[] = {
+  {stdAc::opmode_t::kAuto, "auto"},
+  {stdAc::opmode_t::kCool, "cool"},
+  {stdAc::opmode_t::kHeat, "heat"},
+  {stdAc::opmode_t::kDry, "dry"},
+  {stdAc::opmode_t::kFan, "fan"}
+};
+
+// Telemetry and the JSON state file report min/max, which the dashboard maps
+// to low/high; commands have always said low/high, so those are accepted too
+constexpr EnumName<stdAc::fanspeed_t> fanSpeedNames[] = {
+  {stdAc::fanspeed_t::kAuto, "auto"},
+  {stdAc::fanspeed_t::kMin, "min"},
+  {stdAc::fanspeed_t::kMedium, "medium"},
+  {stdAc::fanspeed_t::kMax, "max"},
+  {stdAc::fanspeed_t::kMin, "low"},
+  {stdAc::fanspeed_t::kMax, "high"}
+};
+
+// Stops at the end of name, so a NUL inside value cannot match past it
+constexpr bool enumNameEquals(const char* value, size_t length, const char* name) {
+  return length == 0 ? *name == '\0' : (*name != '\0' && *name == *value && enumNameEquals(value + 1, length - 1, name + 1));
+}
+
+// Index of the entry for value, or N
+template <typename T, size_t N>
+constexpr size_t enumValueIndex(const EnumName<T> (&table)[N], T value, size_t i = 0) {
+  return (i >= N || table[i].value == value) ? i : enumValueIndex(table, value, i + 1);
+}
+
+// Index of the entry named by an unterminated, case-sensitive string, or N
+template <typename T, size_t N>
+constexpr size_t enumNameIndex(const EnumName<T> (&table)[N], const char* value, size_t length, size_t i = 0) {
+  return (i >= N || enumNameEquals(value, length, table[i].name)) ? i : enumNameIndex(table, value, length, i + 1);
+}
+
+template <typename T, size_t N>
+constexpr const char* enumName(const EnumName<T> (&table)[N], T value, const char* fallback) {
+  return enumValueIndex(table, value) < N ? table[enumValueIndex(table, value)].name : fallback;
+}
+
+// Every name must decode to its own value, so aliases cannot shadow each other
+template <typename T, size_t N>
+constexpr bool enumNamesConsistent(const EnumName<T> (&table)[N], size_t i = 0) {
+  return i >= N || ((table[enumNameIndex(table, table[i].name, __builtin_strlen(table[i].name))].value == table[i].value) &&
+                    enumNamesConsistent(table, i + 1));
+}
+
+static_assert(enumNamesConsistent(modeNames), "Duplicate mode name");
+static_assert(enumNamesConsistent(fanSpeedNames), "Duplicate fan speed name");
+
+// Unknown values are reported with the defaults the firmware starts from
+constexpr const char* modeName(stdAc::opmode_t mode) {
+  return enumName(modeNames, mode, "cool");
+}
+
+constexpr const char* fanSpeedName(stdAc::fanspeed_t fanspeed) {
+  return enumName(fanSpeedNames, fanspeed, "medium");
+}
+
+static_assert(enumNameEquals("max", 3, fanSpeedName(stdAc::fanspeed_t::kMax)), "Fan speed names must match what the dashboard maps");
+
+// Single-byte wire encoding, used by the persisted state and schedule records.
+// The byte is the stdAc value, so existing records keep decoding; only values
+// with a name in the table are accepted.
+constexpr uint8_t modeCode(stdAc::opmode_t mode) {
+  return (uint8_t)mode;
+}
+
+constexpr uint8_t fanSpeedCode(stdAc::fanspeed_t fanspeed) {
+  return (uint8_t)fanspeed;
+}
+
+inline bool decodeModeCode(uint8_t code, stdAc::opmode_t& mode) {
+  size_t count = sizeof(modeNames) / sizeof(modeNames[0]);
+  if (enumValueIndex(modeNames, (stdAc::opmode_t)code) >= count) {
+    return false;
+  }
+  mode = (stdAc::opmode_t)code;
+  return true;
+}
+
+inline bool decodeFanSpeedCode(uint8_t code, stdAc::fanspeed_t& fanspeed) {
+  size_t count = sizeof(fanSpeedNames) / sizeof(fanSpeedNames[0]);
+  if (enumValueIndex(fanSpeedNames, (stdAc::fanspeed_t)code) >= count) {
+    return false;
+  }
+  fanspeed = (stdAc::fanspeed_t)code;
+  return true;
+}
@@ -0,0 +1,38 @@
+#include "ac_state.h"
+
+#include "ac_codec.h"
+
+void encodeStateRecord(const ACState& state, uint32_t sequence, ACStateRecord& record) {
+  record.magic = STATE_RECORD_MAGIC;
+  record.sequence = sequence;
+  record.power = state.power ? 1 : 0;
+  record.mode = modeCode(state.mode);
+  record.degrees = (int8_t)state.degrees;
+  record.fanspeed = fanSpeedCode(state.fanspeed);
+  record.crc = crc32((const uint8_t*)&record, offsetof(ACStateRecord, crc));
+}
+
+bool decodeStateRecord(const ACStateRecord& record, ACState& state) {
+  if (record.magic != STATE_RECORD_MAGIC || record.crc != crc32((const uint8_t*)&record, offsetof(ACStateRecord, crc))) {
+    return false;
+  }
+  ACState decoded;
+  if (!decodeModeCode(record.mode, decoded.mode) || !decodeFanSpeedCode(record.fanspeed, decoded.fanspeed)) {
+    return false;
+  }
+  decoded.power = record.power != 0;
+  decoded.degrees = record.degrees;
+  state = decoded;
+  return true;
+}
+
+uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <IRsend.h>
+#else
+// Host builds do not link IRremoteESP8266; these mirror its stdAc enums so
+// persisted records and wire values stay identical
+namespace stdAc {
+enum class opmode_t {
+  kOff = -1,
+  kAuto = 0,
+  kCool = 1,
+  kHeat = 2,
+  kDry = 3,
+  kFan = 4,
+  kLastOpmodeEnum = kFan
+};
+
+enum class fanspeed_t {
+  kAuto = 0,
+  kMin = 1,
+  kLow = 2,
+  kMedium = 3,
+  kHigh = 4,
+  kMax = 5,
+  kMediumHigh = 6,
+  kLastFanspeedEnum = kMediumHigh
+};
+}  // namespace stdAc
+#endif
+
+const uint32_t STATE_RECORD_MAGIC = 0xAC57A7E1;
+const uint8_t AC_MAX_CHANNELS = 4; // AC units, each with its own IR emitter, one controller can drive
+
+// AC state structure
+struct ACState {
+  bool power = false;
+  stdAc::opmode_t mode = stdAc::opmode_t::kCool;
+  int degrees = 25;
+  stdAc::fanspeed_t fanspeed = stdAc::fanspeed_t::kMedium;
+};
+
+// Fixed-size persisted AC state, shared by RTC memory and the flash journal
+struct ACStateRecord {
+  uint32_t magic;
+  uint32_t sequence;
+  uint8_t power;
+  uint8_t mode;
+  int8_t degrees;
+  uint8_t fanspeed;
+  uint32_t crc;
+};
+
+void encodeStateRecord(const ACState& state, uint32_t sequence, ACStateRecord& record);
+
+// False if the record is blank, corrupt or holds an unknown enum value
+bool decodeStateRecord(const ACStateRecord& record, ACState& state);
+
+// CRC-32 (IEEE), used by every persisted record
+uint32_t crc32(const uint8_t* data, size_t length);
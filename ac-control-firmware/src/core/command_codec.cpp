@@ -0,0 +1,205 @@
+#include "command_codec.h"
+
+#include <ArduinoJson.h>
+#include <string.h>
+
+const int POWER_TOGGLE = 2;
+const int TEMPERATURE_MIN = 16;
+const int TEMPERATURE_MAX = 30;
+
+const ValueToken powerTokens[] = {
+  {"on", 1},
+  {"off", 0},
+  {"toggle", POWER_TOGGLE}
+};
+
+const char* commandName(CommandType command) {
+  switch (command) {
+    case CommandType::Power: return "power";
+    case CommandType::Mode: return "mode";
+    case CommandType::Temperature: return "temperature";
+    case CommandType::FanSpeed: return "fanspeed";
+    case CommandType::State: return "state";
+    case CommandType::Schedule: return "schedule";
+    case CommandType::OTAUpdate: return "ota";
+    case CommandType::Channels: return "channels";
+    case CommandType::LocalApi: return "local_api";
+  }
+  return "unknown";
+}
+
+// Bounded by the token length, so a NUL inside the payload cannot end the
+// comparison early and the table entry is never read past its end
+bool matchToken(const char* value, size_t length, const ValueToken* tokens, size_t count, int& result) {
+  for (size_t i = 0; i < count; i++) {
+    if (length == strlen(tokens[i].name) && memcmp(value, tokens[i].name, length) == 0) {
+      result = tokens[i].value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseBoundedInt(const char* value, size_t length, int lowest, int highest, int& result) {
+  size_t i = 0;
+  bool negative = false;
+  if (i < length && (value[i] == '-' || value[i] == '+')) {
+    negative = (value[i] == '-');
+    i++;
+  }
+  if (i == length) {
+    return false;
+  }
+  long limit = negative ? -(long)lowest : (long)highest;
+  long parsed = 0;
+  for (; i < length; i++) {
+    if (value[i] < '0' || value[i] > '9') {
+      return false;
+    }
+    parsed = parsed * 10 + (value[i] - '0');
+    if (parsed > limit) {
+      return false; // Out of range already; stop before it can overflow
+    }
+  }
+  if (negative) {
+    parsed = -parsed;
+  }
+  if (parsed < lowest || parsed > highest) {
+    return false;
+  }
+  result = (int)parsed;
+  return true;
+}
+
+bool parsePowerValue(const char* value, size_t length, bool current, bool& power) {
+  int token;
+  if (!matchToken(value, length, powerTokens, sizeof(powerTokens) / sizeof(powerTokens[0]), token)) {
+    return false;
+  }
+  power = (token == POWER_TOGGLE) ? !current : (token == 1);
+  return true;
+}
+
+bool parseModeValue(const char* value, size_t length, stdAc::opmode_t& mode) {
+  size_t index = enumNameIndex(modeNames, value, length);
+  if (index >= sizeof(modeNames) / sizeof(modeNames[0])) {
+    return false;
+  }
+  mode = modeNames[index].value;
+  return true;
+}
+
+bool parseTemperatureValue(const char* value, size_t length, int& degrees) {
+  return parseBoundedInt(value, length, TEMPERATURE_MIN, TEMPERATURE_MAX, degrees);
+}
+
+bool parseFanSpeedValue(const char* value, size_t length, stdAc::fanspeed_t& fanspeed) {
+  size_t index = enumNameIndex(fanSpeedNames, value, length);
+  if (index >= sizeof(fanSpeedNames) / sizeof(fanSpeedNames[0])) {
+    return false;
+  }
+  fanspeed = fanSpeedNames[index].value;
+  return true;
+}
+
+const char* unwrapCommandEnvelope(char* payload, size_t& length, uint32_t& sequence) {
+  sequence = 0;
+  if (length == 0 || payload[0] != '{') {
+    return payload;
+  }
+  // Zero-copy parse: strings stay in payload and are terminated in place
+  StaticJsonDocument<96> doc;
+  if (deserializeJson(doc, payload, length) || !doc["value"].is<const char*>()) {
+    return nullptr;
+  }
+  sequence = doc["seq"] | 0UL;
+  const char* value = doc["value"].as<const char*>();
+  length = strlen(value);
+  return value;
+}
+
+bool applyFieldCommand(CommandType command, const char* value, size_t length, ACState& state) {
+  // Like the state command, changing a setting turns the unit on
+  switch (command) {
+    case CommandType::Power:
+      return parsePowerValue(value, length, state.power, state.power);
+    case CommandType::Mode:
+      state.power = true;
+      return parseModeValue(value, length, state.mode);
+    case CommandType::Temperature:
+      state.power = true;
+      return parseTemperatureValue(value, length, state.degrees);
+    case CommandType::FanSpeed:
+      state.power = true;
+      return parseFanSpeedValue(value, length, state.fanspeed);
+    default:
+      return false;
+  }
+}
+
+StateCommandResult decodeStateCommand(char* payload, size_t length, ACState& state, uint32_t& sequence) {
+  // Non-const input lets ArduinoJson parse in place without copying strings
+  StaticJsonDocument<192> doc;
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error || !doc.is<JsonObject>()) {
+    return StateCommandResult::Malformed;
+  }
+  JsonObject fields = doc.as<JsonObject>();
+  sequence = fields["seq"] | 0UL;
+  fields.remove("seq");
+  if (fields.size() == 0) {
+    return StateCommandResult::Empty;
+  }
+
+  // Changing a setting turns the unit on unless the same message also sets
+  // the power explicitly
+  bool currentPower = state.power;
+  bool valid = true;
+  bool recognised = false; // Unknown keys alone must not send a frame
+  if (fields.containsKey("mode")) {
+    recognised = true;
+    JsonVariant mode = fields["mode"];
+    if (mode.is<int>()) {
+      valid = valid && mode.as<int>() >= 0 && mode.as<int>() <= UINT8_MAX && decodeModeCode(mode.as<int>(), state.mode);
+    } else {
+      const char* name = mode | "";
+      valid = valid && parseModeValue(name, strlen(name), state.mode);
+    }
+    state.power = true;
+  }
+  if (fields.containsKey("temperature")) {
+    recognised = true;
+    JsonVariant temperature = fields["temperature"];
+    if (temperature.is<int>()) {
+      state.degrees = temperature.as<int>();
+      valid = valid && state.degrees >= TEMPERATURE_MIN && state.degrees <= TEMPERATURE_MAX;
+    } else {
+      const char* degrees = temperature | "";
+      valid = valid && parseTemperatureValue(degrees, strlen(degrees), state.degrees);
+    }
+    state.power = true;
+  }
+  if (fields.containsKey("fanspeed")) {
+    recognised = true;
+    JsonVariant fanspeed = fields["fanspeed"];
+    if (fanspeed.is<int>()) {
+      valid = valid && fanspeed.as<int>() >= 0 && fanspeed.as<int>() <= UINT8_MAX &&
+              decodeFanSpeedCode(fanspeed.as<int>(), state.fanspeed);
+    } else {
+      const char* name = fanspeed | "";
+      valid = valid && parseFanSpeedValue(name, strlen(name), state.fanspeed);
+    }
+    state.power = true;
+  }
+  if (fields.containsKey("power")) {
+    recognised = true;
+    JsonVariant power = fields["power"];
+    if (power.is<bool>()) {
+      state.power = power.as<bool>();
+    } else {
+      const char* powerValue = power | "";
+      valid = valid && parsePowerValue(powerValue, strlen(powerValue), currentPower, state.power);
+    }
+  }
+  return valid && recognised ? StateCommandResult::Ok : StateCommandResult::Invalid;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ac_codec.h"
+#include "ac_state.h"
+
+// MQTT command dispatch
+enum class CommandType : uint8_t {
+  Power,
+  Mode,
+  Temperature,
+  FanSpeed,
+  State,
+  Schedule,
+  OTAUpdate,
+  Channels,
+  LocalApi
+};
+
+enum class StateCommandResult : uint8_t {
+  Ok,
+  Malformed, // Not a JSON object
+  Empty,     // No fields besides "seq"
+  Invalid    // A field has an unknown or out-of-range value, or no known field is set
+};
+
+// Command value tokens, matched against the raw payload bytes
+struct ValueToken {
+  const char* name;
+  int value;
+};
+
+const char* commandName(CommandType command);
+
+// Exact, case-sensitive match of an unterminated value against a token table
+bool matchToken(const char* value, size_t length, const ValueToken* tokens, size_t count, int& result);
+
+// Parses an optionally signed decimal that must use every byte and lie in [lowest, highest]
+bool parseBoundedInt(const char* value, size_t length, int lowest, int highest, int& result);
+
+bool parsePowerValue(const char* value, size_t length, bool current, bool& power);
+bool parseModeValue(const char* value, size_t length, stdAc::opmode_t& mode);
+bool parseTemperatureValue(const char* value, size_t length, int& degrees);
+bool parseFanSpeedValue(const char* value, size_t length, stdAc::fanspeed_t& fanspeed);
+
+// Per-field commands are either a bare value ("on") or {"seq":N,"value":"on"}.
+// Returns the value, which points into payload, and updates length to match;
+// nullptr if the envelope is malformed.
+const char* unwrapCommandEnvelope(char* payload, size_t& length, uint32_t& sequence);
+
+// Applies one per-field command value to state; false if the value is invalid
+bool applyFieldCommand(CommandType command, const char* value, size_t length, ACState& state);
+
+// Decodes {"seq":N,"power":..,"mode":..,"temperature":..,"fanspeed":..} on top
+// of state; mode and fanspeed may also be given as their wire codes. payload
+// is parsed in place. state is only meaningful on Ok, and
+// sequence is set whenever the payload is a JSON object.
+StateCommandResult decodeStateCommand(char* payload, size_t length, ACState& state, uint32_t& sequence);
@@ -0,0 +1,55 @@
+#include "protocol_search.h"
+
+void ProtocolSearch::begin(const int16_t* candidates, size_t count, int16_t hint) {
+  _count = count < MAX_CANDIDATES ? count : MAX_CANDIDATES;
+  size_t hintIndex = _count;
+  for (size_t i = 0; i < _count; i++) {
+    _candidates[i] = candidates[i];
+    if (candidates[i] == hint) {
+      hintIndex = i;
+    }
+  }
+  // Rotate the hint to the front, keeping the others in brand order
+  for (size_t i = hintIndex; i > 0 && i < _count; i--) {
+    int16_t swap = _candidates[i];
+    _candidates[i] = _candidates[i - 1];
+    _candidates[i - 1] = swap;
+  }
+  _low = 0;
+  _high = _count;
+  _rounds = 0;
+  _result = _count > 0 ? Result::Pending : Result::Exhausted;
+  if (hintIndex < _count) {
+    _groupEnd = 1;
+  } else {
+    nextGroup();
+  }
+}
+
+ProtocolSearch::Result ProtocolSearch::answer(bool responded) {
+  if (_result != Result::Pending) {
+    return _result;
+  }
+  _rounds++;
+  if (responded) {
+    _high = _groupEnd;
+    if (_high - _low == 1) {
+      // The group that responded was this candidate alone
+      _result = Result::Found;
+      return _result;
+    }
+  } else {
+    _low = _groupEnd;
+    if (_low == _high) {
+      _result = Result::Exhausted;
+      return _result;
+    }
+  }
+  // A single remaining candidate is still fired alone to confirm it
+  nextGroup();
+  return _result;
+}
+
+void ProtocolSearch::nextGroup() {
+  _groupEnd = _low + (_high - _low + 1) / 2;
+}
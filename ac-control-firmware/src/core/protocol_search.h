@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Narrows a brand's candidate protocols down to the one the unit accepts.
+// Each round fires one group of candidates and the installer's yes/no answer
+// keeps or discards the whole group, so n candidates take about log2(n) + 1
+// answers instead of up to n.
+class ProtocolSearch {
+ public:
+  enum class Result : uint8_t {
+    Pending,
+    Found,
+    Exhausted
+  };
+
+  static const size_t MAX_CANDIDATES = 16;
+
+  // Candidates in brand order. A hint that is among them is moved to the front
+  // and fired alone in the first round. Extra candidates are ignored.
+  void begin(const int16_t* candidates, size_t count, int16_t hint);
+
+  // Answer for the current group; "no" on the last remaining group exhausts the search
+  Result answer(bool responded);
+
+  Result result() const { return _result; }
+  size_t count() const { return _count; }
+  int16_t candidate(size_t index) const { return _candidates[index]; }
+
+  // Current group is [groupBegin(), groupEnd()); it always lies inside the remaining range
+  size_t groupBegin() const { return _low; }
+  size_t groupEnd() const { return _groupEnd; }
+  size_t remaining() const { return _high - _low; }
+  size_t rounds() const { return _rounds; }
+
+  // Only meaningful once result() is Found
+  int16_t winner() const { return _candidates[_low]; }
+
+ private:
+  void nextGroup();
+
+  int16_t _candidates[MAX_CANDIDATES];
+  size_t _count = 0;
+  size_t _low = 0;      // Remaining range [_low, _high) still holds the protocol
+  size_t _high = 0;
+  size_t _groupEnd = 0;
+  size_t _rounds = 0;
+  Result _result = Result::Exhausted;
+};
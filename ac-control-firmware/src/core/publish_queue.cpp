@@ -0,0 +1,63 @@
+#include "publish_queue.h"
+
+#include <string.h>
+
+bool PublishQueue::push(uint8_t topic, uint8_t flags, const char* payload, size_t length) {
+  if (length > UINT16_MAX || !fits(length)) {
+    return false;
+  }
+  Header header = {topic, flags, (uint16_t)length};
+  size_t tail = (_head + _used) % CAPACITY;
+  copyIn(tail, &header, sizeof(header));
+  copyIn((tail + sizeof(header)) % CAPACITY, payload, length);
+  _used += sizeof(header) + length;
+  _count++;
+  return true;
+}
+
+bool PublishQueue::peek(Header& header) const {
+  if (_count == 0) {
+    return false;
+  }
+  copyOut(_head, &header, sizeof(header));
+  return true;
+}
+
+size_t PublishQueue::read(char* payload, size_t size) const {
+  Header header;
+  if (size == 0 || !peek(header)) {
+    return 0;
+  }
+  size_t length = header.length < size - 1 ? header.length : size - 1;
+  copyOut((_head + sizeof(header)) % CAPACITY, payload, length);
+  payload[length] = '\0';
+  return length;
+}
+
+void PublishQueue::pop() {
+  Header header;
+  if (!peek(header)) {
+    return;
+  }
+  size_t recordSize = sizeof(header) + header.length;
+  _head = (_head + recordSize) % CAPACITY;
+  _used -= recordSize;
+  _count--;
+  if (_count == 0) {
+    _head = 0; // Keep the next records contiguous
+  }
+}
+
+void PublishQueue::copyIn(size_t offset, const void* data, size_t length) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  size_t first = CAPACITY - offset < length ? CAPACITY - offset : length;
+  memcpy(_buffer + offset, bytes, first);
+  memcpy(_buffer, bytes + first, length - first);
+}
+
+void PublishQueue::copyOut(size_t offset, void* data, size_t length) const {
+  uint8_t* bytes = static_cast<uint8_t*>(data);
+  size_t first = CAPACITY - offset < length ? CAPACITY - offset : length;
+  memcpy(bytes, _buffer + offset, first);
+  memcpy(bytes + first, _buffer, length - first);
+}
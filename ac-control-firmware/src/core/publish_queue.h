@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte ring of variable-length outbound MQTT messages. Each record is a
+// Header followed by its payload; records wrap around the end of the buffer.
+// Topics are stored as small ids so the queue survives topic table rebuilds.
+class PublishQueue {
+ public:
+  struct Header {
+    uint8_t topic;
+    uint8_t flags;
+    uint16_t length;
+  };
+
+  static const size_t CAPACITY = 2048;
+
+  // True if a payload of this length can be pushed without evicting anything
+  bool fits(size_t length) const { return sizeof(Header) + length <= CAPACITY - _used; }
+
+  // Appends a record; fails if it does not fit, so callers choose what to evict
+  bool push(uint8_t topic, uint8_t flags, const char* payload, size_t length);
+
+  // Reads the oldest record's header; false when the queue is empty
+  bool peek(Header& header) const;
+
+  // Copies the oldest record's payload and terminates it; returns the copied length
+  size_t read(char* payload, size_t size) const;
+
+  // Removes the oldest record
+  void pop();
+
+  bool empty() const { return _count == 0; }
+  size_t count() const { return _count; }
+  size_t used() const { return _used; }
+
+ private:
+  void copyIn(size_t offset, const void* data, size_t length);
+  void copyOut(size_t offset, void* data, size_t length) const;
+
+  uint8_t _buffer[CAPACITY];
+  size_t _head = 0; // Offset of the oldest record
+  size_t _used = 0;
+  size_t _count = 0;
+};
@@ -0,0 +1,48 @@
+#include "reconnect_backoff.h"
+
+ReconnectBackoff::ReconnectBackoff(uint32_t baseMs, uint32_t capMs) : _base(baseMs), _cap(capMs) {}
+
+void ReconnectBackoff::seed(const uint8_t* mac, size_t length) {
+  // FNV-1a; neighbouring MACs differ only in the last bytes
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ mac[i]) * 16777619u;
+  }
+  _state = hash != 0 ? hash : 1;
+}
+
+uint32_t ReconnectBackoff::initialDelay(uint32_t windowMs) {
+  return random(0, windowMs);
+}
+
+uint32_t ReconnectBackoff::next() {
+  uint32_t delay;
+  if (_previous == 0 && _retryAfter != 0) {
+    delay = _retryAfter + random(0, _spread);
+  } else if (_previous == 0) {
+    delay = random(0, _base);
+  } else {
+    uint64_t upper = (uint64_t)_previous * 3;
+    delay = random(_base, upper < _cap ? (uint32_t)upper : _cap);
+  }
+  // Keeps the next draw growing even when this one was short
+  _previous = delay > _base ? delay : _base;
+  return delay;
+}
+
+uint32_t ReconnectBackoff::serverBusy() {
+  _previous = _cap;
+  return random(_cap / 2, _cap);
+}
+
+void ReconnectBackoff::setRetryAfter(uint32_t retryAfterMs, uint32_t spreadMs) {
+  _retryAfter = retryAfterMs;
+  _spread = retryAfterMs != 0 ? spreadMs : 0;
+}
+
+uint32_t ReconnectBackoff::random(uint32_t low, uint32_t high) {
+  _state ^= _state << 13;
+  _state ^= _state >> 17;
+  _state ^= _state << 5;
+  return high > low ? low + _state % (high - low) : low;
+}
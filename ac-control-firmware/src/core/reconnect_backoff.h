@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// MQTT reconnect scheduling with decorrelated jitter: each retry waits a
+// random time between the base and three times the previous wait, capped.
+// The generator is seeded from the MAC, so a fleet that lost the broker at
+// the same moment spreads its handshakes instead of retrying in step.
+class ReconnectBackoff {
+ public:
+  ReconnectBackoff(uint32_t baseMs, uint32_t capMs);
+
+  void seed(const uint8_t* mac, size_t length);
+
+  // Random delay in [0, windowMs) before the first connect after boot
+  uint32_t initialDelay(uint32_t windowMs);
+
+  // Delay before the next attempt. The first one after reset() is drawn from
+  // [0, base), or follows the broker hint when one is set.
+  uint32_t next();
+
+  // Broker refused the connection as unavailable; backs off to the cap
+  uint32_t serverBusy();
+
+  // Starts the sequence again at once
+  void reset() { _previous = 0; }
+
+  // How long a connection must stay up before connectedFor() restarts the
+  // sequence. A broker that accepts connections and then drops them would
+  // otherwise put the fleet back into [0, base) on every cycle.
+  void setStableTime(uint32_t stableMs) { _stable = stableMs; }
+
+  // Called while connected; once uptimeMs reaches the stable time the next
+  // drop starts the sequence again
+  void connectedFor(uint32_t uptimeMs) {
+    if (uptimeMs >= _stable) {
+      _previous = 0;
+    }
+  }
+
+  // Broker hint: after a drop, wait retryAfterMs plus up to spreadMs before
+  // the first attempt. Zero clears it.
+  void setRetryAfter(uint32_t retryAfterMs, uint32_t spreadMs);
+
+  uint32_t retryAfter() const { return _retryAfter; }
+
+ private:
+  // Uniform in [low, high); low when the range is empty
+  uint32_t random(uint32_t low, uint32_t high);
+
+  uint32_t _base;
+  uint32_t _cap;
+  uint32_t _previous = 0;  // 0 until the first retry after a reset
+  uint32_t _stable = 0;
+  uint32_t _state = 1;     // xorshift32 state, never zero
+  uint32_t _retryAfter = 0;
+  uint32_t _spread = 0;
+};
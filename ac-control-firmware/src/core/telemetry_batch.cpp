@@ -0,0 +1,76 @@
+#include "telemetry_batch.h"
+
+#include <stdio.h>
+
+#include "ac_codec.h"
+
+void SampleStats::add(int32_t value) {
+  if (count == 0 || value < min) {
+    min = value;
+  }
+  if (count == 0 || value > max) {
+    max = value;
+  }
+  sum += value;
+  count++;
+}
+
+void TelemetryBatch::begin(uint32_t now) {
+  *this = TelemetryBatch();
+  _start = now;
+}
+
+void TelemetryBatch::sample(int32_t rssi, uint32_t freeHeap, uint32_t maxFreeBlock, uint32_t loopStallUs) {
+  _rssi.add(rssi);
+  _heap.add((int32_t)freeHeap);
+  _maxBlock.add((int32_t)maxFreeBlock);
+  _stall.add(loopStallUs > INT32_MAX ? INT32_MAX : (int32_t)loopStallUs);
+}
+
+void TelemetryBatch::recordState(uint32_t now, uint8_t channel, const ACState& state) {
+  size_t slot = (_eventHead + _eventCount) % MAX_EVENTS;
+  if (_eventCount == MAX_EVENTS) {
+    _eventHead = (_eventHead + 1) % MAX_EVENTS;
+    _eventsDropped++;
+  } else {
+    _eventCount++;
+  }
+  uint32_t offset = now - _start;
+  Event& event = _events[slot];
+  event.offset = offset > UINT16_MAX ? UINT16_MAX : (uint16_t)offset;
+  event.channel = channel;
+  event.power = state.power ? 1 : 0;
+  event.mode = modeCode(state.mode);
+  event.degrees = (int8_t)state.degrees;
+  event.fanspeed = fanSpeedCode(state.fanspeed);
+}
+
+size_t TelemetryBatch::format(char* output, size_t size, uint32_t now) const {
+  if (size == 0) {
+    return 0;
+  }
+  size_t length = 0;
+  // Appends while there is room; a truncated record is still terminated
+  auto append = [&](int written) {
+    if (written > 0) {
+      length += (size_t)written < size - length ? (size_t)written : size - length - 1;
+    }
+  };
+  const SampleStats* stats[] = {&_rssi, &_heap, &_maxBlock, &_stall};
+  const char* names[] = {"rssi", "heap", "max_block", "stall_us"};
+  append(snprintf(output, size, "{\"start\":%lu,\"span\":%lu,\"samples\":%lu", (unsigned long)_start,
+                  (unsigned long)(now - _start), (unsigned long)_rssi.count));
+  for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+    append(snprintf(output + length, size - length, ",\"%s\":[%ld,%ld,%ld]", names[i], (long)stats[i]->min,
+                    (long)stats[i]->average(), (long)stats[i]->max));
+  }
+  append(snprintf(output + length, size - length, ",\"wifi_drops\":%u,\"mqtt_drops\":%u,\"events\":[",
+                  (unsigned)_wifiDrops, (unsigned)_mqttDrops));
+  for (size_t i = 0; i < _eventCount; i++) {
+    const Event& e = event(i);
+    append(snprintf(output + length, size - length, "%s[%u,%u,%u,%u,%d,%u]", i > 0 ? "," : "", (unsigned)e.offset,
+                    (unsigned)e.channel, (unsigned)e.power, (unsigned)e.mode, (int)e.degrees, (unsigned)e.fanspeed));
+  }
+  append(snprintf(output + length, size - length, "],\"events_dropped\":%lu}", (unsigned long)_eventsDropped));
+  return length;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ac_state.h"
+
+// Running min/max/average of one sampled quantity. Only the aggregate is
+// published, so individual samples are folded in rather than stored.
+struct SampleStats {
+  int32_t min = 0;
+  int32_t max = 0;
+  int64_t sum = 0;
+  uint32_t count = 0;
+
+  void add(int32_t value);
+  int32_t average() const { return count ? (int32_t)(sum / (int64_t)count) : 0; }
+};
+
+// One batched telemetry record: link and heap samples taken at a high rate,
+// plus a ring of the AC state changes made during the batch. Published as
+//   {"start":s,"span":s,"samples":n,"rssi":[min,avg,max],"heap":[..],
+//    "max_block":[..],"stall_us":[..],"wifi_drops":n,"mqtt_drops":n,
+//    "events":[[t,channel,power,mode,degrees,fanspeed],..],"events_dropped":n}
+// where t is seconds since start and mode/fanspeed are their wire codes.
+class TelemetryBatch {
+ public:
+  static const size_t MAX_EVENTS = 16;
+
+  struct Event {
+    uint16_t offset; // Seconds since the batch started
+    uint8_t channel;
+    uint8_t power;
+    uint8_t mode;
+    int8_t degrees;
+    uint8_t fanspeed;
+  };
+
+  // Clears everything and starts a new batch at now (seconds)
+  void begin(uint32_t now);
+
+  void sample(int32_t rssi, uint32_t freeHeap, uint32_t maxFreeBlock, uint32_t loopStallUs);
+
+  // When the ring is full the oldest event is overwritten and counted as dropped
+  void recordState(uint32_t now, uint8_t channel, const ACState& state);
+
+  void recordWiFiDrop() { _wifiDrops++; }
+  void recordMqttDrop() { _mqttDrops++; }
+
+  uint32_t start() const { return _start; }
+  uint32_t samples() const { return _rssi.count; }
+  size_t eventCount() const { return _eventCount; }
+  // Oldest first
+  const Event& event(size_t index) const { return _events[(_eventHead + index) % MAX_EVENTS]; }
+
+  // Writes the terminated JSON record and returns its length; output is
+  // truncated, not overrun, when it does not fit
+  size_t format(char* output, size_t size, uint32_t now) const;
+
+ private:
+  uint32_t _start = 0;
+  SampleStats _rssi;
+  SampleStats _heap;
+  SampleStats _maxBlock;
+  SampleStats _stall;
+  uint16_t _wifiDrops = 0;
+  uint16_t _mqttDrops = 0;
+  Event _events[MAX_EVENTS];
+  size_t _eventHead = 0;  // Oldest event
+  size_t _eventCount = 0;
+  uint32_t _eventsDropped = 0;
+};
@@ -0,0 +1,56 @@
+#include "telemetry_format.h"
+
+#include <ArduinoJson.h>
+#include <stdio.h>
+
+#include "ac_codec.h"
+
+// snprintf returns the untruncated length; report what was actually written
+static size_t writtenLength(int length, size_t size) {
+  if (length < 0 || size == 0) {
+    return 0;
+  }
+  return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+size_t formatTelemetry(char* output, size_t size, const DeviceDescriptor& device, const ACState& state) {
+  // Values are const char* or scalars, which v6 links instead of copying, so
+  // only the member slots count; they are twice as large on 64-bit hosts
+  StaticJsonDocument<JSON_OBJECT_SIZE(12)> doc;
+  doc["device_id"] = device.deviceId;
+  doc["customer_id"] = device.customerId;
+  doc["zone_id"] = device.zoneId;
+  doc["ac_brand"] = device.brand;
+  doc["ac_protocol"] = device.protocol;
+  doc["firmware_version"] = device.firmwareVersion;
+  doc["wifi_ssid"] = device.wifiSsid;
+  doc["rssi"] = device.rssi;
+  doc["ac_power"] = state.power;
+  doc["ac_mode"] = modeName(state.mode);
+  doc["ac_temperature"] = state.degrees;
+  doc["ac_fanspeed"] = fanSpeedName(state.fanspeed);
+  return serializeJson(doc, output, size);
+}
+
+size_t formatStateTelemetry(char* output, size_t size, const ACState& state) {
+  int length = snprintf(output, size, "{\"ac_power\":%s,\"ac_mode\":\"%s\",\"ac_temperature\":%d,\"ac_fanspeed\":\"%s\"}",
+                        state.power ? "true" : "false", modeName(state.mode), state.degrees, fanSpeedName(state.fanspeed));
+  return writtenLength(length, size);
+}
+
+size_t formatHeartbeat(char* output, size_t size, int rssi, unsigned long uptime) {
+  int length = snprintf(output, size, "{\"rssi\":%d,\"uptime\":%lu}", rssi, uptime);
+  return writtenLength(length, size);
+}
+
+size_t formatCommandAck(char* output, size_t size, uint32_t sequence, const char* result, uint8_t channel, const ACState& state) {
+  char channelField[16] = "";
+  if (channel > 0) {
+    snprintf(channelField, sizeof(channelField), "\"channel\":%u,", (unsigned)channel);
+  }
+  int length = snprintf(output, size,
+                        "{\"seq\":%lu,\"result\":\"%s\",%s\"ac_power\":%s,\"ac_mode\":\"%s\",\"ac_temperature\":%d,\"ac_fanspeed\":\"%s\"}",
+                        (unsigned long)sequence, result, channelField, state.power ? "true" : "false", modeName(state.mode),
+                        state.degrees, fanSpeedName(state.fanspeed));
+  return writtenLength(length, size);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ac_state.h"
+
+// Static fields of the full telemetry descriptor
+struct DeviceDescriptor {
+  const char* deviceId;
+  const char* customerId;
+  const char* zoneId;
+  const char* brand;
+  const char* protocol;
+  const char* firmwareVersion;
+  const char* wifiSsid;
+  int rssi;
+};
+
+// Each formatter writes a terminated JSON payload and returns its length;
+// output is truncated, not overrun, when it does not fit
+size_t formatTelemetry(char* output, size_t size, const DeviceDescriptor& device, const ACState& state);
+size_t formatStateTelemetry(char* output, size_t size, const ACState& state);
+size_t formatHeartbeat(char* output, size_t size, int rssi, unsigned long uptime);
+
+// Acks are cumulative: the result for sequence N covers every earlier sequence
+// coalesced into the same IR frame. Channel 0 acks carry no channel field, as
+// before channels existed.
+size_t formatCommandAck(char* output, size_t size, uint32_t sequence, const char* result, uint8_t channel, const ACState& state);
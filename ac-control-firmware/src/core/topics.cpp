@@ -0,0 +1,111 @@
+#include "topics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const TopicRoute topicRoutes[] = {
+  {"/command/power", CommandType::Power, true, true},
+  {"/command/mode", CommandType::Mode, true, true},
+  {"/command/temperature", CommandType::Temperature, true, true},
+  {"/command/fanspeed", CommandType::FanSpeed, true, true},
+  {"/command/state", CommandType::State, true, true},
+  {"/command/schedule", CommandType::Schedule, true, false},
+  {"/config/channels", CommandType::Channels, false, false},
+  {"/config/local", CommandType::LocalApi, false, false},
+  {"/ota/update", CommandType::OTAUpdate, false, false}
+};
+const size_t TOPIC_ROUTE_COUNT = sizeof(topicRoutes) / sizeof(topicRoutes[0]);
+
+bool buildTopicTable(TopicTable& topics, const uint8_t mac[6], const char* customerId, const char* zoneId, bool broadcast) {
+  snprintf(topics.deviceId, sizeof(topics.deviceId), "%02X:%02X:%02X:%02X:%02X:%02X",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  int length = snprintf(topics.base, sizeof(topics.base), "node/%s/%s", customerId, topics.deviceId);
+  // Leave room for the longest suffix so every derived topic fits; each one is
+  // still checked so a truncated topic is reported rather than subscribed
+  bool fits = length >= 0 && (size_t)length + strlen("/telemetry/heartbeat") < sizeof(topics.base) &&
+              buildTopic(topics.status, sizeof(topics.status), topics.base, "/status") &&
+              buildTopic(topics.telemetry, sizeof(topics.telemetry), topics.base, "/telemetry") &&
+              buildTopic(topics.heartbeat, sizeof(topics.heartbeat), topics.base, "/telemetry/heartbeat") &&
+              buildTopic(topics.batch, sizeof(topics.batch), topics.base, "/telemetry/batch") &&
+              buildTopic(topics.metrics, sizeof(topics.metrics), topics.base, "/metrics") &&
+              buildTopic(topics.error, sizeof(topics.error), topics.base, "/error") &&
+              buildTopic(topics.ack, sizeof(topics.ack), topics.base, "/ack") &&
+              buildTopic(topics.otaStatus, sizeof(topics.otaStatus), topics.base, "/ota/status");
+  if (fits) {
+    topics.baseLength = length;
+    // Shorter than the device base
+    length = snprintf(topics.backpressure, sizeof(topics.backpressure), "node/%s/backpressure", customerId);
+    fits = length >= 0 && (size_t)length < sizeof(topics.backpressure);
+  }
+  if (!fits) {
+    topics.baseLength = 0;
+    topics.zoneBaseLength = 0;
+    topics.broadcastBaseLength = 0;
+    return false;
+  }
+
+  char zoneScope[MQTT_TOPIC_SIZE];
+  length = snprintf(zoneScope, sizeof(zoneScope), "zone/%s", zoneId);
+  topics.zoneBaseLength = 0;
+  if (length >= 0 && (size_t)length < sizeof(zoneScope)) {
+    buildGroupBase(topics.zoneBase, sizeof(topics.zoneBase), topics.zoneBaseLength, customerId, zoneScope);
+  }
+  topics.broadcastBaseLength = 0;
+  if (broadcast) {
+    buildGroupBase(topics.broadcastBase, sizeof(topics.broadcastBase), topics.broadcastBaseLength, customerId, "broadcast");
+  }
+  return true;
+}
+
+bool buildGroupBase(char* base, size_t size, size_t& baseLength, const char* customerId, const char* scope) {
+  int length = snprintf(base, size, "node/%s/%s", customerId, scope);
+  if (length < 0 || (size_t)length + strlen("/command/temperature") >= size) {
+    baseLength = 0;
+    return false;
+  }
+  baseLength = length;
+  return true;
+}
+
+bool buildTopic(char* topic, size_t size, const char* base, const char* suffix) {
+  int length = snprintf(topic, size, "%s%s", base, suffix);
+  return length >= 0 && (size_t)length < size;
+}
+
+bool buildChannelTopic(char* topic, size_t size, const TopicTable& topics, uint8_t channel, const char* suffix) {
+  int length = channel == 0 ? snprintf(topic, size, "%s%s", topics.base, suffix)
+                            : snprintf(topic, size, "%s/ac/%u%s", topics.base, (unsigned)channel, suffix);
+  return length >= 0 && (size_t)length < size;
+}
+
+const TopicRoute* findTopicRoute(const TopicTable& topics, const char* topic, bool& group, uint8_t& channel) {
+  const char* suffix = nullptr;
+  group = false;
+  channel = 0;
+  if (topics.baseLength > 0 && strncmp(topic, topics.base, topics.baseLength) == 0) {
+    suffix = topic + topics.baseLength;
+    if (strncmp(suffix, "/ac/", 4) == 0 && suffix[4] >= '1' && suffix[4] < '0' + AC_MAX_CHANNELS) {
+      channel = suffix[4] - '0';
+      suffix += 5;
+    }
+  } else if (topics.zoneBaseLength > 0 && strncmp(topic, topics.zoneBase, topics.zoneBaseLength) == 0) {
+    suffix = topic + topics.zoneBaseLength;
+    group = true;
+    channel = AC_ALL_CHANNELS;
+  } else if (topics.broadcastBaseLength > 0 && strncmp(topic, topics.broadcastBase, topics.broadcastBaseLength) == 0) {
+    suffix = topic + topics.broadcastBaseLength;
+    group = true;
+    channel = AC_ALL_CHANNELS;
+  } else {
+    return nullptr;
+  }
+  for (size_t i = 0; i < TOPIC_ROUTE_COUNT; i++) {
+    const TopicRoute& route = topicRoutes[i];
+    if (strcmp(suffix, route.suffix) == 0) {
+      bool allowed = group ? route.group : (channel == 0 || route.channel);
+      return allowed ? &route : nullptr;
+    }
+  }
+  return nullptr;
+}
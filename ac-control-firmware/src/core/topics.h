@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_codec.h"
+
+const size_t MQTT_TOPIC_SIZE = 128; // Max length of a device topic, including terminator
+const uint8_t AC_ALL_CHANNELS = 0xFF; // Group commands address every channel
+
+// Extra channels live under <base>/ac/<n>, with n a single digit
+static_assert(AC_MAX_CHANNELS <= 10, "Channel numbers must be one digit");
+
+struct TopicRoute {
+  const char* suffix;
+  CommandType command;
+  bool group;   // Also accepted on the zone and customer broadcast topics
+  bool channel; // Also accepted under <base>/ac/<n> for channels other than 0
+};
+
+// Subscribed topic suffixes, relative to the device base topic
+extern const TopicRoute topicRoutes[];
+extern const size_t TOPIC_ROUTE_COUNT;
+
+// Device topics, built once per MQTT connection
+struct TopicTable {
+  char deviceId[18];
+  char base[MQTT_TOPIC_SIZE];
+  size_t baseLength = 0;
+  char zoneBase[MQTT_TOPIC_SIZE];      // node/<customer_id>/zone/<zone_id>
+  size_t zoneBaseLength = 0;           // 0 when the zone topic does not fit
+  char broadcastBase[MQTT_TOPIC_SIZE]; // node/<customer_id>/broadcast
+  size_t broadcastBaseLength = 0;      // 0 when disabled or too long
+  char backpressure[MQTT_TOPIC_SIZE];  // node/<customer_id>/backpressure, retained reconnect hint from the backend
+  char status[MQTT_TOPIC_SIZE];
+  char telemetry[MQTT_TOPIC_SIZE];
+  char heartbeat[MQTT_TOPIC_SIZE];
+  char batch[MQTT_TOPIC_SIZE];
+  char metrics[MQTT_TOPIC_SIZE];
+  char error[MQTT_TOPIC_SIZE];
+  char ack[MQTT_TOPIC_SIZE];
+  char otaStatus[MQTT_TOPIC_SIZE];
+};
+
+// Builds every topic under node/<customer_id>/<MAC>. False if the customer ID
+// is too long for the device topics; group topics that do not fit are left
+// with a zero base length instead.
+bool buildTopicTable(TopicTable& topics, const uint8_t mac[6], const char* customerId, const char* zoneId, bool broadcast);
+
+// Group topics are shared by every device in a zone or customer
+bool buildGroupBase(char* base, size_t size, size_t& baseLength, const char* customerId, const char* scope);
+
+// <base><suffix>; false if it was truncated
+bool buildTopic(char* topic, size_t size, const char* base, const char* suffix);
+
+// Channel 0 uses the device topics; channel n uses <base>/ac/<n><suffix>.
+// False if the topic does not fit.
+bool buildChannelTopic(char* topic, size_t size, const TopicTable& topics, uint8_t channel, const char* suffix);
+
+// Matches an incoming topic against the device and group bases; group is set
+// when it arrived on a zone or broadcast topic. channel is the addressed AC
+// channel, AC_ALL_CHANNELS for group topics; it is not checked against the
+// number of configured channels.
+const TopicRoute* findTopicRoute(const TopicTable& topics, const char* topic, bool& group, uint8_t& channel);
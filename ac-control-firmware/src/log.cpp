@@ -0,0 +1,17 @@
+#include "log.h"
+
+#include <stdarg.h>
+
+void logWrite(const char* tag, PGM_P format, ...) {
+  // Single-threaded loop(), so one shared buffer is enough
+  static char buffer[LOG_BUFFER_SIZE];
+  int length = snprintf(buffer, sizeof(buffer), "[%s] ", tag);
+  if (length < 0 || (size_t)length >= sizeof(buffer)) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vsnprintf_P(buffer + length, sizeof(buffer) - length, format, args);
+  va_end(args);
+  Serial.println(buffer);
+}
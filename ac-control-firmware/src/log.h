@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Log levels, selected at build time with -D LOG_LEVEL=... in platformio.ini.
+// Calls above the selected level compile to nothing, arguments included.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Longest formatted line, including the "[TAG] " prefix; longer lines are truncated
+#define LOG_BUFFER_SIZE 256
+
+// Formats "[tag] message" into a static buffer and writes it to Serial.
+// The format string lives in flash; nothing is allocated on the heap.
+void logWrite(const char* tag, PGM_P format, ...);
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(tag, format, ...) logWrite(tag, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_ERROR(tag, format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(tag, format, ...) logWrite(tag, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_WARN(tag, format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(tag, format, ...) logWrite(tag, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_INFO(tag, format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(tag, format, ...) logWrite(tag, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(tag, format, ...) do {} while (0)
+#endif
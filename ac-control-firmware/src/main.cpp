@@ -1,40 +1,139 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
+#include <ESP8266mDNS.h>
 #include <LittleFS.h>
 #include <ArduinoJson.h>
 #include <IRremoteESP8266.h>
 #include <IRac.h>
+#include <IRutils.h>
 #include <PubSubClient.h>
 #include <ESP8266HTTPClient.h>
-#include <ESP8266httpUpdate.h>
 #include <DNSServer.h>
-#include <vector>
+#include <EEPROM.h>
+#include <time.h>
+#include "api_client.h"
+#include "log.h"
+#include "metrics.h"
+#include "ota_updater.h"
+#include "core/ac_codec.h"
+#include "core/ac_state.h"
+#include "core/command_codec.h"
+#include "core/protocol_search.h"
+#include "core/publish_queue.h"
+#include "core/reconnect_backoff.h"
+#include "core/telemetry_batch.h"
+#include "core/telemetry_format.h"
+#include "core/topics.h"
 
 // Configuration constants
 const char* CONFIG_FILE = "/config.json";
-const char* AC_STATE_FILE = "/ac_state.json";
+const char* AC_STATE_FILE = "/ac_state.json";  // Legacy JSON state, read once for migration
+const char* AC_STATE_JOURNAL_FILE = "/ac_state.bin";
+const char* AC_CHANNEL_JOURNAL_FORMAT = "/ac_state_%u.bin"; // Journals of channels 1 and up
+const char* PUBLISH_SPOOL_FILE = "/mqtt_spool.bin";
+const char* SCHEDULE_FILE = "/schedule.bin";
+const char* NTP_SERVER_1 = "pool.ntp.org";
+const char* NTP_SERVER_2 = "time.google.com";
+const char* DEFAULT_TIMEZONE = "UTC0"; // POSIX TZ string
 const char* AP_PASSWORD = "password123";
 const uint16_t IR_LED_PIN = 4;  // GPIO4 (D2)
+const uint8_t AC_CHANNEL_PINS[] = {4, 5, 12, 13, 14}; // GPIOs free for extra IR emitters on a D1 mini; boot straps excluded
 const char* MQTT_BROKER = "13cc21a598da48498cbc4ecab9ba9c6d.s1.eu.hivemq.cloud";
 const int MQTT_PORT = 8883;
 const char* MQTT_USERNAME = "MyACControl";
 const char* MQTT_PASSWORD = "MyAC@Control1";
 const char* API_KEY = "123dasd12313dsasdas";
-const char* API_BASE_URL = "https://accontrolapi-922006260296.us-central1.run.app";
+const char* API_HOST = "accontrolapi-922006260296.us-central1.run.app";
+const uint16_t API_PORT = 443;
 const char* FIRMWARE_VERSION = "1.0.2";
 const unsigned long TELEMETRY_INTERVAL = 30000;  // 30 seconds
-const unsigned long RECONNECT_INTERVAL = 5000;   // Initial reconnect delay
+const unsigned long HEARTBEAT_INTERVAL = 60000;  // Default heartbeat interval for change-driven telemetry
+const unsigned long METRICS_INTERVAL = 300000;   // 5 minutes
+const unsigned long BATCH_SAMPLE_INTERVAL = 1000; // RSSI, heap and loop stall sampling period
+const unsigned long BATCH_INTERVAL = 300000;     // One aggregated telemetry/batch record per 5 minutes
+const unsigned long RECONNECT_INTERVAL = 5000;   // Backoff base; retries are jittered up to 3x the previous wait
 const unsigned long MAX_RECONNECT_INTERVAL = 30000; // Max reconnect delay
+const unsigned long MQTT_STARTUP_SPREAD = 10000; // First connect after power-on waits up to this, so a site does not connect at once
+const unsigned long MQTT_RESTART_SPREAD = 1000;  // Same after a software restart, which the fleet does not share
+const uint32_t MAX_RETRY_AFTER = 3600;           // Seconds; longer broker hints are clamped
 const int HTTP_TIMEOUT = 20000; // 5 seconds timeout for HTTP requests
 const int MQTT_BUFFER_SIZE = 1024; // Increased MQTT buffer size
+const bool MQTT_CUSTOMER_BROADCAST = true; // Also accept commands on node/<customer_id>/broadcast/command/...
+const size_t PUBLISH_PAYLOAD_SIZE = 768; // Largest queued payload, sized for the worst-case metrics JSON
+const size_t JSON_ARENA_SIZE = 1536; // The one JSON document, sized for a full schedule command
+const size_t API_BODY_SIZE = 384; // Provisioning API request and response bodies
+const unsigned long PUBLISH_DRAIN_INTERVAL = 50; // Pause between drained bursts after a reconnect
+const size_t PUBLISH_DRAIN_BURST = 4; // Messages sent per burst
+const bool PUBLISH_SPOOL_ENABLED = true; // Spill evicted error messages to LittleFS
+const size_t PUBLISH_SPOOL_LIMIT = 4096; // Max spool file size; further errors are dropped
+const unsigned long OTA_START_JITTER = 30000; // Random start delay so a fleet rollout does not download at once
+const uint8_t OTA_PROGRESS_STEP = 10; // Percent between ota/status progress reports
+const size_t SCHEDULE_MAX_RULES = 12; // Rules in one schedule; a full schedule fits one MQTT message
+const uint8_t SCHEDULE_MAX_CATCHUP = 5; // Minutes replayed after a stall; larger clock jumps are skipped
+const time_t SCHEDULE_MIN_VALID_TIME = 1700000000; // Earlier clock readings mean SNTP has not synced yet
+const uint32_t SCHEDULE_MAGIC = 0xAC5C4ED0;
+const unsigned long COMMAND_COALESCE_WINDOW = 200; // Per-field commands within this window share one IR frame (0 disables)
+const unsigned long STATE_FLUSH_DELAY = 30000; // Quiet period before the AC state is written to flash
+const size_t STATE_JOURNAL_SLOTS = 16; // Records kept in the on-flash state ring journal
+const uint32_t RTC_STATE_OFFSET = 32; // RTC user memory block; the first 128 bytes are reserved by OTA
+const uint32_t WIFI_CACHE_MAGIC = 0xAC0BC551;
+const uint32_t TLS_SESSION_MAGIC = 0xAC075E55;
+const unsigned long WIFI_CONNECT_TIMEOUT = 10000; // Give up on a single association attempt after this long
+const unsigned long WIFI_RETRY_INTERVAL = 5000;   // Pause between association attempts
+const unsigned long WIFI_SCAN_INTERVAL = 30000;   // Background scan refresh period in AP mode
+const size_t WIFI_SCAN_MAX_RESULTS = 20;          // Strongest networks kept in the scan cache
+const uint32_t BOOT_IMAGE_MAGIC = 0xAC0B0070;
+const uint16_t BOOT_IMAGE_VERSION = 5; // Bump when the BootImage layout changes
+const size_t PAGE_CHUNK_SIZE = 512; // Portal pages are streamed in chunks of at most this size
+const size_t PAGE_LINE_SIZE = 160;  // Max length of one formatted template line
+const uint8_t POWER_LISTEN_INTERVAL = 3; // DTIM beacons slept through in modem/light sleep; bounds the added command latency
+const unsigned long POWER_IDLE_DELAY = 50; // Idle loops yield this long; the SDK only sleeps inside delay()
+const unsigned long POWER_AWAKE_HOLD = 2000; // Stay awake after MQTT traffic so follow-up commands are not delayed
+const uint16_t POWER_ACTIVE_CURRENT_MA = 70; // Datasheet figures for the current estimate in metrics
+const uint16_t POWER_MODEM_SLEEP_CURRENT_MA = 15;
+const uint16_t POWER_LIGHT_SLEEP_CURRENT_MA = 1;
+const uint16_t MQTT_KEEPALIVE = 15; // Seconds, PubSubClient default
+const uint16_t MQTT_SLEEP_KEEPALIVE = 60; // Fewer pings, and wakeups, in modem/light sleep
+const uint32_t MQTT_STABLE_KEEPALIVES = 3; // Keep-alive periods a connection must last before the backoff restarts from its base
+const unsigned long DISCOVERY_FRAME_GAP = 1500; // Pause between test frames of one sweep so each gets its own beep
+const size_t STATE_COMMAND_COPY_SIZE = 256; // Largest group state command applied to more than one channel
+const unsigned long CONFIG_RESTART_DELAY = 3000; // Lets the ack drain before a channel change reboots
+const size_t LOCAL_TOKEN_MIN_LENGTH = 16; // Shorter local API tokens are rejected when provisioned
+const uint8_t LOCAL_AUTH_MAX_FAILURES = 5; // Failed local API logins before the lockout
+const unsigned long LOCAL_AUTH_LOCKOUT = 60000; // Local API refuses every request this long after too many failures
+const char* MDNS_SERVICE = "accontrol"; // Advertised as _accontrol._tcp for on-site gateways
 
 // Global objects
 ESP8266WebServer server(80);
 DNSServer dnsServer;
 IRac ac(IR_LED_PIN);
 WiFiClientSecure espClient;
+BearSSL::Session tlsSession;
 PubSubClient mqttClient(espClient);
+ApiClient apiClient(API_HOST, API_PORT, API_KEY, HTTP_TIMEOUT);
+
+// Opt-in radio power saving. Normal leaves the SDK default and never yields.
+enum class PowerMode : uint8_t {
+  Normal,
+  ModemSleep,
+  LightSleep
+};
+
+constexpr EnumName<PowerMode> powerModeNames[] = {
+  {PowerMode::Normal, "normal"},
+  {PowerMode::ModemSleep, "modem"},
+  {PowerMode::LightSleep, "light"}
+};
+
+// An extra IR emitter and the unit it drives. Channel 0 is described by
+// ac_brand/ac_protocol and always uses IR_LED_PIN.
+struct ChannelConfig {
+  uint8_t pin;
+  uint8_t reserved;
+  int16_t protocol; // decode_type_t
+  int16_t model;    // IRac model, 1 for most protocols
+};
 
 // Configuration structure
 struct Config {
@@ -44,176 +143,666 @@ struct Config {
   String zone_id;
   String ac_brand;
   String ac_protocol;
+  int16_t ac_model = 1;
+  uint8_t channel_count = 1; // Including channel 0
+  ChannelConfig extra_channels[AC_MAX_CHANNELS - 1] = {}; // Channel n is extra_channels[n - 1]
   String firmware_version;
+  String local_token; // Bearer token for the LAN API; empty disables it
+  bool telemetry_on_change = true;  // Descriptor once per connection, then state changes and heartbeats
+  unsigned long heartbeat_interval = HEARTBEAT_INTERVAL;
+  PowerMode power_mode = PowerMode::Normal;
+};
+
+// One timed action. Only the fields flagged in `fields` are changed; like the
+// state command, setting mode, temperature or fan speed also turns the unit on.
+struct ScheduleRule {
+  uint8_t days;     // Bit 0 = Sunday ... bit 6 = Saturday, as tm_wday
+  uint8_t fields;   // RULE_* bits, and the AC channel above RULE_CHANNEL_SHIFT
+  uint16_t minute;  // Local minute of the day, 0-1439
+  uint8_t power;
+  uint8_t mode;
+  int8_t degrees;
+  uint8_t fanspeed;
+};
+
+const uint8_t RULE_POWER = 0x01;
+const uint8_t RULE_MODE = 0x02;
+const uint8_t RULE_TEMPERATURE = 0x04;
+const uint8_t RULE_FANSPEED = 0x08;
+const uint8_t RULE_CHANNEL_SHIFT = 4; // Rules from before channels existed read as channel 0
+static_assert(AC_MAX_CHANNELS - 1 <= (0xFF >> RULE_CHANNEL_SHIFT), "Channel must fit the rule fields byte");
+
+// Persisted rule table, stored next to the AC state
+struct ScheduleTable {
+  uint32_t magic;
+  uint8_t count;
+  uint8_t reserved[3];
+  char timezone[48];
+  ScheduleRule rules[SCHEDULE_MAX_RULES];
+  uint32_t crc;
+};
+
+// Wi-Fi connection state machine, driven by loop() and SDK events
+enum class WiFiState : uint8_t {
+  Idle,
+  Connecting,
+  Connected,
+  Failed
+};
+
+// One entry of the cached, de-duplicated scan list
+struct ScanResult {
+  char ssid[33];
+  int8_t rssi;
+  bool secure;
+};
+
+// Last successful association, kept in RTC memory to skip the channel scan
+struct WiFiCacheRecord {
+  uint32_t magic;
+  uint32_t ssidHash;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reserved;
+  uint32_t crc;
 };
 
-// AC state structure
-struct ACState {
-  bool power = false;
-  stdAc::opmode_t mode = stdAc::opmode_t::kCool;
-  int degrees = 25;
-  stdAc::fanspeed_t fanspeed = stdAc::fanspeed_t::kMedium;
+// RTC user memory is addressed in 4-byte blocks; each record starts after the previous one
+constexpr uint32_t rtcBlocks(size_t size) { return (size + 3) / 4; }
+const uint32_t RTC_WIFI_OFFSET = RTC_STATE_OFFSET + rtcBlocks(sizeof(ACStateRecord)); // Cached BSSID/channel
+
+// MQTT connection is split across loop() iterations so HTTP and IR work
+// get a pass between the TLS handshake and the MQTT CONNECT. Each step still
+// blocks: BearSSL has no incremental handshake API, so a full handshake holds
+// one loop() for as long as it takes, and PubSubClient waits for the CONNACK.
+enum class MQTTConnectState : uint8_t {
+  Idle,
+  HandshakeNext, // The next pass runs the blocking TLS handshake
+  ConnectNext    // The next pass sends CONNECT and waits for the CONNACK
 };
 
-// Brand-protocol mapping
-struct BrandProtocol {
-  const char* brand;
-  std::vector<decode_type_t> protocols;
+// BearSSL session parameters, kept in RTC memory so a reboot can resume TLS
+struct TLSSessionRecord {
+  uint32_t magic;
+  uint8_t session[sizeof(BearSSL::Session)];
+  uint32_t crc;
+};
+const uint32_t RTC_TLS_OFFSET = RTC_WIFI_OFFSET + rtcBlocks(sizeof(WiFiCacheRecord)); // BearSSL session
+static_assert(RTC_STATE_OFFSET >= 32, "RTC records overlap the area reserved by OTA");
+static_assert(RTC_TLS_OFFSET * 4 + sizeof(TLSSessionRecord) <= 512, "TLS session does not fit in RTC user memory");
+
+// Binary snapshot of Config and ACState, kept in the EEPROM flash sector so
+// boot does not depend on mounting LittleFS and parsing JSON
+struct BootImage {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length;
+  char wifi_ssid[33];
+  char wifi_password[65];
+  char customer_id[64];
+  char zone_id[64];
+  char ac_brand[24];
+  char ac_protocol[8];
+  char firmware_version[16];
+  char local_token[65];
+  uint8_t telemetry_on_change;
+  uint8_t power_mode;
+  uint32_t heartbeat_interval;
+  int16_t ac_model;
+  uint8_t channel_count;
+  ChannelConfig extra_channels[AC_MAX_CHANNELS - 1];
+  ACStateRecord state; // Channel 0; extra channels restore from their journals
+  uint32_t crc;
+};
+
+// Outbound messages. Snapshot topics carry the latest state and are only
+// flagged; event topics are queued with their payload.
+enum class PublishTopic : uint8_t {
+  Heartbeat,
+  Metrics,
+  Error,
+  Ack,
+  OtaStatus,
+  Batch
+};
+
+const uint8_t PUBLISH_RETAINED = 0x01;
+const uint8_t PUBLISH_SPOOL = 0x02; // Spilled to LittleFS instead of dropped when evicted
+
+const uint8_t SNAPSHOT_STATUS = 0x01;
+const uint8_t SNAPSHOT_TELEMETRY = 0x02;
+const uint8_t SNAPSHOT_STATE = 0x04; // Channel 0; channel n uses SNAPSHOT_STATE << n
+static_assert((SNAPSHOT_STATE << (AC_MAX_CHANNELS - 1)) <= 0x80, "Every channel needs a snapshot bit");
+
+// Runtime state of one AC channel
+struct ACChannel {
+  IRac* ir = nullptr;
+  ACState state;
+  ACState pendingState;
+  bool hasPendingState = false;
+  unsigned long pendingSince = 0;
+  uint32_t pendingReceivedAt = 0;
+  uint32_t pendingSequence = 0; // Highest sequence folded into pendingState
+  uint32_t stateSequence = 0;
+  bool stateDirty = false;
+  unsigned long stateChangedAt = 0;
+  ACState lastPublishedState;
+  bool stateTelemetryPublished = false;
+};
+
+// Portal page templates, kept in flash and streamed with chunked transfer
+static const char WIFI_PAGE_HEADER[] PROGMEM =
+  "<html><body><h1>Wi-Fi Setup</h1><form action='/submit' method='POST'>"
+  "<label>Wi-Fi SSID:</label><select name='ssid'>";
+static const char WIFI_PAGE_FOOTER[] PROGMEM =
+  "</select><br>"
+  "<label>Wi-Fi Password:</label><input type='password' name='password'><br>"
+  "<input type='submit' value='Save Wi-Fi Settings'>"
+  "</form>"
+  "<script>"
+  "function refresh(){fetch('/scan').then(function(r){return r.json();}).then(function(d){"
+  "if(!d.networks.length)return;var s=document.getElementsByName('ssid')[0],v=s.value;s.innerHTML='';"
+  "d.networks.forEach(function(n){var o=document.createElement('option');o.value=o.textContent=n.ssid;s.appendChild(o);});"
+  "if(v)s.value=v;if(s.selectedIndex<0)s.selectedIndex=0;});}"
+  "setInterval(refresh,10000);"
+  "</script></body></html>";
+static const char WIFI_PAGE_SCANNING[] PROGMEM = "<option value=''>Scanning...</option>";
+static const char CONFIG_PAGE_HEADER[] PROGMEM =
+  "<html><body><h1>Device Configuration</h1><form action='/config' method='POST'>"
+  "<label>Customer ID:</label><input type='text' name='customer_id'><br>"
+  "<label>Zone ID:</label><input type='text' name='zone_id'><br>"
+  "<label>AC Brand:</label><select name='ac_brand'>";
+static const char CONFIG_PAGE_FOOTER[] PROGMEM =
+  "</select><br>"
+  "<label><input type='checkbox' name='skip_testing' value='true'> Skip AC protocol testing (uses first available protocol)</label><br>"
+  "<input type='submit' value='Save and Proceed'>"
+  "</form></body></html>";
+static const char TEST_PAGE_HEADER[] PROGMEM = "<html><body><h1>Testing AC Protocol</h1>";
+static const char TEST_PAGE_SWEEPING[] PROGMEM =
+  "<meta http-equiv='refresh' content='2;url=/test'>"
+  "<p>Sending test signals. Watch and listen to the AC.</p></body></html>";
+static const char TEST_PAGE_FOOTER[] PROGMEM =
+  "<p>Did the AC beep, turn on or change in any way during these signals?</p>"
+  "<form action='/result' method='POST'>"
+  "<input type='hidden' name='success' value='yes'><input type='submit' value='Yes, it responded'>"
+  "</form>"
+  "<form action='/result' method='POST'>"
+  "<input type='hidden' name='success' value='no'><input type='submit' value='No response'>"
+  "</form>"
+  "<form action='/result' method='POST'>"
+  "<input type='hidden' name='success' value='repeat'><input type='submit' value='Send again'>"
+  "</form></body></html>";
+static const char STATUS_PAGE_HEADER[] PROGMEM = "<html><body><h1>Device Status</h1>";
+static const char STATUS_PAGE_FOOTER[] PROGMEM =
+  "<form action='/reset' method='POST'><input type='submit' value='Reset Device'></form>"
+  "</body></html>";
+static const char OPTION_TEMPLATE[] PROGMEM = "<option value='%s'>%s</option>";
+
+// Brand-protocol mapping, kept in flash. Each brand owns a contiguous run of
+// brandProtocolList; brandTable is sorted by name for binary search.
+const size_t BRAND_NAME_SIZE = 12;
+
+struct BrandEntry {
+  char name[BRAND_NAME_SIZE];
+  uint8_t offset;
+  uint8_t count;
+};
+
+constexpr int16_t brandProtocolList[] PROGMEM = {
+  decode_type_t::AIRTON, // airton
+  decode_type_t::AIRWELL, // airwell
+  decode_type_t::AMCOR, // amcor
+  decode_type_t::ARGO, // argo
+  decode_type_t::BOSCH144, // bosch
+  decode_type_t::CARRIER_AC, decode_type_t::CARRIER_AC40, decode_type_t::CARRIER_AC64, decode_type_t::CARRIER_AC84, decode_type_t::CARRIER_AC128, // carrier
+  decode_type_t::CLIMABUTLER, // climabutler
+  decode_type_t::COOLIX, decode_type_t::COOLIX48, // coolix
+  decode_type_t::CORONA_AC, // corona
+  decode_type_t::DAIKIN, decode_type_t::DAIKIN2, decode_type_t::DAIKIN64, decode_type_t::DAIKIN128, decode_type_t::DAIKIN152, decode_type_t::DAIKIN160, decode_type_t::DAIKIN176, decode_type_t::DAIKIN200, decode_type_t::DAIKIN216, decode_type_t::DAIKIN312, // daikin
+  decode_type_t::DELONGHI_AC, // delonghi
+  decode_type_t::ECOCLIM, // ecoclim
+  decode_type_t::ELECTRA_AC, // electra
+  decode_type_t::FUJITSU_AC, // fujitsu
+  decode_type_t::GOODWEATHER, // goodweather
+  decode_type_t::GORENJE, // gorenje
+  decode_type_t::GREE, // gree
+  decode_type_t::HAIER_AC, decode_type_t::HAIER_AC_YRW02, decode_type_t::HAIER_AC160, decode_type_t::HAIER_AC176, // haier
+  decode_type_t::HITACHI_AC, decode_type_t::HITACHI_AC1, decode_type_t::HITACHI_AC2, decode_type_t::HITACHI_AC3, decode_type_t::HITACHI_AC264, decode_type_t::HITACHI_AC296, decode_type_t::HITACHI_AC344, decode_type_t::HITACHI_AC424, // hitachi
+  decode_type_t::KELON, decode_type_t::KELON168, // kelon
+  decode_type_t::KELVINATOR, // kelvinator
+  decode_type_t::LG, // lg
+  decode_type_t::MIDEA, decode_type_t::MIDEA24, // midea
+  decode_type_t::MIRAGE, // mirage
+  decode_type_t::MITSUBISHI_AC, decode_type_t::MITSUBISHI112, decode_type_t::MITSUBISHI136, decode_type_t::MITSUBISHI_HEAVY_88, decode_type_t::MITSUBISHI_HEAVY_152, // mitsubishi
+  decode_type_t::NEOCLIMA, // neoclima
+  decode_type_t::PANASONIC_AC, decode_type_t::PANASONIC_AC32, // panasonic
+  decode_type_t::RHOSS, // rhoss
+  decode_type_t::SAMSUNG_AC, // samsung
+  decode_type_t::SANYO_AC, decode_type_t::SANYO_AC88, decode_type_t::SANYO_AC152, // sanyo
+  decode_type_t::SHARP_AC, // sharp
+  decode_type_t::TCL96AC, decode_type_t::TCL112AC, // tcl
+  decode_type_t::TECHNIBEL_AC, // technibel
+  decode_type_t::TECO, // teco
+  decode_type_t::TEKNOPOINT, // teknopoint
+  decode_type_t::TOSHIBA_AC, // toshiba
+  decode_type_t::TRANSCOLD, // transcold
+  decode_type_t::TROTEC, decode_type_t::TROTEC_3550, // trotec
+  decode_type_t::TRUMA, // truma
+  decode_type_t::VESTEL_AC, // vestel
+  decode_type_t::VOLTAS, // voltas
+  decode_type_t::WHIRLPOOL_AC, // whirlpool
+  decode_type_t::YORK, // york
 };
 
-const std::vector<BrandProtocol> brandProtocols = {
-  {"airton", {decode_type_t::AIRTON}},
-  {"airwell", {decode_type_t::AIRWELL}},
-  {"amcor", {decode_type_t::AMCOR}},
-  {"argo", {decode_type_t::ARGO}},
-  {"bosch", {decode_type_t::BOSCH144}},
-  {"carrier", {decode_type_t::CARRIER_AC, decode_type_t::CARRIER_AC40, decode_type_t::CARRIER_AC64, decode_type_t::CARRIER_AC84, decode_type_t::CARRIER_AC128}},
-  {"climabutler", {decode_type_t::CLIMABUTLER}},
-  {"coolix", {decode_type_t::COOLIX, decode_type_t::COOLIX48}},
-  {"corona", {decode_type_t::CORONA_AC}},
-  {"daikin", {decode_type_t::DAIKIN, decode_type_t::DAIKIN2, decode_type_t::DAIKIN64, decode_type_t::DAIKIN128, decode_type_t::DAIKIN152, decode_type_t::DAIKIN160, decode_type_t::DAIKIN176, decode_type_t::DAIKIN200, decode_type_t::DAIKIN216, decode_type_t::DAIKIN312}},
-  {"delonghi", {decode_type_t::DELONGHI_AC}},
-  {"ecoclim", {decode_type_t::ECOCLIM}},
-  {"electra", {decode_type_t::ELECTRA_AC}},
-  {"fujitsu", {decode_type_t::FUJITSU_AC}},
-  {"goodweather", {decode_type_t::GOODWEATHER}},
-  {"gorenje", {decode_type_t::GORENJE}},
-  {"gree", {decode_type_t::GREE}},
-  {"haier", {decode_type_t::HAIER_AC, decode_type_t::HAIER_AC_YRW02, decode_type_t::HAIER_AC160, decode_type_t::HAIER_AC176}},
-  {"hitachi", {decode_type_t::HITACHI_AC, decode_type_t::HITACHI_AC1, decode_type_t::HITACHI_AC2, decode_type_t::HITACHI_AC3, decode_type_t::HITACHI_AC264, decode_type_t::HITACHI_AC296, decode_type_t::HITACHI_AC344, decode_type_t::HITACHI_AC424}},
-  {"kelon", {decode_type_t::KELON, decode_type_t::KELON168}},
-  {"kelvinator", {decode_type_t::KELVINATOR}},
-  {"lg", {decode_type_t::LG}},
-  {"midea", {decode_type_t::MIDEA, decode_type_t::MIDEA24}},
-  {"mirage", {decode_type_t::MIRAGE}},
-  {"mitsubishi", {decode_type_t::MITSUBISHI_AC, decode_type_t::MITSUBISHI112, decode_type_t::MITSUBISHI136, decode_type_t::MITSUBISHI_HEAVY_88, decode_type_t::MITSUBISHI_HEAVY_152}},
-  {"neoclima", {decode_type_t::NEOCLIMA}},
-  {"panasonic", {decode_type_t::PANASONIC_AC, decode_type_t::PANASONIC_AC32}},
-  {"rhoss", {decode_type_t::RHOSS}},
-  {"samsung", {decode_type_t::SAMSUNG_AC}},
-  {"sanyo", {decode_type_t::SANYO_AC, decode_type_t::SANYO_AC88, decode_type_t::SANYO_AC152}},
-  {"sharp", {decode_type_t::SHARP_AC}},
-  {"tcl", {decode_type_t::TCL96AC, decode_type_t::TCL112AC}},
-  {"technibel", {decode_type_t::TECHNIBEL_AC}},
-  {"teco", {decode_type_t::TECO}},
-  {"teknopoint", {decode_type_t::TEKNOPOINT}},
-  {"toshiba", {decode_type_t::TOSHIBA_AC}},
-  {"transcold", {decode_type_t::TRANSCOLD}},
-  {"trotec", {decode_type_t::TROTEC, decode_type_t::TROTEC_3550}},
-  {"truma", {decode_type_t::TRUMA}},
-  {"vestel", {decode_type_t::VESTEL_AC}},
-  {"voltas", {decode_type_t::VOLTAS}},
-  {"whirlpool", {decode_type_t::WHIRLPOOL_AC}},
-  {"york", {decode_type_t::YORK}}
+constexpr BrandEntry brandTable[] PROGMEM = {
+  {"airton", 0, 1},
+  {"airwell", 1, 1},
+  {"amcor", 2, 1},
+  {"argo", 3, 1},
+  {"bosch", 4, 1},
+  {"carrier", 5, 5},
+  {"climabutler", 10, 1},
+  {"coolix", 11, 2},
+  {"corona", 13, 1},
+  {"daikin", 14, 10},
+  {"delonghi", 24, 1},
+  {"ecoclim", 25, 1},
+  {"electra", 26, 1},
+  {"fujitsu", 27, 1},
+  {"goodweather", 28, 1},
+  {"gorenje", 29, 1},
+  {"gree", 30, 1},
+  {"haier", 31, 4},
+  {"hitachi", 35, 8},
+  {"kelon", 43, 2},
+  {"kelvinator", 45, 1},
+  {"lg", 46, 1},
+  {"midea", 47, 2},
+  {"mirage", 49, 1},
+  {"mitsubishi", 50, 5},
+  {"neoclima", 55, 1},
+  {"panasonic", 56, 2},
+  {"rhoss", 58, 1},
+  {"samsung", 59, 1},
+  {"sanyo", 60, 3},
+  {"sharp", 63, 1},
+  {"tcl", 64, 2},
+  {"technibel", 66, 1},
+  {"teco", 67, 1},
+  {"teknopoint", 68, 1},
+  {"toshiba", 69, 1},
+  {"transcold", 70, 1},
+  {"trotec", 71, 2},
+  {"truma", 73, 1},
+  {"vestel", 74, 1},
+  {"voltas", 75, 1},
+  {"whirlpool", 76, 1},
+  {"york", 77, 1}
 };
 
+const size_t BRAND_COUNT = sizeof(brandTable) / sizeof(brandTable[0]);
+const size_t BRAND_PROTOCOL_COUNT = sizeof(brandProtocolList) / sizeof(brandProtocolList[0]);
+
+// Compile-time checks that keep the table searchable as brands are added
+constexpr bool brandNameLess(const char* a, const char* b) {
+  return (*a == *b) ? (*a != '\0' && brandNameLess(a + 1, b + 1)) : (*a < *b);
+}
+
+constexpr bool brandTableValid(size_t i = 0) {
+  return i + 1 >= BRAND_COUNT ||
+         (brandNameLess(brandTable[i].name, brandTable[i + 1].name) &&
+          brandTable[i].offset + brandTable[i].count == brandTable[i + 1].offset &&
+          brandTableValid(i + 1));
+}
+
+constexpr bool brandCountsFit(size_t i = 0) {
+  return i >= BRAND_COUNT || (brandTable[i].count <= ProtocolSearch::MAX_CANDIDATES && brandCountsFit(i + 1));
+}
+
+static_assert(brandTableValid(), "brandTable must be sorted by lowercase name with contiguous protocol runs");
+static_assert(brandTable[0].offset == 0 &&
+              brandTable[BRAND_COUNT - 1].offset + brandTable[BRAND_COUNT - 1].count == BRAND_PROTOCOL_COUNT,
+              "brandTable must cover brandProtocolList exactly");
+static_assert(brandCountsFit(), "Every brand must fit one protocol discovery search");
+
 // Global variables
 Config config;
-ACState acState;
+WiFiState wifiState = WiFiState::Idle;
+bool wifiEverConnected = false;
+bool normalModeStarted = false;
+bool wifiUseCache = false;
+unsigned long wifiAttemptStart = 0;
+WiFiCacheRecord wifiCache;
+ScanResult scanResults[WIFI_SCAN_MAX_RESULTS];
+size_t scanResultCount = 0;
+bool wifiScanStarted = false;
+unsigned long wifiScanTime = 0; // Start of the last scan, or completion of the last successful one
+WiFiEventHandler wifiGotIPHandler;
+WiFiEventHandler wifiDisconnectedHandler;
+volatile bool wifiGotIP = false;
+volatile bool wifiLostConnection = false;
+MQTTConnectState mqttConnectState = MQTTConnectState::Idle;
+ACChannel acChannels[AC_MAX_CHANNELS]; // The first config.channel_count are in use
+uint32_t commandReceivedAt = 0;
+// Command sequence numbers come from the optional {"seq":N,...} envelope; 0 means
+// unsequenced. Kept in RAM only, so the first sequenced command after boot is accepted.
+uint32_t lastCommandSequence = 0;
+unsigned long lastMetricsTime = 0;
+TelemetryBatch telemetryBatch;
+unsigned long lastBatchSample = 0;
+unsigned long batchStartedAt = 0;
+bool mqttOnline = false; // Connected at the last check, so a drop is counted once
+unsigned long mqttConnectedAt = 0;
+char pageBuffer[PAGE_CHUNK_SIZE]; // Pending bytes of the page being streamed
+size_t pageLength = 0;
+char metricsBuffer[PUBLISH_PAYLOAD_SIZE];
+StaticJsonDocument<JSON_ARENA_SIZE> jsonArena; // Only used through jsonScratch()
+PublishQueue publishQueue;
+ScheduleTable schedule = {};
+bool timeConfigured = false;
+time_t lastScheduleMinute = 0; // Last minute (epoch / 60) whose rules were run
+OtaUpdater otaUpdater;
+uint8_t otaReportedProgress = 0;
+uint8_t otaReportedRetries = 0;
+uint8_t pendingSnapshots = 0; // SNAPSHOT_* bits waiting for a connection
+char publishPayload[PUBLISH_PAYLOAD_SIZE]; // Scratch for the message being drained or spilled
+unsigned long lastPublishDrain = 0;
+size_t spoolReadOffset = 0; // Bytes of the spool file already published
 bool isAPMode = false;
 unsigned long lastTelemetryTime = 0;
-bool testingProtocol = false;
-size_t currentProtocolIndex = 0;
-std::vector<decode_type_t> protocolsToTest;
+uint8_t localAuthFailures = 0;
+unsigned long localAuthLockedAt = 0;
+bool restartPending = false; // Set once a channel change is saved
+unsigned long restartRequestedAt = 0;
+// A channels command is only persisted: the emitters are created at boot, so
+// the layout in use stays unchanged until the reboot
+uint8_t stagedChannelCount = 0; // 0 when nothing is staged
+ChannelConfig stagedChannels[AC_MAX_CHANNELS - 1] = {};
+BrandEntry testBrand = {}; // Brand being provisioned, copied out of flash
+ProtocolSearch protocolSearch;
+bool discoveryActive = false;
+size_t discoverySweepIndex = 0; // Next candidate of the current group to fire
+unsigned long discoveryFrameTime = 0;
+unsigned long lastActivityTime = 0; // Last MQTT message, for POWER_AWAKE_HOLD
 unsigned long lastReconnectAttempt = 0;
-unsigned long reconnectDelay = RECONNECT_INTERVAL;
+unsigned long reconnectDelay = 0;
+ReconnectBackoff reconnectBackoff(RECONNECT_INTERVAL, MAX_RECONNECT_INTERVAL);
+TopicTable topics;
 
 // Function prototypes
 void loadConfig();
 void saveConfig();
-void loadACState();
-void saveACState();
+void setupChannels();
+bool anyPendingCommand();
+void stateJournalPath(uint8_t channel, char* path, size_t size);
+void loadACState(uint8_t channel);
+void saveACState(uint8_t channel);
+void flushACState(uint8_t channel);
+bool loadLegacyACState();
+bool loadBootImage();
+void saveBootImage();
+void clearBootImage();
+bool copyBootField(char* field, size_t size, const String& value);
 void enterAPMode();
 void handleWiFiSetupPage();
+void handleWiFiScanList();
+void startWiFiScan();
+void handleWiFiScan();
+void storeScanResults(int count);
+size_t jsonEscape(const char* input, char* output, size_t size);
+JsonDocument& jsonScratch();
 void handleWiFiSubmit();
 void handleConfigPage();
 void handleConfigSubmit();
 void handleTestProtocol();
 void handleTestResult();
 void connectToWiFi();
+void beginWiFiAttempt();
+void handleWiFi();
+bool loadWiFiCache();
+void saveWiFiCache();
 void startNormalWebServer();
+void applyPowerMode();
+void handlePowerIdle();
 void handleNormalPage();
+void startMDNS();
+bool authorizeLocalRequest();
+void handleLocalCommand(CommandType command);
+void handleLocalState();
 void handleReset();
 void connectToMQTT();
+void applyBackpressureHint(char* payload, size_t length);
+void handleMQTTConnect();
+bool loadTLSSession();
+void saveTLSSession();
 void publishStatus();
 void publishTelemetry();
-void publishError(const String& errorType, const String& errorMessage);
+void publishStateTelemetry(uint8_t channel);
+void publishHeartbeat();
+void publishMetrics();
+void handleTelemetryBatch();
+void handleMetrics();
+void beginPage(const char* contentType = "text/html");
+void pageWrite_P(PGM_P text);
+void pageWritef(PGM_P format, ...);
+void pageFlush();
+void endPage();
+void publishError(const char* errorType, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void enqueuePublish(PublishTopic topic, const char* payload, uint8_t flags);
+void serviceOutbox();
+size_t drainPublishQueue(size_t budget);
+bool sendSnapshot(uint8_t snapshot);
+bool sendSpooledMessage();
+void spoolMessage(const PublishQueue::Header& header, const char* payload);
+const char* publishTopicName(PublishTopic topic);
 void mqttCallback(char* topic, byte* payload, unsigned int length);
-void sendIRSignal(const String& command, const String& value);
-void performOTAUpdate(const String& url, const String& newVersion);
-String getMACAddress();
-bool validateZoneID(const String& customerId, const String& zoneId);
-bool registerDevice();
+bool buildTopicTable();
+bool sendIRSignal(uint8_t channel, CommandType command, const char* value, size_t length, uint32_t sequence);
+bool applyStateCommand(uint8_t channel, char* payload, size_t length, bool group);
+void applyGroupStateCommand(char* payload, size_t length);
+void applyChannelsCommand(char* payload, size_t length);
+void applyLocalApiCommand(char* payload, size_t length);
+bool parseChannelConfig(JsonObjectConst object, ChannelConfig& channel);
+void applyScheduleCommand(char* payload, size_t length, bool group);
+bool parseScheduleRule(JsonObjectConst object, ScheduleRule& rule);
+void loadSchedule();
+void saveSchedule();
+void configureTime();
+void handleSchedule();
+void runScheduleMinute(time_t minute);
+void runScheduleRule(const ScheduleRule& rule);
+bool acceptCommandSequence(uint8_t channel, uint32_t sequence);
+void publishCommandAck(uint8_t channel, uint32_t sequence, const char* result);
+bool transmitACState(uint8_t channel, const ACState& next);
+bool flushPendingCommand(uint8_t channel);
+void startOTAUpdate(const String& url, const String& newVersion);
+void handleOTAUpdate();
+void publishOTAStatus(const char* state, const String& version);
+void getMACAddress(char* output, size_t size);
+bool serializeApiRequest(const JsonDocument& doc, char* payload, size_t size);
+bool validateZoneID(const String& customerId, const String& zoneId, int16_t& protocolHint);
+bool registerDevice(int& httpCode);
+bool registerAndSaveConfig(int& httpCode);
+bool prepareApiRequest(const char* action);
+void reportApiClientError(int httpCode);
 decode_type_t getProtocolFromString(const String& protocolStr);
-void testNextProtocol();
+bool startDiscovery(int16_t hint);
+void startDiscoverySweep();
+void handleDiscovery();
+void sendTestFrame(decode_type_t protocol);
+void sendDiscoveryFailedPage();
 String generateUniqueSSID();
+bool findBrand(const char* name, BrandEntry& entry);
+void readBrand(size_t index, BrandEntry& entry);
+decode_type_t brandProtocol(const BrandEntry& entry, size_t index);
 
 void setup() {
   Serial.begin(115200);
   while (!Serial) delay(10);
-  Serial.println("[SETUP] Starting ESP8266 AC Control...");
+  LOG_INFO("SETUP", "Starting ESP8266 AC Control...");
+
+  // Read the binary boot image before LittleFS is touched
+  bool fastBoot = loadBootImage();
 
   if (!LittleFS.begin()) {
-    Serial.println("[SETUP] Failed to mount LittleFS");
+    LOG_ERROR("SETUP", "Failed to mount LittleFS");
     return;
   }
-  Serial.println("[SETUP] LittleFS mounted successfully");
+  LOG_INFO("SETUP", "LittleFS mounted successfully");
+
+  if (loadTLSSession()) {
+    LOG_INFO("SETUP", "Restored TLS session from RTC memory");
+  }
 
   // Set MQTT buffer size
   mqttClient.setBufferSize(MQTT_BUFFER_SIZE);
-  Serial.println("[SETUP] MQTT buffer size set to " + String(MQTT_BUFFER_SIZE) + " bytes");
+  LOG_DEBUG("SETUP", "MQTT buffer size set to %d bytes", MQTT_BUFFER_SIZE);
 
-  loadConfig();
-  loadACState();
+  if (!fastBoot) {
+    loadConfig();
+  }
+  setupChannels();
+  for (uint8_t i = 0; i < config.channel_count; i++) {
+    loadACState(i);
+  }
+  loadSchedule();
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  reconnectBackoff.seed(mac, sizeof(mac));
+  batchStartedAt = millis();
+  telemetryBatch.begin(batchStartedAt / 1000);
+  uint16_t keepAlive = config.power_mode == PowerMode::Normal ? MQTT_KEEPALIVE : MQTT_SLEEP_KEEPALIVE;
+  mqttClient.setKeepAlive(keepAlive);
+  reconnectBackoff.setStableTime(MQTT_STABLE_KEEPALIVES * keepAlive * 1000);
+  if (!fastBoot && !config.wifi_ssid.isEmpty()) {
+    // Migrate the JSON configuration so the next boot takes the fast path
+    saveBootImage();
+  }
 
   if (config.wifi_ssid.isEmpty()) {
-    Serial.println("[SETUP] No Wi-Fi config found, entering AP mode");
+    LOG_INFO("SETUP", "No Wi-Fi config found, entering AP mode");
     enterAPMode();
   } else {
-    Serial.println("[SETUP] Attempting to connect to Wi-Fi: " + config.wifi_ssid);
+    // loop() starts normal operation once the first association succeeds
+    LOG_INFO("SETUP", "Attempting to connect to Wi-Fi: %s", config.wifi_ssid.c_str());
     connectToWiFi();
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("[SETUP] Wi-Fi connected, starting normal operation");
-      startNormalWebServer();
-      connectToMQTT();
-    } else {
-      Serial.println("[SETUP] Wi-Fi connection failed, entering AP mode");
-      enterAPMode();
-    }
   }
 }
 
 void loop() {
+  metricsLoopTick();
   if (isAPMode) {
     dnsServer.processNextRequest();
     server.handleClient();
+    handleWiFi();
+    handleWiFiScan();
+    if (wifiState == WiFiState::Connected) {
+      LOG_INFO("LOOP", "Wi-Fi setup complete, rebooting...");
+      delay(1000);
+      ESP.restart();
+    } else if (wifiState == WiFiState::Failed) {
+      // Stay in the portal so the installer can pick another network
+      LOG_ERROR("LOOP", "Wi-Fi setup failed, staying in AP mode");
+      WiFi.disconnect();
+      wifiState = WiFiState::Idle;
+    }
   } else {
     server.handleClient();
-    if (WiFi.status() != WL_CONNECTED) {
-      Serial.println("[LOOP] Wi-Fi disconnected, attempting to reconnect");
-      connectToWiFi();
+    if (normalModeStarted) {
+      MDNS.update();
     }
-    if (WiFi.status() == WL_CONNECTED) {
-      if (!mqttClient.connected()) {
+    handleDiscovery();
+    handleWiFi();
+    if (wifiState == WiFiState::Failed && !wifiEverConnected) {
+      LOG_ERROR("LOOP", "Wi-Fi connection failed, entering AP mode");
+      WiFi.disconnect();
+      wifiState = WiFiState::Idle;
+      enterAPMode();
+      return;
+    }
+    if (wifiState == WiFiState::Connected && !normalModeStarted) {
+      LOG_INFO("LOOP", "Wi-Fi connected, starting normal operation");
+      normalModeStarted = true;
+      startNormalWebServer();
+      configureTime();
+      // After a site power loss every unit gets here together
+      bool powerOn = ESP.getResetInfoPtr()->reason == REASON_DEFAULT_RST;
+      lastReconnectAttempt = millis();
+      reconnectDelay = reconnectBackoff.initialDelay(powerOn ? MQTT_STARTUP_SPREAD : MQTT_RESTART_SPREAD);
+      LOG_INFO("LOOP", "First MQTT connect in %lu ms", reconnectDelay);
+    }
+    if (wifiState == WiFiState::Connected) {
+      if (mqttConnectState != MQTTConnectState::Idle) {
+        handleMQTTConnect();
+      } else if (!mqttClient.connected()) {
         unsigned long currentTime = millis();
+        if (mqttOnline) {
+          mqttOnline = false;
+          telemetryBatch.recordMqttDrop();
+          // A broker outage drops the whole fleet at once, so even the first retry waits
+          lastReconnectAttempt = currentTime;
+          reconnectDelay = reconnectBackoff.next();
+          LOG_INFO("LOOP", "MQTT disconnected, reconnecting in %lu ms", reconnectDelay);
+        }
         if (currentTime - lastReconnectAttempt >= reconnectDelay) {
           lastReconnectAttempt = currentTime;
-          Serial.println("[LOOP] MQTT disconnected, attempting to reconnect");
+          LOG_INFO("LOOP", "Attempting to connect to MQTT");
           connectToMQTT();
-          reconnectDelay = min(reconnectDelay * 2, MAX_RECONNECT_INTERVAL);
+          reconnectDelay = reconnectBackoff.next();
         }
       } else {
         mqttClient.loop();
-        reconnectDelay = RECONNECT_INTERVAL;
+        if (!mqttOnline) {
+          mqttOnline = true;
+          mqttConnectedAt = millis();
+        }
+        reconnectBackoff.connectedFor(millis() - mqttConnectedAt);
+      }
+    }
+
+    for (uint8_t i = 0; i < config.channel_count; i++) {
+      if (acChannels[i].hasPendingState && millis() - acChannels[i].pendingSince >= COMMAND_COALESCE_WINDOW) {
+        flushPendingCommand(i);
+      }
+    }
+
+    handleSchedule();
+    handleOTAUpdate();
+    serviceOutbox();
+
+    for (uint8_t i = 0; i < config.channel_count; i++) {
+      if (acChannels[i].stateDirty && millis() - acChannels[i].stateChangedAt >= STATE_FLUSH_DELAY) {
+        flushACState(i);
+      }
+    }
+
+    if (restartPending && millis() - restartRequestedAt >= CONFIG_RESTART_DELAY) {
+      LOG_INFO("LOOP", "Rebooting to apply the new channel configuration");
+      for (uint8_t i = 0; i < config.channel_count; i++) {
+        flushACState(i);
       }
+      ESP.restart();
     }
 
     unsigned long currentTime = millis();
-    if (currentTime - lastTelemetryTime >= TELEMETRY_INTERVAL && mqttClient.connected()) {
+    unsigned long telemetryInterval = config.telemetry_on_change ? config.heartbeat_interval : TELEMETRY_INTERVAL;
+    if (currentTime - lastTelemetryTime >= telemetryInterval && mqttClient.connected()) {
       lastTelemetryTime = currentTime;
-      Serial.println("[LOOP] Publishing periodic telemetry");
-      publishTelemetry();
+      if (config.telemetry_on_change) {
+        publishHeartbeat();
+      } else {
+        LOG_INFO("LOOP", "Publishing periodic telemetry");
+        publishTelemetry();
+      }
+    }
+
+    if (currentTime - lastMetricsTime >= METRICS_INTERVAL && mqttClient.connected()) {
+      lastMetricsTime = currentTime;
+      publishMetrics();
     }
+    handleTelemetryBatch();
+
+    handlePowerIdle();
   }
 }
 
@@ -222,16 +811,16 @@ String generateUniqueSSID() {
   mac.replace(":", "");
   String uniquePart = mac.substring(mac.length() - 6);
   String ssid = "AC_Control_" + uniquePart;
-  Serial.println("[SSID] Generated unique SSID: " + ssid);
+  LOG_INFO("SSID", "Generated unique SSID: %s", ssid.c_str());
   return ssid;
 }
 
 void loadConfig() {
-  Serial.println("[CONFIG] Loading configuration from " + String(CONFIG_FILE));
+  LOG_INFO("CONFIG", "Loading configuration from %s", CONFIG_FILE);
   if (LittleFS.exists(CONFIG_FILE)) {
     File file = LittleFS.open(CONFIG_FILE, "r");
     if (file) {
-      StaticJsonDocument<512> doc;
+      JsonDocument& doc = jsonScratch();
       DeserializationError error = deserializeJson(doc, file);
       if (!error) {
         config.wifi_ssid = doc["wifi_ssid"] | "";
@@ -240,190 +829,489 @@ void loadConfig() {
         config.zone_id = doc["zone_id"] | "";
         config.ac_brand = doc["ac_brand"] | "";
         config.ac_protocol = doc["ac_protocol"] | "";
+        config.ac_model = doc["ac_model"] | 1;
+        config.channel_count = 1;
+        for (JsonObjectConst channel : doc["channels"].as<JsonArrayConst>()) {
+          if (config.channel_count < AC_MAX_CHANNELS &&
+              parseChannelConfig(channel, config.extra_channels[config.channel_count - 1])) {
+            config.channel_count++;
+          } else {
+            LOG_ERROR("CONFIG", "Ignoring invalid or surplus AC channel");
+          }
+        }
         config.firmware_version = doc["firmware_version"] | FIRMWARE_VERSION;
-        Serial.println("[CONFIG] Configuration loaded: SSID=" + config.wifi_ssid + ", CustomerID=" + config.customer_id);
+        config.local_token = doc["local_token"] | "";
+        config.telemetry_on_change = doc["telemetry_on_change"] | true;
+        config.heartbeat_interval = doc["heartbeat_interval"] | HEARTBEAT_INTERVAL;
+        const char* powerMode = doc["power_mode"] | "normal";
+        size_t powerIndex = enumNameIndex(powerModeNames, powerMode, strlen(powerMode));
+        config.power_mode = powerIndex < sizeof(powerModeNames) / sizeof(powerModeNames[0]) ? powerModeNames[powerIndex].value : PowerMode::Normal;
+        LOG_INFO("CONFIG", "Configuration loaded: SSID=%s, CustomerID=%s", config.wifi_ssid.c_str(), config.customer_id.c_str());
       } else {
-        Serial.println("[CONFIG] Failed to parse config file: " + String(error.c_str()));
+        LOG_ERROR("CONFIG", "Failed to parse config file: %s", error.c_str());
       }
       file.close();
     } else {
-      Serial.println("[CONFIG] Failed to open config file");
+      LOG_ERROR("CONFIG", "Failed to open config file");
     }
   } else {
-    Serial.println("[CONFIG] Config file does not exist");
+    LOG_WARN("CONFIG", "Config file does not exist");
   }
 }
 
 void saveConfig() {
-  Serial.println("[CONFIG] Saving configuration to " + String(CONFIG_FILE));
+  LOG_INFO("CONFIG", "Saving configuration to %s", CONFIG_FILE);
   File file = LittleFS.open(CONFIG_FILE, "w");
   if (file) {
-    StaticJsonDocument<512> doc;
+    JsonDocument& doc = jsonScratch();
     doc["wifi_ssid"] = config.wifi_ssid;
     doc["wifi_password"] = config.wifi_password;
     doc["customer_id"] = config.customer_id;
     doc["zone_id"] = config.zone_id;
     doc["ac_brand"] = config.ac_brand;
     doc["ac_protocol"] = config.ac_protocol;
+    doc["ac_model"] = config.ac_model;
+    uint8_t channelCount = stagedChannelCount ? stagedChannelCount : config.channel_count;
+    const ChannelConfig* extraChannels = stagedChannelCount ? stagedChannels : config.extra_channels;
+    JsonArray channels = doc.createNestedArray("channels");
+    for (uint8_t i = 1; i < channelCount; i++) {
+      JsonObject channel = channels.createNestedObject();
+      channel["pin"] = extraChannels[i - 1].pin;
+      channel["protocol"] = extraChannels[i - 1].protocol;
+      channel["model"] = extraChannels[i - 1].model;
+    }
     doc["firmware_version"] = config.firmware_version;
+    doc["local_token"] = config.local_token;
+    doc["telemetry_on_change"] = config.telemetry_on_change;
+    doc["heartbeat_interval"] = config.heartbeat_interval;
+    doc["power_mode"] = enumName(powerModeNames, config.power_mode, "normal");
     if (serializeJson(doc, file) == 0) {
-      Serial.println("[CONFIG] Failed to write config file");
+      LOG_ERROR("CONFIG", "Failed to write config file");
     } else {
-      Serial.println("[CONFIG] Configuration saved successfully");
+      LOG_INFO("CONFIG", "Configuration saved successfully");
     }
     file.close();
   } else {
-    Serial.println("[CONFIG] Failed to open config file for writing");
+    LOG_ERROR("CONFIG", "Failed to open config file for writing");
   }
+  saveBootImage();
 }
 
-void loadACState() {
-  Serial.println("[AC_STATE] Loading AC state from " + String(AC_STATE_FILE));
-  if (LittleFS.exists(AC_STATE_FILE)) {
-    File file = LittleFS.open(AC_STATE_FILE, "r");
-    if (file) {
-      StaticJsonDocument<256> doc;
-      DeserializationError error = deserializeJson(doc, file);
-      if (!error) {
-        acState.power = doc["power"] | false;
-        String modeStr = doc["mode"] | "cool";
-        if (modeStr == "auto") acState.mode = stdAc::opmode_t::kAuto;
-        else if (modeStr == "cool") acState.mode = stdAc::opmode_t::kCool;
-        else if (modeStr == "heat") acState.mode = stdAc::opmode_t::kHeat;
-        else if (modeStr == "dry") acState.mode = stdAc::opmode_t::kDry;
-        else if (modeStr == "fan") acState.mode = stdAc::opmode_t::kFan;
-        acState.degrees = doc["degrees"] | 25;
-        String fanStr = doc["fanspeed"] | "medium";
-        if (fanStr == "auto") acState.fanspeed = stdAc::fanspeed_t::kAuto;
-        else if (fanStr == "min") acState.fanspeed = stdAc::fanspeed_t::kMin;
-        else if (fanStr == "medium") acState.fanspeed = stdAc::fanspeed_t::kMedium;
-        else if (fanStr == "max") acState.fanspeed = stdAc::fanspeed_t::kMax;
-        Serial.println("[AC_STATE] AC state loaded: Power=" + String(acState.power) + ", Mode=" + modeStr + ", Temp=" + String(acState.degrees));
-      } else {
-        Serial.println("[AC_STATE] Failed to parse AC state file: " + String(error.c_str()));
-      }
-      file.close();
-    } else {
-      Serial.println("[AC_STATE] Failed to open AC state file");
+bool loadBootImage() {
+  BootImage image;
+  EEPROM.begin(sizeof(BootImage));
+  EEPROM.get(0, image);
+  EEPROM.end();
+
+  if (image.magic != BOOT_IMAGE_MAGIC || image.version != BOOT_IMAGE_VERSION || image.length != sizeof(BootImage)) {
+    LOG_WARN("CONFIG", "No usable boot image, falling back to %s", CONFIG_FILE);
+    return false;
+  }
+  if (image.crc != crc32((const uint8_t*)&image, offsetof(BootImage, crc))) {
+    LOG_ERROR("CONFIG", "Boot image CRC mismatch, falling back to %s", CONFIG_FILE);
+    return false;
+  }
+
+  config.wifi_ssid = image.wifi_ssid;
+  config.wifi_password = image.wifi_password;
+  config.customer_id = image.customer_id;
+  config.zone_id = image.zone_id;
+  config.ac_brand = image.ac_brand;
+  config.ac_protocol = image.ac_protocol;
+  config.firmware_version = image.firmware_version;
+  config.local_token = image.local_token;
+  config.telemetry_on_change = image.telemetry_on_change != 0;
+  config.heartbeat_interval = image.heartbeat_interval;
+  config.power_mode = image.power_mode <= (uint8_t)PowerMode::LightSleep ? (PowerMode)image.power_mode : PowerMode::Normal;
+  config.ac_model = image.ac_model;
+  config.channel_count = image.channel_count >= 1 && image.channel_count <= AC_MAX_CHANNELS ? image.channel_count : 1;
+  memcpy(config.extra_channels, image.extra_channels, sizeof(config.extra_channels));
+  ACState state;
+  if (decodeStateRecord(image.state, state)) {
+    acChannels[0].state = state;
+    acChannels[0].stateSequence = image.state.sequence;
+  }
+  LOG_INFO("CONFIG", "Configuration loaded from boot image: SSID=%s, CustomerID=%s", config.wifi_ssid.c_str(), config.customer_id.c_str());
+  return true;
+}
+
+void saveBootImage() {
+  BootImage image = {};
+  image.magic = BOOT_IMAGE_MAGIC;
+  image.version = BOOT_IMAGE_VERSION;
+  image.length = sizeof(BootImage);
+  bool fits = copyBootField(image.wifi_ssid, sizeof(image.wifi_ssid), config.wifi_ssid) &&
+              copyBootField(image.wifi_password, sizeof(image.wifi_password), config.wifi_password) &&
+              copyBootField(image.customer_id, sizeof(image.customer_id), config.customer_id) &&
+              copyBootField(image.zone_id, sizeof(image.zone_id), config.zone_id) &&
+              copyBootField(image.ac_brand, sizeof(image.ac_brand), config.ac_brand) &&
+              copyBootField(image.ac_protocol, sizeof(image.ac_protocol), config.ac_protocol) &&
+              copyBootField(image.firmware_version, sizeof(image.firmware_version), config.firmware_version) &&
+              copyBootField(image.local_token, sizeof(image.local_token), config.local_token);
+  if (!fits) {
+    // The JSON file stays authoritative for values that do not fit the image
+    LOG_ERROR("CONFIG", "Configuration too large for boot image, clearing it");
+    clearBootImage();
+    return;
+  }
+  image.telemetry_on_change = config.telemetry_on_change ? 1 : 0;
+  image.heartbeat_interval = config.heartbeat_interval;
+  image.power_mode = (uint8_t)config.power_mode;
+  image.ac_model = config.ac_model;
+  image.channel_count = stagedChannelCount ? stagedChannelCount : config.channel_count;
+  memcpy(image.extra_channels, stagedChannelCount ? stagedChannels : config.extra_channels, sizeof(image.extra_channels));
+  encodeStateRecord(acChannels[0].state, acChannels[0].stateSequence, image.state);
+  image.crc = crc32((const uint8_t*)&image, offsetof(BootImage, crc));
+
+  EEPROM.begin(sizeof(BootImage));
+  EEPROM.put(0, image);
+  if (EEPROM.commit()) {
+    LOG_INFO("CONFIG", "Boot image saved");
+  } else {
+    LOG_ERROR("CONFIG", "Failed to write boot image");
+  }
+  EEPROM.end();
+}
+
+void clearBootImage() {
+  EEPROM.begin(sizeof(BootImage));
+  EEPROM.put(0, (uint32_t)0);
+  EEPROM.commit();
+  EEPROM.end();
+}
+
+bool copyBootField(char* field, size_t size, const String& value) {
+  if (value.length() >= size) {
+    return false;
+  }
+  memcpy(field, value.c_str(), value.length() + 1);
+  return true;
+}
+
+// Channel 0 drives the global IRac that discovery also uses; the others get
+// their own instance on their configured pin
+void setupChannels() {
+  acChannels[0].ir = &ac;
+  for (uint8_t i = 1; i < config.channel_count; i++) {
+    const ChannelConfig& channel = config.extra_channels[i - 1];
+    acChannels[i].ir = new IRac(channel.pin);
+    LOG_INFO("AC_STATE", "AC channel %u: GPIO%u, protocol %d, model %d", (unsigned)i, (unsigned)channel.pin, channel.protocol, channel.model);
+  }
+}
+
+bool anyPendingCommand() {
+  for (uint8_t i = 0; i < config.channel_count; i++) {
+    if (acChannels[i].hasPendingState) {
+      return true;
     }
+  }
+  return false;
+}
+
+void stateJournalPath(uint8_t channel, char* path, size_t size) {
+  if (channel == 0) {
+    strlcpy(path, AC_STATE_JOURNAL_FILE, size);
   } else {
-    Serial.println("[AC_STATE] AC state file does not exist");
+    snprintf(path, size, AC_CHANNEL_JOURNAL_FORMAT, (unsigned)channel);
   }
 }
 
-void saveACState() {
-  Serial.println("[AC_STATE] Saving AC state to " + String(AC_STATE_FILE));
-  File file = LittleFS.open(AC_STATE_FILE, "w");
+// Only channel 0 has an RTC record: the TLS session takes the rest of RTC
+// user memory, so the other channels restore from their flash journals
+void loadACState(uint8_t channel) {
+  ACChannel& unit = acChannels[channel];
+  char path[24];
+  stateJournalPath(channel, path, sizeof(path));
+  LOG_INFO("AC_STATE", "Loading AC state for channel %u from %s%s", (unsigned)channel, channel == 0 ? "RTC memory and " : "", path);
+  ACStateRecord record;
+  ACState state;
+  // A state snapshot from the boot image, if any, is the baseline to beat
+  bool found = unit.stateSequence != 0;
+  uint32_t newestSequence = unit.stateSequence;
+
+  // RTC memory survives a soft reboot and may hold a record not yet flushed to flash
+  if (channel == 0 && ESP.rtcUserMemoryRead(RTC_STATE_OFFSET, (uint32_t*)&record, sizeof(record)) && decodeStateRecord(record, state)) {
+    unit.state = state;
+    newestSequence = record.sequence;
+    found = true;
+    LOG_DEBUG("AC_STATE", "Found RTC state record, sequence %u", (unsigned)record.sequence);
+  }
+
+  File file = LittleFS.open(path, "r");
   if (file) {
-    StaticJsonDocument<256> doc;
-    doc["power"] = acState.power;
-    switch (acState.mode) {
-      case stdAc::opmode_t::kAuto: doc["mode"] = "auto"; break;
-      case stdAc::opmode_t::kCool: doc["mode"] = "cool"; break;
-      case stdAc::opmode_t::kHeat: doc["mode"] = "heat"; break;
-      case stdAc::opmode_t::kDry: doc["mode"] = "dry"; break;
-      case stdAc::opmode_t::kFan: doc["mode"] = "fan"; break;
-      default: doc["mode"] = "cool";
-    }
-    doc["degrees"] = acState.degrees;
-    switch (acState.fanspeed) {
-      case stdAc::fanspeed_t::kAuto: doc["fanspeed"] = "auto"; break;
-      case stdAc::fanspeed_t::kMin: doc["fanspeed"] = "min"; break;
-      case stdAc::fanspeed_t::kMedium: doc["fanspeed"] = "medium"; break;
-      case stdAc::fanspeed_t::kMax: doc["fanspeed"] = "max"; break;
-      default: doc["fanspeed"] = "medium";
-    }
-    String payload;
-    serializeJson(doc, payload);
-    Serial.println("[AC_STATE] Saving payload: " + payload);
-    if (serializeJson(doc, file) == 0) {
-      Serial.println("[AC_STATE] Failed to write AC state file");
-    } else {
-      Serial.println("[AC_STATE] AC state saved successfully");
+    while (file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+      if (decodeStateRecord(record, state) && (!found || record.sequence > newestSequence)) {
+        unit.state = state;
+        newestSequence = record.sequence;
+        found = true;
+      }
     }
     file.close();
+  }
+
+  if (found) {
+    unit.stateSequence = newestSequence;
+    LOG_INFO("AC_STATE", "AC state loaded: Channel=%u, Sequence=%u, Power=%d, Mode=%d, Temp=%d", (unsigned)channel,
+             (unsigned)unit.stateSequence, unit.state.power, (int)unit.state.mode, unit.state.degrees);
+  } else if (channel == 0 && loadLegacyACState()) {
+    // Move the legacy state into the journal so the JSON file is read only once
+    saveACState(0);
+    flushACState(0);
+    LittleFS.remove(AC_STATE_FILE);
+  } else {
+    LOG_WARN("AC_STATE", "No saved AC state found for channel %u, using defaults", (unsigned)channel);
+  }
+}
+
+void saveACState(uint8_t channel) {
+  ACChannel& unit = acChannels[channel];
+  ACStateRecord record;
+  encodeStateRecord(unit.state, ++unit.stateSequence, record);
+  if (channel == 0 && !ESP.rtcUserMemoryWrite(RTC_STATE_OFFSET, (uint32_t*)&record, sizeof(record))) {
+    LOG_ERROR("AC_STATE", "Failed to write AC state to RTC memory");
+  }
+  // Flash is written lazily once commands have been quiet for STATE_FLUSH_DELAY
+  unit.stateDirty = true;
+  unit.stateChangedAt = millis();
+}
+
+void flushACState(uint8_t channel) {
+  ACChannel& unit = acChannels[channel];
+  if (!unit.stateDirty) {
+    return;
+  }
+  unit.stateDirty = false;
+  ACStateRecord record;
+  encodeStateRecord(unit.state, unit.stateSequence, record);
+
+  char path[24];
+  stateJournalPath(channel, path, sizeof(path));
+  File file = LittleFS.open(path, LittleFS.exists(path) ? "r+" : "w+");
+  if (!file) {
+    LOG_ERROR("AC_STATE", "Failed to open AC state journal %s for writing", path);
+    return;
+  }
+  // Rotate through the ring so consecutive writes land on different slots
+  size_t offset = (unit.stateSequence % STATE_JOURNAL_SLOTS) * sizeof(record);
+  size_t size = file.size() - file.size() % sizeof(record);
+  if (offset > size) {
+    offset = size;
+  }
+  if (!file.seek(offset, SeekSet) || file.write((const uint8_t*)&record, sizeof(record)) != sizeof(record)) {
+    LOG_ERROR("AC_STATE", "Failed to write AC state journal %s", path);
   } else {
-    Serial.println("[AC_STATE] Failed to open AC state file for writing");
+    LOG_INFO("AC_STATE", "AC state flushed to %s, sequence %u", path, (unsigned)unit.stateSequence);
+  }
+  file.close();
+}
+
+bool loadLegacyACState() {
+  if (!LittleFS.exists(AC_STATE_FILE)) {
+    return false;
+  }
+  LOG_INFO("AC_STATE", "Migrating legacy AC state from %s", AC_STATE_FILE);
+  File file = LittleFS.open(AC_STATE_FILE, "r");
+  if (!file) {
+    LOG_ERROR("AC_STATE", "Failed to open AC state file");
+    return false;
   }
+  JsonDocument& doc = jsonScratch();
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  if (error) {
+    LOG_ERROR("AC_STATE", "Failed to parse AC state file: %s", error.c_str());
+    return false;
+  }
+  // The file predates channels, so it belongs to channel 0
+  ACState& state = acChannels[0].state;
+  // Unknown names keep the defaults; the file wrote fan speeds as min/max, which the codec still accepts
+  state.power = doc["power"] | false;
+  const char* mode = doc["mode"] | "cool";
+  parseModeValue(mode, strlen(mode), state.mode);
+  state.degrees = doc["degrees"] | 25;
+  const char* fanspeed = doc["fanspeed"] | "medium";
+  parseFanSpeedValue(fanspeed, strlen(fanspeed), state.fanspeed);
+  LOG_INFO("AC_STATE", "AC state loaded: Power=%d, Mode=%s, Temp=%d", state.power, modeName(state.mode), state.degrees);
+  return true;
 }
 
 void enterAPMode() {
   isAPMode = true;
   String apSSID = generateUniqueSSID();
   WiFi.softAP(apSSID.c_str(), AP_PASSWORD);
-  Serial.println("[AP_MODE] Started AP Mode. SSID: " + apSSID + ", IP: " + WiFi.softAPIP().toString());
+  LOG_INFO("AP_MODE", "Started AP Mode. SSID: %s, IP: %s", apSSID.c_str(), WiFi.softAPIP().toString().c_str());
 
   dnsServer.start(53, "*", WiFi.softAPIP());
+  startWiFiScan();
 
   server.on("/", HTTP_GET, handleWiFiSetupPage);
+  server.on("/scan", HTTP_GET, handleWiFiScanList);
   server.on("/submit", HTTP_POST, handleWiFiSubmit);
   server.onNotFound([]() {
-    Serial.println("[WEB_SERVER] Redirecting unknown request to /");
+    LOG_DEBUG("WEB_SERVER", "Redirecting unknown request to /");
     server.sendHeader("Location", "/", true);
     server.send(302, "text/plain", "");
   });
 
   server.begin();
-  Serial.println("[AP_MODE] Web server started in AP mode");
+  LOG_INFO("AP_MODE", "Web server started in AP mode");
 }
 
 void handleWiFiSetupPage() {
-  Serial.println("[WEB_SERVER] Serving Wi-Fi setup page");
-  String html = "<html><body><h1>Wi-Fi Setup</h1><form action='/submit' method='POST'>";
-  html += "<label>Wi-Fi SSID:</label><select name='ssid'>";
-  int n = WiFi.scanNetworks();
-  Serial.println("[WEB_SERVER] Found " + String(n) + " Wi-Fi networks");
-  for (int i = 0; i < n; ++i) {
-    html += "<option value='" + WiFi.SSID(i) + "'>" + WiFi.SSID(i) + "</option>";
+  LOG_DEBUG("WEB_SERVER", "Serving Wi-Fi setup page with %u cached networks", (unsigned)scanResultCount);
+  beginPage();
+  pageWrite_P(WIFI_PAGE_HEADER);
+  if (scanResultCount == 0) {
+    pageWrite_P(WIFI_PAGE_SCANNING);
+  }
+  for (size_t i = 0; i < scanResultCount; ++i) {
+    pageWritef(OPTION_TEMPLATE, scanResults[i].ssid, scanResults[i].ssid);
+  }
+  pageWrite_P(WIFI_PAGE_FOOTER);
+  endPage();
+}
+
+// Serves the cached scan list; never triggers a scan itself
+void handleWiFiScanList() {
+  beginPage("application/json");
+  pageWritef(PSTR("{\"scanning\":%s,\"networks\":["), WiFi.scanComplete() == WIFI_SCAN_RUNNING ? "true" : "false");
+  char ssid[2 * sizeof(scanResults[0].ssid)];
+  for (size_t i = 0; i < scanResultCount; ++i) {
+    jsonEscape(scanResults[i].ssid, ssid, sizeof(ssid));
+    pageWritef(PSTR("%s{\"ssid\":\"%s\",\"rssi\":%d,\"secure\":%s}"),
+               i > 0 ? "," : "", ssid, scanResults[i].rssi, scanResults[i].secure ? "true" : "false");
+  }
+  pageWrite_P(PSTR("]}"));
+  endPage();
+}
+
+void startWiFiScan() {
+  WiFi.scanNetworks(true); // Asynchronous; results are collected by handleWiFiScan()
+  wifiScanStarted = true;
+  wifiScanTime = millis();
+  LOG_DEBUG("WIFI", "Background scan started");
+}
+
+// Collects finished scans and starts a new one every WIFI_SCAN_INTERVAL
+void handleWiFiScan() {
+  int n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING) {
+    return;
+  }
+  if (n >= 0) {
+    storeScanResults(n);
+    WiFi.scanDelete();
+    wifiScanTime = millis();
+    LOG_INFO("WIFI", "Scan found %d networks, %u cached", n, (unsigned)scanResultCount);
+    return;
+  }
+  // Channel hopping would disturb an association in progress
+  if (wifiState == WiFiState::Connecting) {
+    return;
+  }
+  if (!wifiScanStarted || millis() - wifiScanTime >= WIFI_SCAN_INTERVAL) {
+    startWiFiScan();
+  }
+}
+
+// Copies scan results into the cache, one entry per SSID, strongest first
+void storeScanResults(int count) {
+  scanResultCount = 0;
+  for (int i = 0; i < count; ++i) {
+    String ssid = WiFi.SSID(i);
+    if (ssid.isEmpty()) {
+      continue; // Hidden network
+    }
+    int8_t rssi = (int8_t)WiFi.RSSI(i);
+
+    size_t slot = scanResultCount;
+    for (size_t j = 0; j < scanResultCount; ++j) {
+      if (ssid.equals(scanResults[j].ssid)) {
+        slot = j;
+        break;
+      }
+    }
+    if (slot < scanResultCount) {
+      if (rssi <= scanResults[slot].rssi) {
+        continue; // Weaker BSSID of a network already listed
+      }
+    } else if (scanResultCount < WIFI_SCAN_MAX_RESULTS) {
+      scanResultCount++;
+    } else if (rssi > scanResults[scanResultCount - 1].rssi) {
+      slot = scanResultCount - 1; // Replace the weakest entry
+    } else {
+      continue;
+    }
+
+    // Move the entry up until the list is sorted by RSSI again
+    ScanResult entry;
+    strlcpy(entry.ssid, ssid.c_str(), sizeof(entry.ssid));
+    entry.rssi = rssi;
+    entry.secure = WiFi.encryptionType(i) != ENC_TYPE_NONE;
+    while (slot > 0 && scanResults[slot - 1].rssi < rssi) {
+      scanResults[slot] = scanResults[slot - 1];
+      slot--;
+    }
+    scanResults[slot] = entry;
+  }
+}
+
+// Escapes quotes, backslashes and control characters; output is always terminated
+size_t jsonEscape(const char* input, char* output, size_t size) {
+  size_t length = 0;
+  for (; *input && length + 1 < size; ++input) {
+    char c = *input;
+    if (c == '"' || c == '\\') {
+      if (length + 2 >= size) {
+        break;
+      }
+      output[length++] = '\\';
+      output[length++] = c;
+    } else if ((uint8_t)c >= 0x20) {
+      output[length++] = c;
+    }
   }
-  html += "</select><br>";
-  html += "<label>Wi-Fi Password:</label><input type='password' name='password'><br>";
-  html += "<input type='submit' value='Save Wi-Fi Settings'>";
-  html += "</form></body></html>";
-  server.send(200, "text/html", html);
+  output[length] = '\0';
+  return length;
+}
+
+// Every document in this file lives in the one static arena, so JSON never
+// touches the heap. A caller must be done with its document before calling
+// anything else that takes the arena.
+JsonDocument& jsonScratch() {
+  jsonArena.clear();
+  return jsonArena;
 }
 
 void handleWiFiSubmit() {
   config.wifi_ssid = server.arg("ssid");
   config.wifi_password = server.arg("password");
-  Serial.println("[WEB_SERVER] Wi-Fi setup submitted: SSID=" + config.wifi_ssid);
+  LOG_INFO("WEB_SERVER", "Wi-Fi setup submitted: SSID=%s", config.wifi_ssid.c_str());
 
   if (config.wifi_ssid.isEmpty()) {
-    Serial.println("[WEB_SERVER] Error: Wi-Fi SSID is required");
+    LOG_ERROR("WEB_SERVER", "Error: Wi-Fi SSID is required");
     server.send(400, "text/plain", "Wi-Fi SSID is required");
     return;
   }
 
   saveConfig();
-  WiFi.softAPdisconnect(true);
-  dnsServer.stop();
-  Serial.println("[WEB_SERVER] AP mode disabled, attempting Wi-Fi connection");
+  // The AP stays up while the station connects; loop() reboots on success
+  LOG_INFO("WEB_SERVER", "Attempting Wi-Fi connection, portal stays available");
+  server.send(200, "text/plain", "Connecting to Wi-Fi. The device reboots once connected; if it is still in setup mode after 15 seconds, please try again.");
   connectToWiFi();
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("[WEB_SERVER] Wi-Fi setup complete, rebooting...");
-    server.send(200, "text/plain", "Wi-Fi setup complete. Rebooting...");
-    delay(1000);
-    ESP.restart();
-  } else {
-    Serial.println("[WEB_SERVER] Failed to connect to Wi-Fi");
-    server.send(500, "text/plain", "Failed to connect to Wi-Fi. Please try again.");
-  }
 }
 
 void handleConfigPage() {
-  Serial.println("[WEB_SERVER] Serving device configuration page");
-  String html = "<html><body><h1>Device Configuration</h1><form action='/config' method='POST'>";
-  html += "<label>Customer ID:</label><input type='text' name='customer_id'><br>";
-  html += "<label>Zone ID:</label><input type='text' name='zone_id'><br>";
-  html += "<label>AC Brand:</label><select name='ac_brand'>";
-  for (const auto& bp : brandProtocols) {
-    html += "<option value='" + String(bp.brand) + "'>" + String(bp.brand) + "</option>";
+  LOG_DEBUG("WEB_SERVER", "Serving device configuration page");
+  beginPage();
+  pageWrite_P(CONFIG_PAGE_HEADER);
+  BrandEntry entry;
+  for (size_t i = 0; i < BRAND_COUNT; ++i) {
+    readBrand(i, entry);
+    pageWritef(OPTION_TEMPLATE, entry.name, entry.name);
   }
-  html += "</select><br>";
-  html += "<label><input type='checkbox' name='skip_testing' value='true'> Skip AC protocol testing (uses first available protocol)</label><br>";
-  html += "<input type='submit' value='Save and Proceed'>";
-  html += "</form></body></html>";
-  server.send(200, "text/html", html);
+  pageWrite_P(CONFIG_PAGE_FOOTER);
+  endPage();
 }
 
 void handleConfigSubmit() {
@@ -431,145 +1319,179 @@ void handleConfigSubmit() {
   config.zone_id = server.arg("zone_id");
   config.ac_brand = server.arg("ac_brand");
   bool skipTesting = server.arg("skip_testing") == "true";
-  Serial.println("[WEB_SERVER] Configuration submitted: CustomerID=" + config.customer_id + ", ZoneID=" + config.zone_id + ", ACBrand=" + config.ac_brand + ", SkipTesting=" + String(skipTesting));
+  LOG_INFO("WEB_SERVER", "Configuration submitted: CustomerID=%s, ZoneID=%s, ACBrand=%s, SkipTesting=%d", config.customer_id.c_str(), config.zone_id.c_str(), config.ac_brand.c_str(), skipTesting);
 
   if (config.customer_id.isEmpty() || config.zone_id.isEmpty() || config.ac_brand.isEmpty()) {
-    Serial.println("[WEB_SERVER] Error: Missing required fields");
+    LOG_ERROR("WEB_SERVER", "Error: Missing required fields");
     server.send(400, "text/plain", "Please fill in all required fields");
     return;
   }
 
-  if (!validateZoneID(config.customer_id, config.zone_id)) {
-    Serial.println("[WEB_SERVER] Error: Invalid Zone ID or not related to Customer ID");
-    server.send(400, "text/plain", "Invalid Zone ID or not related to Customer ID");
-    return;
-  }
-
-  protocolsToTest.clear();
-  for (const auto& bp : brandProtocols) {
-    if (config.ac_brand.equalsIgnoreCase(bp.brand)) {
-      protocolsToTest = bp.protocols;
-      Serial.println("[WEB_SERVER] Found " + String(protocolsToTest.size()) + " protocols for brand " + config.ac_brand);
-      break;
-    }
+  if (findBrand(config.ac_brand.c_str(), testBrand)) {
+    LOG_INFO("WEB_SERVER", "Found %u protocols for brand %s", (unsigned)testBrand.count, config.ac_brand.c_str());
+  } else {
+    testBrand.count = 0;
   }
 
-  if (protocolsToTest.empty()) {
-    Serial.println("[WEB_SERVER] Error: Selected brand is not supported");
+  if (testBrand.count == 0) {
+    LOG_ERROR("WEB_SERVER", "Error: Selected brand is not supported");
     server.send(400, "text/plain", "Selected brand is not supported");
     return;
   }
 
   if (skipTesting) {
-    for (size_t i = 0; i < protocolsToTest.size(); i++) {
-      if (ac.isProtocolSupported(protocolsToTest[i])) {
-        config.ac_protocol = String((int)protocolsToTest[i]);
+    // Registration checks the zone server-side, so provisioning is a single request
+    for (size_t i = 0; i < testBrand.count; i++) {
+      decode_type_t protocol = brandProtocol(testBrand, i);
+      if (ac.isProtocolSupported(protocol)) {
+        config.ac_protocol = String((int)protocol);
         config.firmware_version = FIRMWARE_VERSION;
-        saveConfig();
-        if (registerDevice()) {
-          Serial.println("[WEB_SERVER] Setup complete, rebooting...");
+        int httpCode = 0;
+        if (registerAndSaveConfig(httpCode)) {
+          LOG_INFO("WEB_SERVER", "Setup complete, rebooting...");
           server.send(200, "text/plain", "Setup complete. Rebooting...");
           delay(1000);
           ESP.restart();
+        } else if (httpCode == 400) {
+          LOG_ERROR("WEB_SERVER", "Error: Invalid Zone ID or not related to Customer ID");
+          server.send(400, "text/plain", "Invalid Zone ID or not related to Customer ID");
         } else {
-          Serial.println("[WEB_SERVER] Error: Failed to register device");
+          LOG_ERROR("WEB_SERVER", "Error: Failed to register device");
           server.send(500, "text/plain", "Failed to register device. Please try again.");
         }
         return;
       }
     }
-    Serial.println("[WEB_SERVER] Error: No supported protocols found for brand");
+    LOG_ERROR("WEB_SERVER", "Error: No supported protocols found for brand");
     server.send(400, "text/plain", "No supported protocols found for the selected brand");
     return;
   }
 
-  testingProtocol = true;
-  currentProtocolIndex = 0;
-  Serial.println("[WEB_SERVER] Starting protocol testing");
-  testNextProtocol();
+  // Check the zone before the installer spends time on protocol testing; the
+  // backend also suggests the protocol most units of this brand ended up with
+  int16_t protocolHint = -1;
+  if (!validateZoneID(config.customer_id, config.zone_id, protocolHint)) {
+    LOG_ERROR("WEB_SERVER", "Error: Invalid Zone ID or not related to Customer ID");
+    server.send(400, "text/plain", "Invalid Zone ID or not related to Customer ID");
+    return;
+  }
+
+  if (!startDiscovery(protocolHint)) {
+    LOG_ERROR("WEB_SERVER", "Error: No supported protocols found for brand");
+    server.send(400, "text/plain", "No supported protocols found for the selected brand");
+    return;
+  }
+  handleTestProtocol();
 }
 
 void handleTestProtocol() {
-  if (!testingProtocol) {
-    Serial.println("[WEB_SERVER] Error: No protocol testing in progress");
+  if (!discoveryActive) {
+    LOG_ERROR("WEB_SERVER", "Error: No protocol testing in progress");
     server.send(400, "text/plain", "No protocol testing in progress");
     return;
   }
 
-  Serial.println("[WEB_SERVER] Serving protocol test page for protocol " + String(currentProtocolIndex + 1));
-  String html = "<html><body><h1>Testing AC Protocol</h1>";
-  html += "<p>Brand: " + config.ac_brand + "</p>";
-  html += "<p>Testing protocol " + String(currentProtocolIndex + 1) + " of " + String(protocolsToTest.size()) + "</p>";
-  html += "<p>Please check if your AC turned on. Did it respond?</p>";
-  html += "<form action='/result' method='POST'>";
-  html += "<input type='hidden' name='success' value='yes'><input type='submit' value='Yes, it worked'>";
-  html += "</form>";
-  html += "<form action='/result' method='POST'>";
-  html += "<input type='hidden' name='success' value='no'><input type='submit' value='No, try next'>";
-  html += "</form></body></html>";
-  server.send(200, "text/html", html);
+  size_t first = protocolSearch.groupBegin();
+  size_t last = protocolSearch.groupEnd();
+  LOG_DEBUG("WEB_SERVER", "Serving protocol test page for candidates %u-%u", (unsigned)(first + 1), (unsigned)last);
+  beginPage();
+  pageWrite_P(TEST_PAGE_HEADER);
+  pageWritef(PSTR("<p>Brand: %s, round %u, %u of %u candidates left</p>"), config.ac_brand.c_str(),
+             (unsigned)(protocolSearch.rounds() + 1), (unsigned)protocolSearch.remaining(), (unsigned)protocolSearch.count());
+  if (discoverySweepIndex < last) {
+    pageWritef(PSTR("<p>Signal %u of %u</p>"), (unsigned)(discoverySweepIndex - first + 1), (unsigned)(last - first));
+    pageWrite_P(TEST_PAGE_SWEEPING);
+  } else {
+    pageWritef(PSTR("<p>Sent %u test signal(s).</p>"), (unsigned)(last - first));
+    pageWrite_P(TEST_PAGE_FOOTER);
+  }
+  endPage();
 }
 
 void handleTestResult() {
-  if (!testingProtocol) {
-    Serial.println("[WEB_SERVER] Error: No protocol testing in progress");
-    server.send(400, "text/plain", "No protocol testing in progress");
+  if (!discoveryActive || discoverySweepIndex < protocolSearch.groupEnd()) {
+    LOG_ERROR("WEB_SERVER", "Error: No protocol test waiting for a result");
+    server.send(400, "text/plain", "No protocol test waiting for a result");
     return;
   }
 
   String success = server.arg("success");
-  Serial.println("[WEB_SERVER] Protocol test result: " + success);
-  if (success == "yes") {
-    config.ac_protocol = String((int)protocolsToTest[currentProtocolIndex]);
-    config.firmware_version = FIRMWARE_VERSION;
-    saveConfig();
-    testingProtocol = false;
-    if (registerDevice()) {
-      Serial.println("[WEB_SERVER] Protocol test successful, setup complete, rebooting...");
-      server.send(200, "text/plain", "Setup complete. Rebooting...");
-      delay(1000);
-      ESP.restart();
-    } else {
-      Serial.println("[WEB_SERVER] Error: Failed to register device");
-      server.send(500, "text/plain", "Failed to register device. Please try again.");
-    }
+  LOG_INFO("WEB_SERVER", "Protocol test result: %s", success.c_str());
+  if (success == "repeat") {
+    startDiscoverySweep();
+    handleTestProtocol();
+    return;
+  }
+  ProtocolSearch::Result result = protocolSearch.answer(success == "yes");
+  if (result == ProtocolSearch::Result::Pending) {
+    startDiscoverySweep();
+    handleTestProtocol();
+    return;
+  }
+
+  discoveryActive = false;
+  if (result == ProtocolSearch::Result::Exhausted) {
+    sendDiscoveryFailedPage();
+    return;
+  }
+  LOG_INFO("IR_TEST", "Protocol %d found after %u answers", (int)protocolSearch.winner(), (unsigned)protocolSearch.rounds());
+  config.ac_protocol = String((int)protocolSearch.winner());
+  config.firmware_version = FIRMWARE_VERSION;
+  int httpCode = 0;
+  if (registerAndSaveConfig(httpCode)) {
+    LOG_INFO("WEB_SERVER", "Protocol test successful, setup complete, rebooting...");
+    server.send(200, "text/plain", "Setup complete. Rebooting...");
+    delay(1000);
+    ESP.restart();
   } else {
-    currentProtocolIndex++;
-    if (currentProtocolIndex < protocolsToTest.size()) {
-      testNextProtocol();
+    LOG_ERROR("WEB_SERVER", "Error: Failed to register device");
+    server.send(500, "text/plain", "Failed to register device. Please try again.");
+  }
+}
+
+// Candidates are the brand's protocols this build can send, hint first
+bool startDiscovery(int16_t hint) {
+  int16_t candidates[ProtocolSearch::MAX_CANDIDATES];
+  size_t count = 0;
+  for (size_t i = 0; i < testBrand.count; i++) {
+    decode_type_t protocol = brandProtocol(testBrand, i);
+    if (ac.isProtocolSupported(protocol)) {
+      candidates[count++] = (int16_t)protocol;
     } else {
-      testingProtocol = false;
-      Serial.println("[WEB_SERVER] Error: No working protocol found for " + config.ac_brand);
-      String html = "<html><body><h1>No Working Protocol Found</h1>";
-      html += "<p>No protocol worked for " + config.ac_brand + ".</p>";
-      html += "<p>Please check your AC brand or ensure the device is pointed at the AC.</p>";
-      html += "<a href='/config'>Try again</a></body></html>";
-      server.send(400, "text/html", html);
+      LOG_DEBUG("IR_TEST", "Protocol %d not supported, skipping", (int)protocol);
     }
   }
+  protocolSearch.begin(candidates, count, hint);
+  if (protocolSearch.result() == ProtocolSearch::Result::Exhausted) {
+    discoveryActive = false;
+    return false;
+  }
+  LOG_INFO("IR_TEST", "Starting protocol discovery for %s: %u candidates, hint %d", config.ac_brand.c_str(), (unsigned)count, (int)hint);
+  discoveryActive = true;
+  startDiscoverySweep();
+  return true;
 }
 
-void testNextProtocol() {
-  if (currentProtocolIndex >= protocolsToTest.size()) {
-    testingProtocol = false;
-    Serial.println("[IR_TEST] No more protocols to test for " + config.ac_brand);
-    String html = "<html><body><h1>No More Protocols</h1>";
-    html += "<p>All protocols tested for " + config.ac_brand + ". None worked.</p>";
-    html += "<p>Please check your AC brand or try again.</p>";
-    html += "<a href='/config'>Back to setup</a></body></html>";
-    server.send(400, "text/html", html);
-    return;
-  }
+void startDiscoverySweep() {
+  discoverySweepIndex = protocolSearch.groupBegin();
+  discoveryFrameTime = millis() - DISCOVERY_FRAME_GAP; // First frame goes out on the next loop()
+  LOG_DEBUG("IR_TEST", "Sweeping candidates %u-%u of %u", (unsigned)(discoverySweepIndex + 1),
+            (unsigned)protocolSearch.groupEnd(), (unsigned)protocolSearch.count());
+}
 
-  decode_type_t protocol = protocolsToTest[currentProtocolIndex];
-  Serial.println("[IR_TEST] Testing protocol " + String(currentProtocolIndex + 1) + " of " + String(protocolsToTest.size()) + ": " + String((int)protocol));
-  if (!ac.isProtocolSupported(protocol)) {
-    Serial.println("[IR_TEST] Protocol " + String((int)protocol) + " not supported, skipping");
-    currentProtocolIndex++;
-    testNextProtocol();
+// Fires the current group one frame at a time from loop(), so the test page
+// keeps refreshing while the sweep runs
+void handleDiscovery() {
+  if (!discoveryActive || discoverySweepIndex >= protocolSearch.groupEnd() ||
+      millis() - discoveryFrameTime < DISCOVERY_FRAME_GAP) {
     return;
   }
+  discoveryFrameTime = millis();
+  sendTestFrame((decode_type_t)protocolSearch.candidate(discoverySweepIndex++));
+}
 
+void sendTestFrame(decode_type_t protocol) {
+  LOG_INFO("IR_TEST", "Sending test frame for protocol %d", (int)protocol);
   ac.next.protocol = protocol;
   ac.next.model = 1;
   ac.next.power = true;
@@ -577,487 +1499,1635 @@ void testNextProtocol() {
   ac.next.degrees = 25;
   ac.next.fanspeed = stdAc::fanspeed_t::kMedium;
 
-  if (ac.sendAc()) {
-    Serial.println("[IR_TEST] IR signal sent successfully for protocol " + String((int)protocol));
-    handleTestProtocol();
-  } else {
-    Serial.println("[IR_TEST] Failed to send IR signal for protocol " + String((int)protocol));
-    currentProtocolIndex++;
-    testNextProtocol();
+  if (!ac.sendAc()) {
+    LOG_ERROR("IR_TEST", "Failed to send IR signal for protocol %d", (int)protocol);
   }
 }
 
+void sendDiscoveryFailedPage() {
+  LOG_ERROR("WEB_SERVER", "Error: No working protocol found for %s", config.ac_brand.c_str());
+  String html = "<html><body><h1>No Working Protocol Found</h1>";
+  html += "<p>No protocol worked for " + config.ac_brand + ".</p>";
+  html += "<p>Please check your AC brand or ensure the device is pointed at the AC.</p>";
+  html += "<a href='/config'>Try again</a></body></html>";
+  server.send(400, "text/html", html);
+}
+
 void connectToWiFi() {
-  Serial.println("[WIFI] Connecting to Wi-Fi: " + config.wifi_ssid);
-  WiFi.begin(config.wifi_ssid.c_str(), config.wifi_password.c_str());
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
-  }
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("[WIFI] Connected to Wi-Fi: " + config.wifi_ssid + ", IP: " + WiFi.localIP().toString() + ", RSSI: " + String(WiFi.RSSI()) + " dBm");
+  static bool handlersRegistered = false;
+  if (!handlersRegistered) {
+    // Event callbacks run in the SDK context, so they only raise flags for handleWiFi()
+    wifiGotIPHandler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP&) { wifiGotIP = true; });
+    wifiDisconnectedHandler = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected&) { wifiLostConnection = true; });
+    handlersRegistered = true;
+  }
+  WiFi.mode(isAPMode ? WIFI_AP_STA : WIFI_STA);
+  WiFi.setAutoReconnect(false);
+  applyPowerMode();
+  wifiUseCache = loadWiFiCache();
+  beginWiFiAttempt();
+}
+
+// The listen interval is sent in the association request, so this runs before
+// every connection. The AP portal always stays awake.
+void applyPowerMode() {
+  PowerMode mode = isAPMode ? PowerMode::Normal : config.power_mode;
+  WiFiSleepType_t type = WIFI_MODEM_SLEEP; // SDK default
+  uint8_t listenInterval = 0; // Wake for every DTIM beacon
+  uint16_t idleCurrent = POWER_ACTIVE_CURRENT_MA;
+  if (mode == PowerMode::ModemSleep) {
+    listenInterval = POWER_LISTEN_INTERVAL;
+    idleCurrent = POWER_MODEM_SLEEP_CURRENT_MA;
+  } else if (mode == PowerMode::LightSleep) {
+    type = WIFI_LIGHT_SLEEP;
+    listenInterval = POWER_LISTEN_INTERVAL;
+    idleCurrent = POWER_LIGHT_SLEEP_CURRENT_MA;
+  }
+  WiFi.setSleepMode(type, listenInterval);
+  metricsSetPowerMode(enumName(powerModeNames, mode, "normal"), listenInterval, POWER_ACTIVE_CURRENT_MA, idleCurrent);
+  LOG_INFO("POWER", "Power mode %s, listen interval %u", enumName(powerModeNames, mode, "normal"), (unsigned)listenInterval);
+}
+
+// Yields the CPU when nothing is due so the SDK can sleep between beacons.
+// Commands still arrive within one listen interval; a burst keeps the loop
+// awake for POWER_AWAKE_HOLD.
+void handlePowerIdle() {
+  if (config.power_mode == PowerMode::Normal || wifiState != WiFiState::Connected ||
+      mqttConnectState != MQTTConnectState::Idle || anyPendingCommand() || otaUpdater.busy() || discoveryActive ||
+      pendingSnapshots != 0 || !publishQueue.empty() || millis() - lastActivityTime < POWER_AWAKE_HOLD) {
+    return;
+  }
+  uint32_t start = micros();
+  delay(POWER_IDLE_DELAY);
+  metricsRecordIdle(micros() - start);
+}
+
+void beginWiFiAttempt() {
+  wifiGotIP = false;
+  wifiLostConnection = false;
+  wifiState = WiFiState::Connecting;
+  wifiAttemptStart = millis();
+  if (wifiUseCache) {
+    LOG_INFO("WIFI", "Connecting to Wi-Fi: %s (cached channel %u)", config.wifi_ssid.c_str(), wifiCache.channel);
+    WiFi.begin(config.wifi_ssid.c_str(), config.wifi_password.c_str(), wifiCache.channel, wifiCache.bssid);
   } else {
-    Serial.println("[WIFI] Failed to connect to Wi-Fi");
-    publishError("WiFi", "Failed to connect to " + config.wifi_ssid);
+    LOG_INFO("WIFI", "Connecting to Wi-Fi: %s", config.wifi_ssid.c_str());
+    WiFi.begin(config.wifi_ssid.c_str(), config.wifi_password.c_str());
+  }
+}
+
+void handleWiFi() {
+  unsigned long currentTime = millis();
+  switch (wifiState) {
+    case WiFiState::Idle:
+      break;
+    case WiFiState::Connecting:
+      if (wifiGotIP) {
+        wifiGotIP = false;
+        wifiLostConnection = false;
+        wifiState = WiFiState::Connected;
+        wifiEverConnected = true;
+        saveWiFiCache();
+        LOG_INFO("WIFI", "Connected to Wi-Fi: %s, IP: %s, RSSI: %d dBm", config.wifi_ssid.c_str(), WiFi.localIP().toString().c_str(), WiFi.RSSI());
+      } else if (currentTime - wifiAttemptStart >= WIFI_CONNECT_TIMEOUT && wifiUseCache) {
+        // The access point may have moved, so retry straight away with a full scan
+        LOG_WARN("WIFI", "Cached BSSID did not answer, retrying with a full scan");
+        wifiUseCache = false;
+        beginWiFiAttempt();
+      } else if (currentTime - wifiAttemptStart >= WIFI_CONNECT_TIMEOUT) {
+        LOG_ERROR("WIFI", "Failed to connect to Wi-Fi");
+        publishError("WiFi", "Failed to connect to %s", config.wifi_ssid.c_str());
+        wifiState = WiFiState::Failed;
+      }
+      break;
+    case WiFiState::Connected:
+      if (wifiLostConnection || WiFi.status() != WL_CONNECTED) {
+        LOG_INFO("WIFI", "Wi-Fi disconnected, attempting to reconnect");
+        telemetryBatch.recordWiFiDrop();
+        wifiUseCache = loadWiFiCache();
+        beginWiFiAttempt();
+      }
+      break;
+    case WiFiState::Failed:
+      if (currentTime - wifiAttemptStart >= WIFI_CONNECT_TIMEOUT + WIFI_RETRY_INTERVAL) {
+        beginWiFiAttempt();
+      }
+      break;
+  }
+}
+
+bool loadWiFiCache() {
+  if (!ESP.rtcUserMemoryRead(RTC_WIFI_OFFSET, (uint32_t*)&wifiCache, sizeof(wifiCache))) {
+    return false;
   }
+  return wifiCache.magic == WIFI_CACHE_MAGIC &&
+         wifiCache.ssidHash == crc32((const uint8_t*)config.wifi_ssid.c_str(), config.wifi_ssid.length()) &&
+         wifiCache.crc == crc32((const uint8_t*)&wifiCache, offsetof(WiFiCacheRecord, crc));
+}
+
+void saveWiFiCache() {
+  wifiCache.magic = WIFI_CACHE_MAGIC;
+  wifiCache.ssidHash = crc32((const uint8_t*)config.wifi_ssid.c_str(), config.wifi_ssid.length());
+  memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.reserved = 0;
+  wifiCache.crc = crc32((const uint8_t*)&wifiCache, offsetof(WiFiCacheRecord, crc));
+  ESP.rtcUserMemoryWrite(RTC_WIFI_OFFSET, (uint32_t*)&wifiCache, sizeof(wifiCache));
 }
 
 void startNormalWebServer() {
   isAPMode = false;
-  Serial.println("[WEB_SERVER] Starting normal web server");
+  LOG_INFO("WEB_SERVER", "Starting normal web server");
   if (config.customer_id.isEmpty() || config.zone_id.isEmpty() || config.ac_brand.isEmpty() || config.ac_protocol.isEmpty()) {
-    Serial.println("[WEB_SERVER] Configuration incomplete, serving config page");
+    LOG_INFO("WEB_SERVER", "Configuration incomplete, serving config page");
     server.on("/", HTTP_GET, handleConfigPage);
     server.on("/config", HTTP_POST, handleConfigSubmit);
     server.on("/test", HTTP_GET, handleTestProtocol);
     server.on("/result", HTTP_POST, handleTestResult);
   } else {
-    Serial.println("[WEB_SERVER] Configuration complete, serving status page");
+    LOG_INFO("WEB_SERVER", "Configuration complete, serving status page");
     server.on("/", HTTP_GET, handleNormalPage);
     server.on("/reset", HTTP_POST, handleReset);
+    // The LAN API mirrors the per-channel MQTT command topics under /api
+    for (size_t i = 0; i < TOPIC_ROUTE_COUNT; i++) {
+      const TopicRoute& route = topicRoutes[i];
+      if (route.channel) {
+        CommandType command = route.command;
+        server.on(String("/api") + route.suffix, HTTP_POST, [command]() { handleLocalCommand(command); });
+      }
+    }
+    server.on("/api/state", HTTP_GET, handleLocalState);
+    startMDNS();
   }
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  const char* headers[] = {"Authorization"};
+  server.collectHeaders(headers, 1);
   server.begin();
-  Serial.println("[WEB_SERVER] Normal web server started on port 80");
+  LOG_INFO("WEB_SERVER", "Normal web server started on port 80");
 }
 
-void handleNormalPage() {
-  Serial.println("[WEB_SERVER] Serving device status page");
-  String html = "<html><body><h1>Device Status</h1>";
-  html += "<p>Wi-Fi SSID: " + config.wifi_ssid + "</p>";
-  html += "<p>RSSI: " + String(WiFi.RSSI()) + " dBm</p>";
-  html += "<p>Customer ID: " + config.customer_id + "</p>";
-  html += "<p>AC Brand: " + config.ac_brand + "</p>";
-  html += "<p>AC Protocol: " + config.ac_protocol + "</p>";
-  html += "<p>Zone ID: " + config.zone_id + "</p>";
-  html += "<p>MQTT Status: " + String(mqttClient.connected() ? "Connected" : "Disconnected") + "</p>";
-  html += "<p>Firmware Version: " + config.firmware_version + "</p>";
-  html += "<form action='/reset' method='POST'><input type='submit' value='Reset Device'></form>";
-  html += "</body></html>";
-  server.send(200, "text/html", html);
+// Lets gateways find the device without the cloud; the host name matches the setup SSID
+void startMDNS() {
+  String hostname = generateUniqueSSID();
+  hostname.replace('_', '-');
+  hostname.toLowerCase();
+  if (!MDNS.begin(hostname.c_str())) {
+    LOG_ERROR("MDNS", "Failed to start mDNS responder");
+    return;
+  }
+  MDNS.addService(MDNS_SERVICE, "tcp", 80);
+  MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "id", WiFi.macAddress().c_str());
+  MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "api", "/api");
+  MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "channels", String((unsigned)config.channel_count).c_str());
+  MDNS.addServiceTxt(MDNS_SERVICE, "tcp", "fw", config.firmware_version.c_str());
+  LOG_INFO("MDNS", "Advertising %s.local as _%s._tcp", hostname.c_str(), MDNS_SERVICE);
 }
 
-void handleReset() {
-  Serial.println("[WEB_SERVER] Device reset requested");
-  LittleFS.remove(CONFIG_FILE);
-  LittleFS.remove(AC_STATE_FILE);
+// Requests carry "Authorization: Bearer <local_token>". Repeated failures lock
+// the API for LOCAL_AUTH_LOCKOUT so the token cannot be guessed from the LAN.
+bool authorizeLocalRequest() {
+  if (config.local_token.isEmpty()) {
+    server.send(403, "application/json", "{\"result\":\"disabled\"}");
+    return false;
+  }
+  if (localAuthFailures >= LOCAL_AUTH_MAX_FAILURES) {
+    if (millis() - localAuthLockedAt < LOCAL_AUTH_LOCKOUT) {
+      server.send(429, "application/json", "{\"result\":\"locked\"}");
+      return false;
+    }
+    localAuthFailures = 0;
+  }
+  const String& header = server.header("Authorization");
+  const char* token = config.local_token.c_str();
+  size_t length = config.local_token.length();
+  // Compared in constant time, so the response time does not leak a prefix
+  uint8_t difference = header.length() == length + 7 && header.startsWith("Bearer ") ? 0 : 1;
+  for (size_t i = 0; i < length; i++) {
+    difference |= (uint8_t)(token[i] ^ (i + 7 < header.length() ? header[i + 7] : 0));
+  }
+  if (difference != 0) {
+    if (++localAuthFailures >= LOCAL_AUTH_MAX_FAILURES) {
+      localAuthLockedAt = millis();
+      LOG_WARN("LOCAL_API", "Too many failed logins, locking the local API");
+    }
+    server.send(401, "application/json", "{\"result\":\"unauthorized\"}");
+    return false;
+  }
+  localAuthFailures = 0;
+  return true;
+}
+
+// POST /api/command/<field>[?channel=n] with the same body as the MQTT
+// command. The frame is sent at once rather than after the coalescing
+// window; the new state reaches the cloud through state telemetry, queued
+// like any other publish while the broker is unreachable.
+void handleLocalCommand(CommandType command) {
+  commandReceivedAt = micros();
+  lastActivityTime = millis();
+  if (!authorizeLocalRequest()) {
+    return;
+  }
+  int channel = 0;
+  if (server.hasArg("channel")) {
+    const String& value = server.arg("channel");
+    if (!parseBoundedInt(value.c_str(), value.length(), 0, config.channel_count - 1, channel)) {
+      server.send(404, "application/json", "{\"result\":\"unknown_channel\"}");
+      return;
+    }
+  }
+  const String& body = server.arg("plain");
+  size_t length = body.length();
+  if (length >= STATE_COMMAND_COPY_SIZE) {
+    server.send(413, "application/json", "{\"result\":\"too_large\"}");
+    return;
+  }
+  // Decoded in place, like the MQTT buffer
+  char payload[STATE_COMMAND_COPY_SIZE];
+  memcpy(payload, body.c_str(), length + 1);
+  LOG_DEBUG("LOCAL_API", "Command %s for channel %d: %s", commandName(command), channel, payload);
+
+  // Local callers have their own sequence space, like zone senders, so they are not deduplicated
+  bool accepted = false;
+  if (command == CommandType::State) {
+    accepted = applyStateCommand(channel, payload, length, true);
+  } else {
+    uint32_t sequence = 0;
+    const char* value = unwrapCommandEnvelope(payload, length, sequence);
+    accepted = value != nullptr && sendIRSignal(channel, command, value, length, 0) && flushPendingCommand(channel);
+  }
+  if (!accepted) {
+    // The reason is logged and published on the error topic
+    server.send(422, "application/json", "{\"result\":\"rejected\"}");
+    return;
+  }
+  formatStateTelemetry(payload, sizeof(payload), acChannels[channel].state);
+  server.send(200, "application/json", payload);
+}
+
+// GET /api/state: {"channels":[<state telemetry of channel 0>, ...]}
+void handleLocalState() {
+  if (!authorizeLocalRequest()) {
+    return;
+  }
+  size_t length = strlcpy(metricsBuffer, "{\"channels\":[", sizeof(metricsBuffer));
+  for (uint8_t i = 0; i < config.channel_count && length + 1 < sizeof(metricsBuffer); i++) {
+    if (i > 0) {
+      metricsBuffer[length++] = ',';
+    }
+    length += formatStateTelemetry(metricsBuffer + length, sizeof(metricsBuffer) - length, acChannels[i].state);
+  }
+  strlcpy(metricsBuffer + length, "]}", sizeof(metricsBuffer) - length);
+  server.send(200, "application/json", metricsBuffer);
+}
+
+void handleNormalPage() {
+  LOG_DEBUG("WEB_SERVER", "Serving device status page");
+  beginPage();
+  pageWrite_P(STATUS_PAGE_HEADER);
+  pageWritef(PSTR("<p>Wi-Fi SSID: %s</p>"), config.wifi_ssid.c_str());
+  pageWritef(PSTR("<p>RSSI: %d dBm</p>"), (int)WiFi.RSSI());
+  pageWritef(PSTR("<p>Customer ID: %s</p>"), config.customer_id.c_str());
+  pageWritef(PSTR("<p>AC Brand: %s</p>"), config.ac_brand.c_str());
+  pageWritef(PSTR("<p>AC Protocol: %s</p>"), config.ac_protocol.c_str());
+  for (uint8_t i = 1; i < config.channel_count; i++) {
+    const ChannelConfig& channel = config.extra_channels[i - 1];
+    pageWritef(PSTR("<p>AC Channel %u: GPIO%u, protocol %d, model %d</p>"), (unsigned)i, (unsigned)channel.pin, channel.protocol, channel.model);
+  }
+  pageWritef(PSTR("<p>Zone ID: %s</p>"), config.zone_id.c_str());
+  pageWritef(PSTR("<p>MQTT Status: %s</p>"), mqttClient.connected() ? "Connected" : "Disconnected");
+  pageWritef(PSTR("<p>Local API: %s</p>"), config.local_token.isEmpty() ? "Disabled" : "Enabled");
+  pageWritef(PSTR("<p>Firmware Version: %s</p>"), config.firmware_version.c_str());
+  pageWrite_P(STATUS_PAGE_FOOTER);
+  endPage();
+}
+
+// Starts a chunked response; the body follows through pageWrite_P/pageWritef
+void beginPage(const char* contentType) {
+  pageLength = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, contentType, "");
+}
+
+// Appends a flash string, flushing the chunk buffer when it would overflow
+void pageWrite_P(PGM_P text) {
+  size_t length = strlen_P(text);
+  if (pageLength + length > sizeof(pageBuffer)) {
+    pageFlush();
+  }
+  if (length > sizeof(pageBuffer)) {
+    server.sendContent_P(text, length);
+    return;
+  }
+  memcpy_P(pageBuffer + pageLength, text, length);
+  pageLength += length;
+}
+
+// Appends one formatted line; output longer than PAGE_LINE_SIZE is truncated
+void pageWritef(PGM_P format, ...) {
+  char line[PAGE_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf_P(line, sizeof(line), format, args);
+  va_end(args);
+  if (written <= 0) {
+    return;
+  }
+  size_t length = min((size_t)written, sizeof(line) - 1);
+  if (pageLength + length > sizeof(pageBuffer)) {
+    pageFlush();
+  }
+  memcpy(pageBuffer + pageLength, line, length);
+  pageLength += length;
+}
+
+void pageFlush() {
+  if (pageLength > 0) {
+    server.sendContent(pageBuffer, pageLength);
+    pageLength = 0;
+  }
+}
+
+// Sends the remaining bytes and the terminating empty chunk
+void endPage() {
+  pageFlush();
+  server.sendContent("");
+}
+
+// Carries the device, customer and zone IDs, so it needs the LAN API token
+void handleMetrics() {
+  if (!authorizeLocalRequest()) {
+    return;
+  }
+  metricsFormatJson(metricsBuffer, sizeof(metricsBuffer));
+  server.send(200, "application/json", metricsBuffer);
+}
+
+void handleReset() {
+  LOG_INFO("WEB_SERVER", "Device reset requested");
+  LittleFS.remove(CONFIG_FILE);
+  LittleFS.remove(AC_STATE_FILE);
+  char path[24];
+  for (uint8_t i = 0; i < AC_MAX_CHANNELS; i++) {
+    stateJournalPath(i, path, sizeof(path));
+    LittleFS.remove(path);
+  }
+  LittleFS.remove(PUBLISH_SPOOL_FILE);
+  LittleFS.remove(SCHEDULE_FILE);
+  clearBootImage();
+  ACStateRecord cleared = {};
+  ESP.rtcUserMemoryWrite(RTC_STATE_OFFSET, (uint32_t*)&cleared, sizeof(cleared));
   server.send(200, "text/plain", "Configuration reset. Rebooting...");
-  Serial.println("[WEB_SERVER] Configuration reset, rebooting...");
+  LOG_INFO("WEB_SERVER", "Configuration reset, rebooting...");
   delay(1000);
   ESP.restart();
 }
 
 void connectToMQTT() {
   if (config.customer_id.isEmpty() || config.zone_id.isEmpty() || config.ac_brand.isEmpty() || config.ac_protocol.isEmpty()) {
-    Serial.println("[MQTT] Cannot connect: Configuration incomplete");
+    LOG_ERROR("MQTT", "Cannot connect: Configuration incomplete");
     return;
   }
   if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("[MQTT] Cannot connect: Wi-Fi not connected");
-    connectToWiFi();
-    if (WiFi.status() != WL_CONNECTED) {
-      Serial.println("[MQTT] Wi-Fi connection failed, cannot connect to MQTT");
-      return;
-    }
+    // handleWiFi() owns reconnection; loop() retries MQTT once Wi-Fi is back
+    LOG_ERROR("MQTT", "Cannot connect: Wi-Fi not connected");
+    return;
+  }
+
+  if (!buildTopicTable()) {
+    LOG_ERROR("MQTT", "Cannot connect: Topic table could not be built");
+    return;
   }
 
   espClient.setInsecure(); // TODO: Use proper TLS certificates in production
+  // Reusing the session turns reconnects into an abbreviated handshake
+  espClient.setSession(&tlsSession);
   mqttClient.setServer(MQTT_BROKER, MQTT_PORT);
   mqttClient.setCallback(mqttCallback);
-  String deviceId = getMACAddress();
-  String clientId = "Wemos-" + deviceId;
-  String lwtTopic = "node/" + config.customer_id + "/" + deviceId + "/status";
-  String lwtPayload = "offline";
-
-  Serial.println("[MQTT] Attempting connection with Client ID: " + clientId);
-  // Use connect method with LWT parameters: clientId, username, password, willTopic, willQoS, willRetain, willMessage
-  if (mqttClient.connect(clientId.c_str(), MQTT_USERNAME, MQTT_PASSWORD, lwtTopic.c_str(), 1, true, lwtPayload.c_str())) {
-    Serial.println("[MQTT] Connected to broker: " + String(MQTT_BROKER));
-    String baseTopic = "node/" + config.customer_id + "/" + deviceId;
-    mqttClient.subscribe((baseTopic + "/command/power").c_str());
-    mqttClient.subscribe((baseTopic + "/command/mode").c_str());
-    mqttClient.subscribe((baseTopic + "/command/temperature").c_str());
-    mqttClient.subscribe((baseTopic + "/command/fanspeed").c_str());
-    mqttClient.subscribe((baseTopic + "/ota/update").c_str());
-    Serial.println("[MQTT] Subscribed to command topics under: " + baseTopic);
-    publishStatus();
-    publishTelemetry();
-  } else {
-    Serial.println("[MQTT] Connection failed, state: " + String(mqttClient.state()));
-    publishError("MQTT", "Connection failed, state: " + String(mqttClient.state()));
+  // Get queued IR work out of the way before the handshake occupies the loop
+  for (uint8_t i = 0; i < config.channel_count; i++) {
+    flushPendingCommand(i);
+  }
+  metrics.mqttConnectAttempts++;
+  mqttConnectState = MQTTConnectState::HandshakeNext;
+  LOG_INFO("MQTT", "Connection attempt started");
+}
+
+void handleMQTTConnect() {
+  switch (mqttConnectState) {
+    case MQTTConnectState::Idle:
+      break;
+    case MQTTConnectState::HandshakeNext: {
+      [[maybe_unused]] unsigned long start = millis(); // Only logged
+      metricsRecordTlsConnect();
+      if (!espClient.connect(MQTT_BROKER, MQTT_PORT)) {
+        mqttConnectState = MQTTConnectState::Idle;
+        metrics.mqttConnectFailures++;
+        LOG_ERROR("MQTT", "TLS connection failed, SSL error: %d", espClient.getLastSSLError());
+        return;
+      }
+      LOG_INFO("MQTT", "TLS connected in %lu ms", (unsigned long)(millis() - start));
+      saveTLSSession();
+      mqttConnectState = MQTTConnectState::ConnectNext;
+      break;
+    }
+    case MQTTConnectState::ConnectNext: {
+      mqttConnectState = MQTTConnectState::Idle;
+      char clientId[32];
+      snprintf(clientId, sizeof(clientId), "Wemos-%s", topics.deviceId);
+      const char* lwtPayload = "offline";
+
+      LOG_INFO("MQTT", "Attempting connection with Client ID: %s", clientId);
+      // PubSubClient reuses the socket opened in the handshake step
+      // Use connect method with LWT parameters: clientId, username, password, willTopic, willQoS, willRetain, willMessage
+      if (mqttClient.connect(clientId, MQTT_USERNAME, MQTT_PASSWORD, topics.status, 1, true, lwtPayload)) {
+        LOG_INFO("MQTT", "Connected to broker: %s", MQTT_BROKER);
+        metrics.mqttConnects++;
+        char topic[MQTT_TOPIC_SIZE];
+        for (size_t i = 0; i < TOPIC_ROUTE_COUNT; i++) {
+          if (buildTopic(topic, sizeof(topic), topics.base, topicRoutes[i].suffix)) {
+            mqttClient.subscribe(topic);
+          } else {
+            LOG_WARN("MQTT", "Command topic %s too long, not subscribing", topicRoutes[i].suffix);
+          }
+        }
+        LOG_INFO("MQTT", "Subscribed to command topics under: %s", topics.base);
+        mqttClient.subscribe(topics.backpressure);
+        for (uint8_t i = 1; i < config.channel_count; i++) {
+          if (buildChannelTopic(topic, sizeof(topic), topics, i, "/command/+")) {
+            mqttClient.subscribe(topic);
+            LOG_INFO("MQTT", "Subscribed to channel %u commands: %s", (unsigned)i, topic);
+          } else {
+            LOG_WARN("MQTT", "Channel %u topic too long, not subscribing", (unsigned)i);
+          }
+        }
+        // One wildcard per group; findTopicRoute() filters the suffixes
+        if (topics.zoneBaseLength > 0 && buildTopic(topic, sizeof(topic), topics.zoneBase, "/command/+")) {
+          mqttClient.subscribe(topic);
+          LOG_INFO("MQTT", "Subscribed to zone commands: %s", topic);
+        }
+        if (topics.broadcastBaseLength > 0 && buildTopic(topic, sizeof(topic), topics.broadcastBase, "/command/+")) {
+          mqttClient.subscribe(topic);
+          LOG_INFO("MQTT", "Subscribed to customer broadcast commands: %s", topic);
+        }
+        publishStatus();
+        publishTelemetry();
+      } else {
+        LOG_ERROR("MQTT", "Connection failed, state: %d", mqttClient.state());
+        metrics.mqttConnectFailures++;
+        espClient.stop();
+        if (mqttClient.state() == MQTT_CONNECT_UNAVAILABLE) {
+          // The broker is shedding load; the delay still counts from this attempt
+          reconnectDelay = reconnectBackoff.serverBusy();
+          LOG_WARN("MQTT", "Broker unavailable, next attempt in %lu ms", reconnectDelay);
+        }
+      }
+      break;
+    }
+  }
+}
+
+// Retained by the backend on node/<customer_id>/backpressure, in seconds:
+// {"retry_after":120,"spread":300}. After the next drop the device waits
+// retry_after plus a random part of spread (default retry_after) before it
+// reconnects. An empty payload or a zero retry_after clears the hint.
+void applyBackpressureHint(char* payload, size_t length) {
+  uint32_t retryAfter = 0;
+  uint32_t spread = 0;
+  if (length > 0) {
+    JsonDocument& doc = jsonScratch();
+    DeserializationError error = deserializeJson(doc, payload, length);
+    if (error) {
+      LOG_ERROR("MQTT", "Error: Invalid backpressure hint: %s", error.c_str());
+      return;
+    }
+    retryAfter = min(doc["retry_after"] | (uint32_t)0, MAX_RETRY_AFTER);
+    spread = min(doc["spread"] | retryAfter, MAX_RETRY_AFTER);
+  }
+  reconnectBackoff.setRetryAfter(retryAfter * 1000, spread * 1000);
+  LOG_INFO("MQTT", "Broker retry-after hint: %lu s, spread %lu s", (unsigned long)retryAfter,
+           (unsigned long)(retryAfter != 0 ? spread : 0));
+}
+
+bool loadTLSSession() {
+  TLSSessionRecord record;
+  if (!ESP.rtcUserMemoryRead(RTC_TLS_OFFSET, (uint32_t*)&record, sizeof(record))) {
+    return false;
+  }
+  if (record.magic != TLS_SESSION_MAGIC || record.crc != crc32((const uint8_t*)&record, offsetof(TLSSessionRecord, crc))) {
+    return false;
   }
+  memcpy((void*)&tlsSession, record.session, sizeof(record.session));
+  return true;
 }
 
+void saveTLSSession() {
+  TLSSessionRecord record;
+  record.magic = TLS_SESSION_MAGIC;
+  memcpy(record.session, (const void*)&tlsSession, sizeof(record.session));
+  record.crc = crc32((const uint8_t*)&record, offsetof(TLSSessionRecord, crc));
+  ESP.rtcUserMemoryWrite(RTC_TLS_OFFSET, (uint32_t*)&record, sizeof(record));
+}
+
+bool buildTopicTable() {
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  if (!buildTopicTable(topics, mac, config.customer_id.c_str(), config.zone_id.c_str(), MQTT_CUSTOMER_BROADCAST)) {
+    LOG_ERROR("MQTT", "Error: Customer ID too long for topic buffer");
+    return false;
+  }
+  // A group that does not fit the topic buffer is left unsubscribed instead of failing the connection
+  if (topics.zoneBaseLength == 0) {
+    LOG_WARN("MQTT", "Zone topic for %s too long, not subscribing", config.zone_id.c_str());
+  }
+  if (MQTT_CUSTOMER_BROADCAST && topics.broadcastBaseLength == 0) {
+    LOG_WARN("MQTT", "Broadcast topic too long, not subscribing");
+  }
+  LOG_DEBUG("MQTT", "Topic table built for base topic: %s", topics.base);
+  return true;
+}
+
+// Snapshot topics are retained and always carry the current state, so while
+// offline only the latest request matters; serviceOutbox() builds the payload.
 void publishStatus() {
-  if (!mqttClient.connected()) {
-    Serial.println("[MQTT] Cannot publish status: Not connected");
+  pendingSnapshots |= SNAPSHOT_STATUS;
+}
+
+void publishTelemetry() {
+  pendingSnapshots |= SNAPSHOT_TELEMETRY;
+  // The full descriptor includes the channel 0 state; the other channels
+  // only report on their own state topics
+  pendingSnapshots &= ~SNAPSHOT_STATE;
+  for (uint8_t i = 1; i < config.channel_count; i++) {
+    pendingSnapshots |= SNAPSHOT_STATE << i;
+  }
+}
+
+void publishStateTelemetry(uint8_t channel) {
+  const ACChannel& unit = acChannels[channel];
+  if (!config.telemetry_on_change) {
+    publishTelemetry();
     return;
   }
-  String topic = "node/" + config.customer_id + "/" + getMACAddress() + "/status";
-  String payload = WiFi.status() == WL_CONNECTED ? "online" : "offline";
-  Serial.println("[MQTT] Publishing status to " + topic + ": " + payload);
-  if (mqttClient.publish(topic.c_str(), payload.c_str(), true)) {
-    Serial.println("[MQTT] Status published successfully");
-  } else {
-    Serial.println("[MQTT] Failed to publish status, state: " + String(mqttClient.state()));
-    publishError("MQTT", "Failed to publish status");
+  if (unit.stateTelemetryPublished && unit.state.power == unit.lastPublishedState.power && unit.state.mode == unit.lastPublishedState.mode &&
+      unit.state.degrees == unit.lastPublishedState.degrees && unit.state.fanspeed == unit.lastPublishedState.fanspeed) {
+    LOG_DEBUG("MQTT", "AC state of channel %u unchanged, skipping state telemetry", (unsigned)channel);
+    return;
+  }
+  if (channel > 0 || !(pendingSnapshots & SNAPSHOT_TELEMETRY)) {
+    pendingSnapshots |= SNAPSHOT_STATE << channel;
   }
 }
 
-void publishTelemetry() {
-  if (!mqttClient.connected()) {
-    Serial.println("[MQTT] Cannot publish telemetry: Not connected");
-    connectToMQTT();
-    return;
-  }
-  String topic = "node/" + config.customer_id + "/" + getMACAddress() + "/telemetry";
-  StaticJsonDocument<256> doc;
-  doc["device_id"] = getMACAddress();
-  doc["customer_id"] = config.customer_id;
-  doc["zone_id"] = config.zone_id;
-  doc["ac_brand"] = config.ac_brand;
-  doc["ac_protocol"] = config.ac_protocol;
-  doc["firmware_version"] = config.firmware_version;
-  doc["wifi_ssid"] = config.wifi_ssid;
-  doc["rssi"] = WiFi.RSSI();
-  doc["ac_power"] = acState.power;
-  switch (acState.mode) {
-    case stdAc::opmode_t::kAuto: doc["ac_mode"] = "auto"; break;
-    case stdAc::opmode_t::kCool: doc["ac_mode"] = "cool"; break;
-    case stdAc::opmode_t::kHeat: doc["ac_mode"] = "heat"; break;
-    case stdAc::opmode_t::kDry: doc["ac_mode"] = "dry"; break;
-    case stdAc::opmode_t::kFan: doc["ac_mode"] = "fan"; break;
-    default: doc["ac_mode"] = "cool";
-  }
-  doc["ac_temperature"] = acState.degrees;
-  switch (acState.fanspeed) {
-    case stdAc::fanspeed_t::kAuto: doc["ac_fanspeed"] = "auto"; break;
-    case stdAc::fanspeed_t::kMin: doc["ac_fanspeed"] = "min"; break;
-    case stdAc::fanspeed_t::kMedium: doc["ac_fanspeed"] = "medium"; break;
-    case stdAc::fanspeed_t::kMax: doc["ac_fanspeed"] = "max"; break;
-    default: doc["ac_fanspeed"] = "medium";
-  }
-  String payload;
-  serializeJson(doc, payload);
-  Serial.println("[MQTT] Publishing telemetry to " + topic + ", payload size: " + String(payload.length()) + " bytes");
-  Serial.println("[MQTT] Telemetry payload: " + payload);
-  if (mqttClient.publish(topic.c_str(), payload.c_str(), true)) {
-    Serial.println("[MQTT] Telemetry published successfully");
+void publishHeartbeat() {
+  char payload[48];
+  formatHeartbeat(payload, sizeof(payload), WiFi.RSSI(), millis() / 1000);
+  LOG_DEBUG("MQTT", "Queueing heartbeat: %s", payload);
+  enqueuePublish(PublishTopic::Heartbeat, payload, 0);
+}
+
+void publishMetrics() {
+  size_t length = metricsFormatJson(metricsBuffer, sizeof(metricsBuffer));
+  LOG_DEBUG("MQTT", "Queueing metrics, payload size: %u bytes", (unsigned)length);
+  enqueuePublish(PublishTopic::Metrics, metricsBuffer, 0);
+}
+
+// Samples at BATCH_SAMPLE_INTERVAL so short Wi-Fi dips and stalls are seen,
+// but publishes a single aggregate per BATCH_INTERVAL. Batches are queued
+// while offline like any event, so an outage still reports its drops.
+void handleTelemetryBatch() {
+  unsigned long currentTime = millis();
+  if (currentTime - lastBatchSample >= BATCH_SAMPLE_INTERVAL) {
+    lastBatchSample = currentTime;
+    // RSSI is meaningless while disassociated; the drop counters cover that time
+    if (WiFi.status() == WL_CONNECTED) {
+      telemetryBatch.sample(WiFi.RSSI(), ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), metricsTakeIntervalStall());
+    }
+  }
+  if (currentTime - batchStartedAt < BATCH_INTERVAL) {
+    return;
+  }
+  size_t length = telemetryBatch.format(metricsBuffer, sizeof(metricsBuffer), currentTime / 1000);
+  LOG_DEBUG("MQTT", "Queueing telemetry batch, %u samples, payload size: %u bytes", (unsigned)telemetryBatch.samples(), (unsigned)length);
+  enqueuePublish(PublishTopic::Batch, metricsBuffer, 0);
+  batchStartedAt = currentTime;
+  telemetryBatch.begin(currentTime / 1000);
+}
+
+bool sendSnapshot(uint8_t snapshot) {
+  bool sent = false;
+  uint8_t channel = 0;
+  if (snapshot == SNAPSHOT_STATUS) {
+    const char* payload = WiFi.status() == WL_CONNECTED ? "online" : "offline";
+    LOG_DEBUG("MQTT", "Publishing status to %s: %s", topics.status, payload);
+    sent = mqttClient.publish(topics.status, payload, true);
+  } else if (snapshot == SNAPSHOT_TELEMETRY) {
+    DeviceDescriptor device = {
+      topics.deviceId, config.customer_id.c_str(), config.zone_id.c_str(), config.ac_brand.c_str(),
+      config.ac_protocol.c_str(), config.firmware_version.c_str(), config.wifi_ssid.c_str(), WiFi.RSSI()
+    };
+    size_t length = formatTelemetry(publishPayload, sizeof(publishPayload), device, acChannels[0].state);
+    LOG_DEBUG("MQTT", "Publishing telemetry to %s, payload size: %u bytes", topics.telemetry, (unsigned)length);
+    LOG_DEBUG("MQTT", "Telemetry payload: %s", publishPayload);
+    sent = mqttClient.publish(topics.telemetry, publishPayload, true);
   } else {
-    Serial.println("[MQTT] Failed to publish telemetry, state: " + String(mqttClient.state()));
-    publishError("MQTT", "Failed to publish telemetry, state: " + String(mqttClient.state()));
+    while ((SNAPSHOT_STATE << channel) != snapshot) {
+      channel++;
+    }
+    char topic[MQTT_TOPIC_SIZE];
+    if (!buildChannelTopic(topic, sizeof(topic), topics, channel, "/telemetry/state")) {
+      LOG_WARN("MQTT", "Channel %u state topic too long, not publishing", (unsigned)channel);
+      return true;
+    }
+    formatStateTelemetry(publishPayload, sizeof(publishPayload), acChannels[channel].state);
+    LOG_DEBUG("MQTT", "Publishing state telemetry to %s: %s", topic, publishPayload);
+    sent = mqttClient.publish(topic, publishPayload, true);
+  }
+  if (!sent) {
+    LOG_ERROR("MQTT", "Failed to publish snapshot %u, state: %d", (unsigned)snapshot, mqttClient.state());
+    return false;
+  }
+  if (snapshot != SNAPSHOT_STATUS) {
+    lastTelemetryTime = millis();
+    acChannels[channel].lastPublishedState = acChannels[channel].state;
+    acChannels[channel].stateTelemetryPublished = true;
   }
+  return true;
 }
 
-void publishError(const String& errorType, const String& errorMessage) {
-  if (!mqttClient.connected()) {
-    Serial.println("[MQTT] Cannot publish error: Not connected");
+// Formatted and escaped into fixed buffers, so reporting an error never allocates
+void publishError(const char* errorType, const char* format, ...) {
+  char message[160];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  char escaped[192];
+  jsonEscape(message, escaped, sizeof(escaped));
+  char payload[256];
+  snprintf(payload, sizeof(payload), "{\"type\":\"%s\",\"message\":\"%s\",\"origin\":\"firmware\"}", errorType, escaped);
+  LOG_INFO("MQTT", "Queueing error: %s", payload);
+  enqueuePublish(PublishTopic::Error, payload, PUBLISH_RETAINED | PUBLISH_SPOOL);
+}
+
+// Never publishes directly, so command handling does not wait on the socket.
+// When the ring is full the oldest records are evicted, spooled ones to flash.
+void enqueuePublish(PublishTopic topic, const char* payload, uint8_t flags) {
+  size_t length = strlen(payload);
+  if (length >= PUBLISH_PAYLOAD_SIZE) {
+    LOG_ERROR("MQTT", "Dropping oversized message for %s: %u bytes", publishTopicName(topic), (unsigned)length);
+    metrics.publishDropped++;
     return;
   }
-  String topic = "node/" + config.customer_id + "/" + getMACAddress() + "/error";
-  StaticJsonDocument<256> doc;
-  doc["type"] = errorType;
-  doc["message"] = errorMessage;
-  doc["origin"] = "firmware";
-  String payload;
-  serializeJson(doc, payload);
-  Serial.println("[MQTT] Publishing error to " + topic + ": " + payload);
-  if (mqttClient.publish(topic.c_str(), payload.c_str(), true)) {
-    Serial.println("[MQTT] Error published successfully");
-  } else {
-    Serial.println("[MQTT] Failed to publish error, state: " + String(mqttClient.state()));
+  while (!publishQueue.fits(length) && !publishQueue.empty()) {
+    PublishQueue::Header header;
+    publishQueue.peek(header);
+    if (header.flags & PUBLISH_SPOOL) {
+      publishQueue.read(publishPayload, sizeof(publishPayload));
+      spoolMessage(header, publishPayload);
+    } else {
+      metrics.publishDropped++;
+    }
+    publishQueue.pop();
+  }
+  publishQueue.push((uint8_t)topic, flags, payload, length);
+}
+
+// Called from loop(); sends at most PUBLISH_DRAIN_BURST messages per PUBLISH_DRAIN_INTERVAL
+void serviceOutbox() {
+  if (!mqttClient.connected() || mqttConnectState != MQTTConnectState::Idle) {
+    return;
+  }
+  if (millis() - lastPublishDrain < PUBLISH_DRAIN_INTERVAL) {
+    return;
+  }
+  if (drainPublishQueue(PUBLISH_DRAIN_BURST) == PUBLISH_DRAIN_BURST) {
+    lastPublishDrain = millis(); // More may be waiting; pace the rest
+  }
+}
+
+// Sends up to budget messages: snapshots first, then spooled and queued events
+// in arrival order. Stops at the first failure and keeps that message.
+size_t drainPublishQueue(size_t budget) {
+  size_t sent = 0;
+  while (sent < budget && mqttClient.connected()) {
+    if (pendingSnapshots != 0) {
+      uint8_t snapshot = pendingSnapshots & -pendingSnapshots; // Lowest pending bit
+      if (!sendSnapshot(snapshot)) {
+        break;
+      }
+      pendingSnapshots &= ~snapshot;
+    } else if (spoolReadOffset > 0 || (PUBLISH_SPOOL_ENABLED && LittleFS.exists(PUBLISH_SPOOL_FILE))) {
+      if (!sendSpooledMessage()) {
+        break;
+      }
+    } else if (!publishQueue.empty()) {
+      PublishQueue::Header header;
+      publishQueue.peek(header);
+      publishQueue.read(publishPayload, sizeof(publishPayload));
+      const char* topic = publishTopicName((PublishTopic)header.topic);
+      LOG_DEBUG("MQTT", "Publishing to %s: %s", topic, publishPayload);
+      if (!mqttClient.publish(topic, publishPayload, header.flags & PUBLISH_RETAINED)) {
+        LOG_ERROR("MQTT", "Failed to publish to %s, state: %d", topic, mqttClient.state());
+        break;
+      }
+      publishQueue.pop();
+    } else {
+      break;
+    }
+    sent++;
+    metrics.publishSent++;
+  }
+  return sent;
+}
+
+// Publishes the next record of the spool file; removes the file once it is fully sent
+bool sendSpooledMessage() {
+  File file = LittleFS.open(PUBLISH_SPOOL_FILE, "r");
+  if (!file) {
+    spoolReadOffset = 0;
+    return true;
+  }
+  PublishQueue::Header header;
+  bool valid = file.seek(spoolReadOffset) &&
+               file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               header.length < sizeof(publishPayload) &&
+               file.read((uint8_t*)publishPayload, header.length) == header.length;
+  size_t fileSize = file.size();
+  file.close();
+  if (!valid) {
+    // End of file or a torn write; either way nothing more can be read
+    LittleFS.remove(PUBLISH_SPOOL_FILE);
+    spoolReadOffset = 0;
+    return true;
+  }
+  publishPayload[header.length] = '\0';
+  const char* topic = publishTopicName((PublishTopic)header.topic);
+  if (!mqttClient.publish(topic, publishPayload, header.flags & PUBLISH_RETAINED)) {
+    LOG_ERROR("MQTT", "Failed to publish spooled message to %s, state: %d", topic, mqttClient.state());
+    return false;
+  }
+  spoolReadOffset += sizeof(header) + header.length;
+  if (spoolReadOffset >= fileSize) {
+    LOG_INFO("MQTT", "Spooled messages delivered");
+    LittleFS.remove(PUBLISH_SPOOL_FILE);
+    spoolReadOffset = 0;
+  }
+  return true;
+}
+
+void spoolMessage(const PublishQueue::Header& header, const char* payload) {
+  if (!PUBLISH_SPOOL_ENABLED) {
+    metrics.publishDropped++;
+    return;
+  }
+  File file = LittleFS.open(PUBLISH_SPOOL_FILE, "a");
+  if (!file || file.size() + sizeof(header) + header.length > PUBLISH_SPOOL_LIMIT) {
+    LOG_WARN("MQTT", "Publish spool full, dropping message for %s", publishTopicName((PublishTopic)header.topic));
+    metrics.publishDropped++;
+    return;
+  }
+  file.write((const uint8_t*)&header, sizeof(header));
+  file.write((const uint8_t*)payload, header.length);
+  file.close();
+  metrics.publishSpooled++;
+}
+
+// Resolved at send time, so messages queued before the topic table exists still work
+const char* publishTopicName(PublishTopic topic) {
+  switch (topic) {
+    case PublishTopic::Heartbeat: return topics.heartbeat;
+    case PublishTopic::Metrics: return topics.metrics;
+    case PublishTopic::Ack: return topics.ack;
+    case PublishTopic::OtaStatus: return topics.otaStatus;
+    case PublishTopic::Batch: return topics.batch;
+    case PublishTopic::Error:
+    default: return topics.error;
   }
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String message;
-  for (unsigned int i = 0; i < length; i++) {
-    message += (char)payload[i];
-  }
-  String deviceId = getMACAddress();
-  String baseTopic = "node/" + config.customer_id + "/" + deviceId;
-  Serial.println("[MQTT] Received message on topic: " + String(topic) + ", payload: " + message);
-
-  if (String(topic) == baseTopic + "/command/power") {
-    sendIRSignal("power", message);
-  } else if (String(topic) == baseTopic + "/command/mode") {
-    sendIRSignal("mode", message);
-  } else if (String(topic) == baseTopic + "/command/temperature") {
-    sendIRSignal("temperature", message);
-  } else if (String(topic) == baseTopic + "/command/fanspeed") {
-    sendIRSignal("fanspeed", message);
-  } else if (String(topic) == baseTopic + "/ota/update") {
-    int commaIndex = message.indexOf(',');
-    if (commaIndex != -1) {
-      String url = message.substring(0, commaIndex);
-      String newVersion = message.substring(commaIndex + 1);
-      Serial.println("[MQTT] OTA update requested: URL=" + url + ", Version=" + newVersion);
-      performOTAUpdate(url, newVersion);
+  commandReceivedAt = micros();
+  lastActivityTime = millis();
+  if (strcmp(topic, topics.backpressure) == 0) {
+    applyBackpressureHint(reinterpret_cast<char*>(payload), length);
+    return;
+  }
+  bool group = false;
+  uint8_t channel = 0;
+  const TopicRoute* route = findTopicRoute(topics, topic, group, channel);
+  if (route == nullptr || (channel != AC_ALL_CHANNELS && channel >= config.channel_count)) {
+    LOG_DEBUG("MQTT", "Ignoring message on unknown topic: %s", topic);
+    return;
+  }
+  // Commands are decoded in place in the PubSubClient buffer; it is reused
+  // only after this callback returns, so it may be modified here
+  char* message = reinterpret_cast<char*>(payload);
+  LOG_DEBUG("MQTT", "Received message on topic: %s, payload: %.*s", topic, (int)length, message);
+
+  if (route->command == CommandType::OTAUpdate) {
+    const char* comma = static_cast<const char*>(memchr(message, ',', length));
+    if (comma != nullptr) {
+      size_t urlLength = comma - message;
+      String url;
+      String newVersion;
+      url.concat(message, urlLength);
+      newVersion.concat(comma + 1, length - urlLength - 1);
+      LOG_INFO("MQTT", "OTA update requested: URL=%s, Version=%s", url.c_str(), newVersion.c_str());
+      startOTAUpdate(url, newVersion);
     } else {
-      Serial.println("[MQTT] Error: Invalid OTA message format");
+      LOG_ERROR("MQTT", "Error: Invalid OTA message format");
       publishError("OTA", "Invalid OTA message format");
     }
+    return;
+  }
+  if (route->command == CommandType::State) {
+    if (channel == AC_ALL_CHANNELS) {
+      applyGroupStateCommand(message, length);
+    } else {
+      applyStateCommand(channel, message, length, group);
+    }
+    return;
+  }
+  if (route->command == CommandType::Schedule) {
+    applyScheduleCommand(message, length, group);
+    return;
+  }
+  if (route->command == CommandType::Channels) {
+    applyChannelsCommand(message, length);
+    return;
+  }
+  if (route->command == CommandType::LocalApi) {
+    applyLocalApiCommand(message, length);
+    return;
+  }
+  uint32_t sequence = 0;
+  size_t valueLength = length;
+  const char* value = unwrapCommandEnvelope(message, valueLength, sequence);
+  if (value == nullptr) {
+    LOG_ERROR("MQTT", "Error: Invalid %s command envelope", commandName(route->command));
+    publishError("IR", "Invalid %s command envelope", commandName(route->command));
+    return;
+  }
+  // Group senders have their own sequence space, so only device commands are deduplicated and acked
+  if (channel == AC_ALL_CHANNELS) {
+    for (uint8_t i = 0; i < config.channel_count; i++) {
+      sendIRSignal(i, route->command, value, valueLength, 0);
+    }
+  } else {
+    sendIRSignal(channel, route->command, value, valueLength, sequence);
   }
 }
 
-void sendIRSignal(const String& command, const String& value) {
-  decode_type_t protocol = getProtocolFromString(config.ac_protocol);
-  Serial.println("[IR] Sending IR signal: Command=" + command + ", Value=" + value + ", Protocol=" + String((int)protocol));
-  if (!ac.isProtocolSupported(protocol)) {
-    Serial.println("[IR] Error: Unsupported protocol: " + config.ac_protocol);
-    publishError("IR", "Unsupported protocol: " + config.ac_protocol);
+// Drops duplicate and out-of-order commands; backends retry with the same
+// sequence. Channels share one sequence space, as they share the device topics.
+bool acceptCommandSequence(uint8_t channel, uint32_t sequence) {
+  if (sequence == 0) {
+    return true;
+  }
+  if (sequence <= lastCommandSequence) {
+    if (acChannels[channel].hasPendingState && sequence <= acChannels[channel].pendingSequence) {
+      LOG_DEBUG("IR", "Duplicate command %lu is still pending", (unsigned long)sequence);
+      return false; // The flush acks it
+    }
+    bool duplicate = (sequence == lastCommandSequence);
+    LOG_WARN("IR", "Dropping %s command %lu (last %lu)", duplicate ? "duplicate" : "stale",
+             (unsigned long)sequence, (unsigned long)lastCommandSequence);
+    publishCommandAck(channel, sequence, duplicate ? "duplicate" : "stale");
+    return false;
+  }
+  lastCommandSequence = sequence;
+  return true;
+}
+
+// Acks are cumulative: the result for sequence N covers every earlier sequence
+// coalesced into the same IR frame. Unsequenced commands are not acked.
+void publishCommandAck(uint8_t channel, uint32_t sequence, const char* result) {
+  if (sequence == 0) {
     return;
   }
-  ac.next.protocol = protocol;
-  ac.next.model = 1;
+  char payload[160];
+  formatCommandAck(payload, sizeof(payload), sequence, result, channel, acChannels[channel].state);
+  LOG_DEBUG("MQTT", "Queueing command ack: %s", payload);
+  enqueuePublish(PublishTopic::Ack, payload, 0);
+}
 
-  ac.next.power = acState.power;
-  ac.next.mode = acState.mode;
-  ac.next.degrees = acState.degrees;
-  ac.next.fanspeed = acState.fanspeed;
-
-  if (command == "power") {
-    if (value == "on") {
-      ac.next.power = true;
-    } else if (value == "off") {
-      ac.next.power = false;
-    } else if (value == "toggle") {
-      ac.next.power = !ac.next.power;
-    } else {
-      Serial.println("[IR] Error: Invalid power command: " + value);
-      publishError("IR", "Invalid power command: " + value);
-      return;
+bool sendIRSignal(uint8_t channel, CommandType command, const char* value, size_t length, uint32_t sequence) {
+  LOG_DEBUG("IR", "Queueing command: Channel=%u, Command=%s, Value=%.*s, Seq=%lu", (unsigned)channel, commandName(command), (int)length, value, (unsigned long)sequence);
+  if (!acceptCommandSequence(channel, sequence)) {
+    return false;
+  }
+  ACChannel& unit = acChannels[channel];
+  // Commands arriving inside the coalescing window build on the pending state
+  ACState next = unit.hasPendingState ? unit.pendingState : unit.state;
+  if (!applyFieldCommand(command, value, length, next)) {
+    char shown[32]; // The value is not terminated and may be arbitrarily long
+    snprintf(shown, sizeof(shown), "%.*s", (int)length, value);
+    LOG_ERROR("IR", "Error: Invalid %s command: %s", commandName(command), shown);
+    publishError("IR", "Invalid %s command: %s", commandName(command), shown);
+    publishCommandAck(channel, sequence, "invalid");
+    return false;
+  }
+
+  unit.pendingState = next;
+  unit.pendingSequence = max(unit.pendingSequence, sequence);
+  if (!unit.hasPendingState) {
+    unit.hasPendingState = true;
+    unit.pendingSince = millis();
+    unit.pendingReceivedAt = commandReceivedAt;
+  }
+  if (COMMAND_COALESCE_WINDOW == 0) {
+    return flushPendingCommand(channel);
+  }
+  return true;
+}
+
+bool flushPendingCommand(uint8_t channel) {
+  ACChannel& unit = acChannels[channel];
+  if (!unit.hasPendingState) {
+    return true;
+  }
+  unit.hasPendingState = false;
+  uint32_t sequence = unit.pendingSequence;
+  unit.pendingSequence = 0;
+  LOG_DEBUG("IR", "Flushing coalesced commands for channel %u after %lu ms", (unsigned)channel, millis() - unit.pendingSince);
+  if (transmitACState(channel, unit.pendingState)) {
+    // Measured from the first command of the burst, so it includes the coalescing window
+    metricsRecordCommandLatency(micros() - unit.pendingReceivedAt);
+    publishCommandAck(channel, sequence, "ok");
+    if (!config.telemetry_on_change) {
+      publishStatus();
     }
-    acState.power = ac.next.power;
-  } else if (command == "mode") {
-    if (value == "auto") ac.next.mode = stdAc::opmode_t::kAuto;
-    else if (value == "cool") ac.next.mode = stdAc::opmode_t::kCool;
-    else if (value == "heat") ac.next.mode = stdAc::opmode_t::kHeat;
-    else if (value == "dry") ac.next.mode = stdAc::opmode_t::kDry;
-    else if (value == "fan") ac.next.mode = stdAc::opmode_t::kFan;
-    else {
-      Serial.println("[IR] Error: Invalid mode command: " + value);
-      publishError("IR", "Invalid mode command: " + value);
-      return;
+    publishStateTelemetry(channel);
+    return true;
+  }
+  publishCommandAck(channel, sequence, "ir_failed");
+  return false;
+}
+
+bool applyStateCommand(uint8_t channel, char* payload, size_t length, bool group) {
+  ACChannel& unit = acChannels[channel];
+  // Commands still in the coalescing window are the base for unset fields
+  ACState next = unit.hasPendingState ? unit.pendingState : unit.state;
+  uint32_t sequence = 0;
+  StateCommandResult result = decodeStateCommand(payload, length, next, sequence);
+  if (result == StateCommandResult::Malformed) {
+    LOG_ERROR("IR", "Error: Invalid state command payload");
+    publishError("IR", "Invalid state command payload");
+    return false;
+  }
+  if (group) {
+    sequence = 0;
+  }
+  if (!acceptCommandSequence(channel, sequence)) {
+    return false;
+  }
+  if (result == StateCommandResult::Empty) {
+    LOG_ERROR("IR", "Error: Empty state command");
+    publishError("IR", "Empty state command");
+    publishCommandAck(channel, sequence, "invalid");
+    return false;
+  }
+  if (result == StateCommandResult::Invalid) {
+    LOG_ERROR("IR", "Error: Invalid value in state command");
+    publishError("IR", "Invalid value in state command");
+    publishCommandAck(channel, sequence, "invalid");
+    return false;
+  }
+
+  LOG_DEBUG("IR", "Applying state command: Channel=%u, Power=%d, Mode=%d, Temp=%d, FanSpeed=%d", (unsigned)channel, next.power, (int)next.mode, next.degrees, (int)next.fanspeed);
+  // A full state command supersedes anything still waiting in the coalescing window,
+  // and its ack covers those commands too
+  unit.hasPendingState = false;
+  sequence = max(sequence, unit.pendingSequence);
+  unit.pendingSequence = 0;
+  // Status stays "online" across commands, so the telemetry carries the new state
+  if (transmitACState(channel, next)) {
+    metricsRecordCommandLatency(micros() - commandReceivedAt);
+    publishCommandAck(channel, sequence, "ok");
+    publishStateTelemetry(channel);
+    return true;
+  }
+  publishCommandAck(channel, sequence, "ir_failed");
+  return false;
+}
+
+// Zone and broadcast state commands reach every channel. The payload is
+// decoded in place, so all but the last channel work on a copy; "toggle"
+// flips each unit from its own state.
+void applyGroupStateCommand(char* payload, size_t length) {
+  uint8_t last = config.channel_count - 1;
+  if (last > 0 && length >= STATE_COMMAND_COPY_SIZE) {
+    LOG_ERROR("IR", "Error: Group state command too long for %u channels", (unsigned)config.channel_count);
+    publishError("IR", "Group state command too long");
+    return;
+  }
+  char copy[STATE_COMMAND_COPY_SIZE];
+  for (uint8_t i = 0; i < last; i++) {
+    memcpy(copy, payload, length);
+    applyStateCommand(i, copy, length, true);
+  }
+  applyStateCommand(last, payload, length, true);
+}
+
+// Replaces the extra channels: {"seq":N,"model":1,"channels":[{"pin":5,
+// "protocol":"DAIKIN","model":1}]}. "model" is channel 0's IRac model and
+// "channels" lists channels 1 and up; an empty array leaves only channel 0.
+// IR emitters are set up at boot, so the new channels are only saved and take
+// effect when the device reboots once the ack is sent.
+void applyChannelsCommand(char* payload, size_t length) {
+  JsonDocument& doc = jsonScratch();
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error || !doc["channels"].is<JsonArray>()) {
+    LOG_ERROR("CONFIG", "Error: Invalid channels payload");
+    publishError("CONFIG", "Invalid channels payload");
+    return;
+  }
+  uint32_t sequence = doc["seq"] | 0UL;
+  if (!acceptCommandSequence(0, sequence)) {
+    return;
+  }
+
+  ChannelConfig channels[AC_MAX_CHANNELS - 1] = {};
+  JsonArrayConst list = doc["channels"].as<JsonArrayConst>();
+  int model = doc["model"] | (int)config.ac_model;
+  bool valid = list.size() < AC_MAX_CHANNELS && model >= -1 && model <= INT16_MAX;
+  size_t count = 0;
+  for (JsonObjectConst object : list) {
+    if (!valid) {
+      break;
     }
-    ac.next.power = true;
-    acState.power = ac.next.power;
-    acState.mode = ac.next.mode;
-  } else if (command == "temperature") {
-    int temp = value.toInt();
-    if (temp < 16 || temp > 30) {
-      Serial.println("[IR] Error: Invalid temperature value: " + value);
-      publishError("IR", "Invalid temperature value: " + value);
-      return;
+    valid = parseChannelConfig(object, channels[count++]);
+  }
+  if (!valid) {
+    LOG_ERROR("CONFIG", "Error: Invalid AC channel or more than %u channels", (unsigned)AC_MAX_CHANNELS);
+    publishError("CONFIG", "Invalid AC channel or more than %u channels", (unsigned)AC_MAX_CHANNELS);
+    publishCommandAck(0, sequence, "invalid");
+    return;
+  }
+
+  config.ac_model = model;
+  stagedChannelCount = count + 1;
+  memcpy(stagedChannels, channels, sizeof(stagedChannels));
+  saveConfig();
+  LOG_INFO("CONFIG", "AC channels updated: %u channels, rebooting shortly", (unsigned)stagedChannelCount);
+  publishCommandAck(0, sequence, "ok");
+  restartPending = true;
+  restartRequestedAt = millis();
+}
+
+// protocol is a decode_type_t number, as in config.ac_protocol, or its name
+bool parseChannelConfig(JsonObjectConst object, ChannelConfig& channel) {
+  channel = {};
+  int pin = object["pin"] | -1;
+  bool validPin = false;
+  for (uint8_t allowed : AC_CHANNEL_PINS) {
+    validPin = validPin || pin == allowed;
+  }
+  JsonVariantConst protocolValue = object["protocol"];
+  decode_type_t protocol = protocolValue.is<int>() ? (decode_type_t)protocolValue.as<int>()
+                                                   : strToDecodeType(protocolValue | "");
+  int model = object["model"] | 1;
+  if (!validPin || !IRac::isProtocolSupported(protocol) || model < -1 || model > INT16_MAX) {
+    return false;
+  }
+  channel.pin = pin;
+  channel.protocol = protocol;
+  channel.model = model;
+  return true;
+}
+
+// Sets the LAN API token: {"seq":N,"token":"..."}. An empty token disables
+// the API. Takes effect immediately; the token never leaves the device again.
+void applyLocalApiCommand(char* payload, size_t length) {
+  JsonDocument& doc = jsonScratch();
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error || !doc["token"].is<const char*>()) {
+    LOG_ERROR("CONFIG", "Error: Invalid local API payload");
+    publishError("CONFIG", "Invalid local API payload");
+    return;
+  }
+  uint32_t sequence = doc["seq"] | 0UL;
+  if (!acceptCommandSequence(0, sequence)) {
+    return;
+  }
+  const char* token = doc["token"];
+  size_t tokenLength = strlen(token);
+  if (tokenLength != 0 && (tokenLength < LOCAL_TOKEN_MIN_LENGTH || tokenLength >= sizeof(BootImage::local_token))) {
+    LOG_ERROR("CONFIG", "Error: Local API token must be %u to %u characters", (unsigned)LOCAL_TOKEN_MIN_LENGTH,
+              (unsigned)(sizeof(BootImage::local_token) - 1));
+    publishError("CONFIG", "Invalid local API token length");
+    publishCommandAck(0, sequence, "invalid");
+    return;
+  }
+  config.local_token = token;
+  localAuthFailures = 0;
+  saveConfig();
+  LOG_INFO("CONFIG", "Local API %s", tokenLength != 0 ? "enabled" : "disabled");
+  publishCommandAck(0, sequence, "ok");
+}
+
+// Replaces the rule table: {"seq":N,"timezone":"CET-1CEST,M3.5.0,M10.5.0/3",
+// "rules":[{"days":62,"at":"08:00","power":"on","mode":"cool","temperature":22}]}.
+// A rule may add "channel":n for an extra AC channel. An empty rules array
+// clears the schedule.
+void applyScheduleCommand(char* payload, size_t length, bool group) {
+  // The largest document; parsed zero-copy into the arena
+  JsonDocument& doc = jsonScratch();
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error || !doc["rules"].is<JsonArray>()) {
+    LOG_ERROR("SCHEDULE", "Error: Invalid schedule payload");
+    publishError("SCHEDULE", "Invalid schedule payload");
+    return;
+  }
+  uint32_t sequence = group ? 0 : (doc["seq"] | 0UL);
+  if (!acceptCommandSequence(0, sequence)) {
+    return;
+  }
+
+  ScheduleTable next = {};
+  const char* timezone = doc["timezone"] | (const char*)schedule.timezone;
+  JsonArrayConst rules = doc["rules"].as<JsonArrayConst>();
+  bool valid = rules.size() <= SCHEDULE_MAX_RULES && strlcpy(next.timezone, timezone, sizeof(next.timezone)) < sizeof(next.timezone);
+  for (JsonObjectConst object : rules) {
+    if (!valid) {
+      break;
     }
-    ac.next.degrees = temp;
-    ac.next.power = true;
-    acState.power = ac.next.power;
-    acState.degrees = ac.next.degrees;
-  } else if (command == "fanspeed") {
-    if (value == "auto") ac.next.fanspeed = stdAc::fanspeed_t::kAuto;
-    else if (value == "low") ac.next.fanspeed = stdAc::fanspeed_t::kMin;
-    else if (value == "medium") ac.next.fanspeed = stdAc::fanspeed_t::kMedium;
-    else if (value == "high") ac.next.fanspeed = stdAc::fanspeed_t::kMax;
-    else {
-      Serial.println("[IR] Error: Invalid fanspeed command: " + value);
-      publishError("IR", "Invalid fanspeed command: " + value);
+    valid = parseScheduleRule(object, next.rules[next.count++]);
+  }
+  if (!valid) {
+    LOG_ERROR("SCHEDULE", "Error: Invalid schedule rule or too many rules");
+    publishError("SCHEDULE", "Invalid schedule rule or more than %u rules", (unsigned)SCHEDULE_MAX_RULES);
+    publishCommandAck(0, sequence, "invalid");
+    return;
+  }
+
+  bool timezoneChanged = strcmp(next.timezone, schedule.timezone) != 0;
+  schedule = next;
+  saveSchedule();
+  if (timezoneChanged) {
+    configureTime();
+  }
+  LOG_INFO("SCHEDULE", "Schedule updated: %u rules, timezone %s", (unsigned)schedule.count, schedule.timezone);
+  publishCommandAck(0, sequence, "ok");
+}
+
+bool parseScheduleRule(JsonObjectConst object, ScheduleRule& rule) {
+  rule = {};
+  int days = object["days"] | 0;
+  const char* at = object["at"] | "";
+  int hour;
+  int minute;
+  if (days < 1 || days > 0x7F || strlen(at) != 5 || at[2] != ':' ||
+      !parseBoundedInt(at, 2, 0, 23, hour) || !parseBoundedInt(at + 3, 2, 0, 59, minute)) {
+    return false;
+  }
+  rule.days = days;
+  rule.minute = hour * 60 + minute;
+  int channel = object["channel"] | 0;
+  if (channel < 0 || channel >= AC_MAX_CHANNELS) {
+    return false;
+  }
+
+  bool valid = true;
+  if (object.containsKey("power")) {
+    JsonVariantConst power = object["power"];
+    bool on = false;
+    if (power.is<bool>()) {
+      on = power.as<bool>();
+    } else {
+      // "toggle" has no meaning for a timed action
+      const char* value = power | "";
+      valid = valid && strcmp(value, "toggle") != 0 && parsePowerValue(value, strlen(value), false, on);
+    }
+    rule.power = on;
+    rule.fields |= RULE_POWER;
+  }
+  if (object.containsKey("mode")) {
+    const char* value = object["mode"] | "";
+    stdAc::opmode_t mode = stdAc::opmode_t::kCool;
+    valid = valid && parseModeValue(value, strlen(value), mode);
+    rule.mode = modeCode(mode);
+    rule.fields |= RULE_MODE;
+  }
+  if (object.containsKey("temperature")) {
+    int degrees = object["temperature"] | 0;
+    valid = valid && degrees >= 16 && degrees <= 30;
+    rule.degrees = degrees;
+    rule.fields |= RULE_TEMPERATURE;
+  }
+  if (object.containsKey("fanspeed")) {
+    const char* value = object["fanspeed"] | "";
+    stdAc::fanspeed_t fanspeed = stdAc::fanspeed_t::kAuto;
+    valid = valid && parseFanSpeedValue(value, strlen(value), fanspeed);
+    rule.fanspeed = fanSpeedCode(fanspeed);
+    rule.fields |= RULE_FANSPEED;
+  }
+  valid = valid && rule.fields != 0;
+  rule.fields |= channel << RULE_CHANNEL_SHIFT;
+  return valid;
+}
+
+void loadSchedule() {
+  schedule = {};
+  File file = LittleFS.open(SCHEDULE_FILE, "r");
+  if (file) {
+    ScheduleTable stored;
+    bool valid = file.read((uint8_t*)&stored, sizeof(stored)) == sizeof(stored) && stored.magic == SCHEDULE_MAGIC &&
+                 stored.count <= SCHEDULE_MAX_RULES && stored.timezone[sizeof(stored.timezone) - 1] == '\0' &&
+                 stored.crc == crc32((const uint8_t*)&stored, offsetof(ScheduleTable, crc));
+    file.close();
+    if (valid) {
+      schedule = stored;
+      LOG_INFO("SCHEDULE", "Loaded %u schedule rules", (unsigned)schedule.count);
       return;
     }
-    ac.next.power = true;
-    acState.power = ac.next.power;
-    acState.fanspeed = ac.next.fanspeed;
+    LOG_ERROR("SCHEDULE", "Error: Schedule file corrupted, ignoring it");
   }
+  strlcpy(schedule.timezone, DEFAULT_TIMEZONE, sizeof(schedule.timezone));
+}
 
-  if (!ac.sendAc()) {
-    Serial.println("[IR] Error: Failed to send IR signal");
-    publishError("IR", "Failed to send IR signal");
+void saveSchedule() {
+  schedule.magic = SCHEDULE_MAGIC;
+  schedule.crc = crc32((const uint8_t*)&schedule, offsetof(ScheduleTable, crc));
+  File file = LittleFS.open(SCHEDULE_FILE, "w");
+  if (!file || file.write((const uint8_t*)&schedule, sizeof(schedule)) != sizeof(schedule)) {
+    LOG_ERROR("SCHEDULE", "Error: Failed to write schedule file");
+    publishError("SCHEDULE", "Failed to write schedule file");
+  }
+  file.close();
+}
+
+// Starts SNTP in the background; rules run once the clock is valid
+void configureTime() {
+  configTime(schedule.timezone, NTP_SERVER_1, NTP_SERVER_2);
+  timeConfigured = true;
+  LOG_INFO("SCHEDULE", "Time sync started, timezone %s", schedule.timezone);
+}
+
+// Runs every rule due since the last call, at most once per minute
+void handleSchedule() {
+  if (!timeConfigured) {
+    return;
+  }
+  time_t now = time(nullptr);
+  if (now < SCHEDULE_MIN_VALID_TIME) {
+    return;
+  }
+  time_t minute = now / 60;
+  if (minute == lastScheduleMinute) {
+    return;
+  }
+  time_t from = lastScheduleMinute + 1;
+  if (lastScheduleMinute == 0 || minute < from || minute - from >= SCHEDULE_MAX_CATCHUP) {
+    from = minute; // First sync, or the clock jumped; do not replay old rules
+  }
+  lastScheduleMinute = minute;
+  for (time_t m = from; m <= minute; m++) {
+    runScheduleMinute(m);
+  }
+}
+
+void runScheduleMinute(time_t minute) {
+  time_t timestamp = minute * 60;
+  struct tm local;
+  localtime_r(&timestamp, &local);
+  uint16_t minuteOfDay = local.tm_hour * 60 + local.tm_min;
+  for (uint8_t i = 0; i < schedule.count; i++) {
+    const ScheduleRule& rule = schedule.rules[i];
+    if (rule.minute == minuteOfDay && (rule.days & (1 << local.tm_wday))) {
+      LOG_INFO("SCHEDULE", "Running rule %u at %02d:%02d", (unsigned)i, local.tm_hour, local.tm_min);
+      runScheduleRule(rule);
+    }
+  }
+}
+
+// Goes through the same path as a state command, without a cloud round trip
+void runScheduleRule(const ScheduleRule& rule) {
+  uint8_t channel = rule.fields >> RULE_CHANNEL_SHIFT;
+  if (channel >= config.channel_count) {
+    LOG_WARN("SCHEDULE", "Skipping rule for unconfigured channel %u", (unsigned)channel);
+    return;
+  }
+  ACChannel& unit = acChannels[channel];
+  ACState next = unit.hasPendingState ? unit.pendingState : unit.state;
+  // Codes were validated when the rule was parsed
+  if (rule.fields & RULE_MODE) {
+    decodeModeCode(rule.mode, next.mode);
+    next.power = true;
+  }
+  if (rule.fields & RULE_TEMPERATURE) {
+    next.degrees = rule.degrees;
+    next.power = true;
+  }
+  if (rule.fields & RULE_FANSPEED) {
+    decodeFanSpeedCode(rule.fanspeed, next.fanspeed);
+    next.power = true;
+  }
+  if (rule.fields & RULE_POWER) {
+    next.power = rule.power;
+  }
+  // Like a state command, the rule supersedes commands still in the coalescing window
+  unit.hasPendingState = false;
+  uint32_t sequence = unit.pendingSequence;
+  unit.pendingSequence = 0;
+  if (transmitACState(channel, next)) {
+    publishCommandAck(channel, sequence, "ok");
+    publishStateTelemetry(channel);
   } else {
-    Serial.println("[IR] IR signal sent successfully");
-    saveACState();
-    publishStatus();
-    publishTelemetry();
+    publishCommandAck(channel, sequence, "ir_failed");
+  }
+}
+
+bool transmitACState(uint8_t channel, const ACState& next) {
+  decode_type_t protocol = getProtocolFromString(config.ac_protocol);
+  int16_t model = config.ac_model;
+  if (channel > 0) {
+    protocol = (decode_type_t)config.extra_channels[channel - 1].protocol;
+    model = config.extra_channels[channel - 1].model;
+  }
+  if (!IRac::isProtocolSupported(protocol)) {
+    LOG_ERROR("IR", "Error: Unsupported protocol %d on channel %u", (int)protocol, (unsigned)channel);
+    publishError("IR", "Unsupported protocol %d on channel %u", (int)protocol, (unsigned)channel);
+    return false;
+  }
+  if (acChannels[channel].ir == nullptr) {
+    LOG_ERROR("IR", "Error: No IR emitter set up for channel %u", (unsigned)channel);
+    publishError("IR", "No IR emitter set up for channel %u", (unsigned)channel);
+    return false;
+  }
+  IRac& ir = *acChannels[channel].ir;
+  ir.next.protocol = protocol;
+  ir.next.model = model;
+  ir.next.power = next.power;
+  ir.next.mode = next.mode;
+  ir.next.degrees = next.degrees;
+  ir.next.fanspeed = next.fanspeed;
+
+  if (!ir.sendAc()) {
+    LOG_ERROR("IR", "Error: Failed to send IR signal on channel %u", (unsigned)channel);
+    publishError("IR", "Failed to send IR signal on channel %u", (unsigned)channel);
+    return false;
+  }
+  LOG_DEBUG("IR", "IR signal sent successfully on channel %u", (unsigned)channel);
+  acChannels[channel].state = next;
+  saveACState(channel);
+  telemetryBatch.recordState(millis() / 1000, channel, next);
+  return true;
+}
+
+void startOTAUpdate(const String& url, const String& newVersion) {
+  if (newVersion == FIRMWARE_VERSION) {
+    LOG_INFO("OTA", "Already running %s, skipping update", FIRMWARE_VERSION);
+    publishOTAStatus("skipped", newVersion);
+    return;
+  }
+  if (otaUpdater.busy()) {
+    LOG_WARN("OTA", "Update to %s already in progress, ignoring request", otaUpdater.version().c_str());
+    publishOTAStatus("busy", newVersion);
+    return;
   }
+  LOG_INFO("OTA", "Starting OTA update from URL: %s, New Version: %s", url.c_str(), newVersion.c_str());
+  otaUpdater.start(url, newVersion, random(OTA_START_JITTER));
+  otaReportedProgress = 0;
+  otaReportedRetries = 0;
+  publishOTAStatus("scheduled", newVersion);
 }
 
-void performOTAUpdate(const String& url, const String& newVersion) {
-  Serial.println("[OTA] Starting OTA update from URL: " + url + ", New Version: " + newVersion);
-  espClient.setTimeout(HTTP_TIMEOUT);
-  t_httpUpdate_return ret = ESPhttpUpdate.update(espClient, url);
-  switch (ret) {
-    case HTTP_UPDATE_OK:
-      config.firmware_version = newVersion;
+// Runs from loop(): moves the download forward and reports progress and the result
+void handleOTAUpdate() {
+  otaUpdater.loop();
+  switch (otaUpdater.state()) {
+    case OtaUpdater::State::Downloading:
+      if (otaUpdater.progress() >= otaReportedProgress + OTA_PROGRESS_STEP) {
+        otaReportedProgress = otaUpdater.progress() - otaUpdater.progress() % OTA_PROGRESS_STEP;
+        publishOTAStatus("downloading", otaUpdater.version());
+      }
+      break;
+    case OtaUpdater::State::Retrying:
+      if (otaUpdater.retries() != otaReportedRetries) {
+        otaReportedRetries = otaUpdater.retries();
+        publishOTAStatus("retrying", otaUpdater.version());
+      }
+      break;
+    case OtaUpdater::State::Succeeded:
+      // The update reboots the device, so persist any state still held back
+      for (uint8_t i = 0; i < config.channel_count; i++) {
+        flushPendingCommand(i);
+        flushACState(i);
+      }
+      config.firmware_version = otaUpdater.version();
       saveConfig();
+      publishOTAStatus("success", otaUpdater.version());
       publishStatus();
       publishTelemetry();
-      Serial.println("[OTA] Update successful, rebooting...");
+      drainPublishQueue(SIZE_MAX);
+      LOG_INFO("OTA", "Update successful, rebooting...");
+      delay(100);
       ESP.restart();
       break;
-    case HTTP_UPDATE_FAILED:
-      Serial.println("[OTA] Update failed: " + String(ESPhttpUpdate.getLastErrorString()));
-      publishError("OTA", "Update failed: " + String(ESPhttpUpdate.getLastErrorString()));
+    case OtaUpdater::State::Failed:
+      publishOTAStatus("failed", otaUpdater.version());
+      publishError("OTA", "Update failed: %s", otaUpdater.error().c_str());
+      otaUpdater.reset();
       break;
-    case HTTP_UPDATE_NO_UPDATES:
-      Serial.println("[OTA] No update available");
-      publishError("OTA", "No update available");
+    default:
       break;
   }
 }
 
-String getMACAddress() {
-  String mac = WiFi.macAddress();
-  Serial.println("[DEVICE] MAC Address: " + mac);
-  return mac;
+// Progress fields always describe the current download, also when a request is skipped
+void publishOTAStatus(const char* state, const String& version) {
+  JsonDocument& doc = jsonScratch();
+  doc["state"] = state;
+  doc["version"] = version.c_str();
+  doc["current_version"] = FIRMWARE_VERSION;
+  doc["progress"] = otaUpdater.progress();
+  doc["written"] = otaUpdater.written();
+  doc["total"] = otaUpdater.total();
+  doc["retries"] = otaUpdater.retries();
+  if (otaUpdater.state() == OtaUpdater::State::Failed) {
+    doc["error"] = otaUpdater.error().c_str();
+  }
+  char payload[256];
+  serializeJson(doc, payload, sizeof(payload));
+  LOG_DEBUG("OTA", "Queueing OTA status: %s", payload);
+  // Retained, so the backend sees the last result even after reconnecting
+  enqueuePublish(PublishTopic::OtaStatus, payload, PUBLISH_RETAINED);
 }
 
-bool validateZoneID(const String& customerId, const String& zoneId) {
-  Serial.println("[API] Validating Zone ID: CustomerID=" + customerId + ", ZoneID=" + zoneId);
-  
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("[API] Error: Wi-Fi not connected");
-    publishError("WiFi", "Wi-Fi not connected before zone validation");
+void getMACAddress(char* output, size_t size) {
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  snprintf(output, size, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  LOG_DEBUG("DEVICE", "MAC Address: %s", output);
+}
+
+// A truncated body must never be sent, so an oversized request is refused
+bool serializeApiRequest(const JsonDocument& doc, char* payload, size_t size) {
+  if (measureJson(doc) >= size) {
+    LOG_ERROR("API", "Error: Request body exceeds %u bytes", (unsigned)size);
+    publishError("API", "Request body exceeds %u bytes", (unsigned)size);
     return false;
   }
+  serializeJson(doc, payload, size);
+  return true;
+}
 
-  IPAddress resolvedIP;
-  if (!WiFi.hostByName("accontrolapi-922006260296.us-central1.run.app", resolvedIP)) {
-    Serial.println("[API] Error: DNS resolution failed");
-    publishError("DNS", "Failed to resolve API hostname");
+bool validateZoneID(const String& customerId, const String& zoneId, int16_t& protocolHint) {
+  LOG_INFO("API", "Validating Zone ID: CustomerID=%s, ZoneID=%s", customerId.c_str(), zoneId.c_str());
+  protocolHint = -1;
+  if (!prepareApiRequest("zone validation")) {
     return false;
   }
-  Serial.println("[API] DNS resolved to: " + resolvedIP.toString());
-
-  WiFiClientSecure secureClient;
-  secureClient.setInsecure();
-  HTTPClient http;
-  http.setTimeout(HTTP_TIMEOUT);
-  String url = String(API_BASE_URL) + "/validate-zone";
-  
-  Serial.println("[API] Free heap before HTTP: " + String(ESP.getFreeHeap()));
-  if (!http.begin(secureClient, url)) {
-    Serial.println("[API] Error: Failed to initialize HTTP client for zone validation");
-    publishError("API", "Failed to initialize HTTP client for zone validation");
+
+  JsonDocument& doc = jsonScratch();
+  doc["customer_id"] = customerId.c_str();
+  doc["zone_id"] = zoneId.c_str();
+  doc["ac_brand_name"] = config.ac_brand.c_str();
+  char payload[API_BODY_SIZE];
+  if (!serializeApiRequest(doc, payload, sizeof(payload))) {
     return false;
   }
+  LOG_DEBUG("API", "Sending validation payload: %s", payload);
 
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("X-Device-Secret", API_KEY);
-
-  StaticJsonDocument<256> doc;
-  doc["customer_id"] = customerId;
-  doc["zone_id"] = zoneId;
-  String payload;
-  serializeJson(doc, payload);
-  Serial.println("[API] Sending validation payload: " + payload);
-
-  int httpCode = http.POST(payload);
+  char response[API_BODY_SIZE];
+  int httpCode = apiClient.post("/validate-zone", payload, response, sizeof(response));
   bool success = false;
   if (httpCode > 0) { // Positive codes indicate a server response
     if (httpCode == 200) {
-      String response = http.getString();
-      Serial.println("[API] Raw response: " + response);
-      StaticJsonDocument<256> respDoc;
+      LOG_DEBUG("API", "Raw response: %s", response);
+      // The request body is already serialized, so the arena is free again
+      JsonDocument& respDoc = jsonScratch();
       DeserializationError error = deserializeJson(respDoc, response);
       if (!error) {
         success = respDoc["valid"] | false;
-        Serial.println("[API] Zone validation result: " + String(success));
+        // Protocols are stored as decimal decode_type_t values, like config.ac_protocol
+        const char* hint = respDoc["protocol_hint"] | "";
+        int value;
+        if (parseBoundedInt(hint, strlen(hint), 0, INT16_MAX, value)) {
+          protocolHint = (int16_t)value;
+        }
+        LOG_INFO("API", "Zone validation result: %d, protocol hint: %d", success, (int)protocolHint);
       } else {
-        Serial.println("[API] Error: Failed to parse zone validation response: " + String(error.c_str()));
-        publishError("API", "Failed to parse zone validation response: " + String(error.c_str()));
+        LOG_ERROR("API", "Error: Failed to parse zone validation response: %s", error.c_str());
+        publishError("API", "Failed to parse zone validation response: %s", error.c_str());
       }
     } else {
-      Serial.println("[API] Error: Zone validation failed with HTTP code: " + String(httpCode));
-      publishError("API", "Zone validation failed with HTTP code: " + String(httpCode));
+      LOG_ERROR("API", "Error: Zone validation failed with HTTP code: %d", httpCode);
+      publishError("API", "Zone validation failed with HTTP code: %d", httpCode);
     }
   } else { // Negative codes indicate client-side errors
-    Serial.println("[API] Error: HTTP client error with code: " + String(httpCode));
-    if (httpCode == HTTPC_ERROR_READ_TIMEOUT) {
-      Serial.println("[API] Error: HTTP read timeout occurred");
-      publishError("API", "HTTP read timeout occurred");
-    } else {
-      publishError("API", "HTTP client error with code: " + String(httpCode));
-    }
+    reportApiClientError(httpCode);
   }
-  http.end();
-  Serial.println("[API] Free heap after HTTP: " + String(ESP.getFreeHeap()));
+  LOG_DEBUG("API", "Free heap after HTTP: %u", (unsigned)ESP.getFreeHeap());
   return success;
 }
 
-bool registerDevice() {
-  Serial.println("[API] Registering device for CustomerID=" + config.customer_id);
-  
-  // Check Wi-Fi status
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("[API] Error: Wi-Fi not connected");
-    publishError("WiFi", "Wi-Fi not connected before device registration");
+bool registerDevice(int& httpCode) {
+  LOG_INFO("API", "Registering device for CustomerID=%s", config.customer_id.c_str());
+  httpCode = 0;
+  if (!prepareApiRequest("device registration")) {
     return false;
   }
 
-  // Test DNS resolution
-  IPAddress resolvedIP;
-  if (!WiFi.hostByName("accontrolapi-922006260296.us-central1.run.app", resolvedIP)) {
-    Serial.println("[API] Error: DNS resolution failed");
-    publishError("DNS", "Failed to resolve API hostname");
-    return false;
-  }
-  Serial.println("[API] DNS resolved to: " + resolvedIP.toString());
-
-  // Initialize secure client
-  WiFiClientSecure secureClient;
-  secureClient.setInsecure(); // TODO: Replace with proper certificate validation
-  HTTPClient http;
-  http.setTimeout(HTTP_TIMEOUT);
-  String url = String(API_BASE_URL) + "/customers/" + config.customer_id + "/devices";
-  
-  Serial.println("[API] Free heap before HTTP: " + String(ESP.getFreeHeap()));
-  if (!http.begin(secureClient, url)) {
-    Serial.println("[API] Error: Failed to initialize HTTP client for device registration");
-    Serial.println("[API] URL: " + url);
-    publishError("API", "Failed to initialize HTTP client for device registration");
+  char mac[18];
+  getMACAddress(mac, sizeof(mac));
+  JsonDocument& doc = jsonScratch();
+  doc["device_id"] = (const char*)mac;
+  doc["zone_id"] = config.zone_id.c_str();
+  doc["ac_brand_name"] = config.ac_brand.c_str();
+  doc["ac_brand_protocol"] = config.ac_protocol.c_str();
+  doc["firmware_version"] = config.firmware_version.c_str();
+  char payload[API_BODY_SIZE];
+  if (!serializeApiRequest(doc, payload, sizeof(payload))) {
     return false;
   }
+  LOG_DEBUG("API", "Sending registration payload: %s", payload);
 
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("X-Device-Secret", API_KEY);
-
-  StaticJsonDocument<256> doc;
-  doc["device_id"] = getMACAddress();
-  doc["zone_id"] = config.zone_id;
-  doc["ac_brand_name"] = config.ac_brand;
-  doc["ac_brand_protocol"] = config.ac_protocol;
-  doc["firmware_version"] = config.firmware_version;
-  String payload;
-  serializeJson(doc, payload);
-  Serial.println("[API] Sending registration payload: " + payload);
-
-  int httpCode = http.POST(payload);
+  char path[96];
+  snprintf(path, sizeof(path), "/customers/%s/devices", config.customer_id.c_str());
+  char response[API_BODY_SIZE];
+  httpCode = apiClient.post(path, payload, response, sizeof(response));
   bool success = (httpCode == 201);
   if (httpCode > 0) { // Server responded
     if (!success) {
-      String response = http.getString();
-      Serial.println("[API] Error: Device registration failed with code: " + String(httpCode));
-      Serial.println("[API] Raw response: " + response);
-      publishError("API", "Device registration failed with code: " + String(httpCode) + ", response: " + response);
+      LOG_ERROR("API", "Error: Device registration failed with code: %d", httpCode);
+      LOG_DEBUG("API", "Raw response: %s", response);
+      publishError("API", "Device registration failed with code: %d, response: %s", httpCode, response);
     } else {
-      Serial.println("[API] Device registered successfully");
+      LOG_INFO("API", "Device registered successfully");
     }
   } else { // Client-side error
-    Serial.println("[API] Error: HTTP client error with code: " + String(httpCode));
-    if (httpCode == HTTPC_ERROR_READ_TIMEOUT) {
-      Serial.println("[API] Error: HTTP read timeout occurred");
-      publishError("API", "HTTP read timeout occurred");
+    reportApiClientError(httpCode);
+  }
+  LOG_DEBUG("API", "Free heap after HTTP: %u", (unsigned)ESP.getFreeHeap());
+  return success;
+}
+
+// The setup is only persisted once the backend has accepted the device, so a
+// rejected zone never boots into normal mode unregistered. Clearing the
+// protocol also keeps a later Wi-Fi resubmit from saving a complete config.
+bool registerAndSaveConfig(int& httpCode) {
+  if (!registerDevice(httpCode)) {
+    config.ac_protocol = "";
+    return false;
+  }
+  saveConfig();
+  return true;
+}
+
+bool prepareApiRequest(const char* action) {
+  if (WiFi.status() != WL_CONNECTED) {
+    LOG_ERROR("API", "Error: Wi-Fi not connected");
+    publishError("WiFi", "Wi-Fi not connected before %s", action);
+    return false;
+  }
+  LOG_DEBUG("API", "Free heap before HTTP: %u", (unsigned)ESP.getFreeHeap());
+  return true;
+}
+
+void reportApiClientError(int httpCode) {
+  LOG_ERROR("API", "Error: HTTP client error with code: %d", httpCode);
+  if (httpCode == HTTPC_ERROR_READ_TIMEOUT) {
+    LOG_ERROR("API", "Error: HTTP read timeout occurred");
+    publishError("API", "HTTP read timeout occurred");
+  } else {
+    publishError("API", "HTTP client error with code: %d", httpCode);
+  }
+  // Drop a connection that may be half-open so the next request starts clean
+  apiClient.end();
+}
+
+// Binary search over the flash table; brand names compare case-insensitively
+bool findBrand(const char* name, BrandEntry& entry) {
+  size_t low = 0;
+  size_t high = BRAND_COUNT;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    int order = strcasecmp_P(name, brandTable[mid].name);
+    if (order == 0) {
+      readBrand(mid, entry);
+      return true;
+    }
+    if (order < 0) {
+      high = mid;
     } else {
-      publishError("API", "HTTP client error with code: " + String(httpCode));
+      low = mid + 1;
     }
   }
-  http.end();
-  Serial.println("[API] Free heap after HTTP: " + String(ESP.getFreeHeap()));
-  return success;
+  return false;
+}
+
+void readBrand(size_t index, BrandEntry& entry) {
+  memcpy_P(&entry, &brandTable[index], sizeof(entry));
+}
+
+decode_type_t brandProtocol(const BrandEntry& entry, size_t index) {
+  return (decode_type_t)(int16_t)pgm_read_word(&brandProtocolList[entry.offset + index]);
 }
 
 decode_type_t getProtocolFromString(const String& protocolStr) {
   decode_type_t protocol = (decode_type_t)protocolStr.toInt();
-  Serial.println("[IR] Converting protocol string: " + protocolStr + " to decode_type_t: " + String((int)protocol));
+  LOG_DEBUG("IR", "Converting protocol string: %s to decode_type_t: %d", protocolStr.c_str(), (int)protocol);
   return protocol;
 }
\ No newline at end of file
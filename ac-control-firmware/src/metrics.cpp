@@ -0,0 +1,115 @@
+#include "metrics.h"
+
+const uint32_t LOOP_HISTOGRAM_BOUNDS_US[LOOP_HISTOGRAM_BUCKETS - 1] = {
+  1000, 2000, 5000, 10000, 20000, 50000, 100000
+};
+
+// Heap figures are sampled at this rate rather than on every iteration
+const unsigned long HEAP_SAMPLE_INTERVAL = 1000;
+
+Metrics metrics;
+
+namespace {
+uint32_t lastLoopMicros = 0;
+uint32_t unaccountedIdleUs = 0; // Idle time inside the current loop iteration
+unsigned long lastHeapSample = 0;
+}
+
+void metricsLoopTick() {
+  uint32_t now = micros();
+  if (lastLoopMicros != 0) {
+    uint32_t elapsed = now - lastLoopMicros;
+    elapsed = elapsed > unaccountedIdleUs ? elapsed - unaccountedIdleUs : 0;
+    size_t bucket = 0;
+    while (bucket < LOOP_HISTOGRAM_BUCKETS - 1 && elapsed >= LOOP_HISTOGRAM_BOUNDS_US[bucket]) {
+      bucket++;
+    }
+    metrics.loopHistogram[bucket]++;
+    metrics.loopCount++;
+    if (elapsed > metrics.maxLoopStallUs) {
+      metrics.maxLoopStallUs = elapsed;
+    }
+    if (elapsed > metrics.intervalMaxLoopUs) {
+      metrics.intervalMaxLoopUs = elapsed;
+    }
+  }
+  lastLoopMicros = now;
+  unaccountedIdleUs = 0;
+
+  if (millis() - lastHeapSample >= HEAP_SAMPLE_INTERVAL) {
+    lastHeapSample = millis();
+    uint32_t freeHeap = ESP.getFreeHeap();
+    uint32_t maxFreeBlock = ESP.getMaxFreeBlockSize();
+    if (freeHeap < metrics.minFreeHeap) {
+      metrics.minFreeHeap = freeHeap;
+    }
+    if (maxFreeBlock < metrics.minMaxFreeBlock) {
+      metrics.minMaxFreeBlock = maxFreeBlock;
+    }
+  }
+}
+
+void metricsRecordCommandLatency(uint32_t latencyUs) {
+  metrics.commandCount++;
+  metrics.commandLatencyLastUs = latencyUs;
+  metrics.commandLatencyTotalUs += latencyUs;
+  if (latencyUs > metrics.commandLatencyMaxUs) {
+    metrics.commandLatencyMaxUs = latencyUs;
+  }
+}
+
+void metricsSetPowerMode(const char* mode, uint8_t listenInterval, uint16_t activeCurrentMa, uint16_t idleCurrentMa) {
+  metrics.powerMode = mode;
+  metrics.listenInterval = listenInterval;
+  metrics.activeCurrentMa = activeCurrentMa;
+  metrics.idleCurrentMa = idleCurrentMa;
+}
+
+void metricsRecordIdle(uint32_t idleUs) {
+  metrics.idleUs += idleUs;
+  unaccountedIdleUs += idleUs;
+}
+
+void metricsRecordTlsConnect() {
+  uint32_t maxFreeBlock = ESP.getMaxFreeBlockSize();
+  metrics.tlsConnects++;
+  if (maxFreeBlock < metrics.tlsMinBlock) {
+    metrics.tlsMinBlock = maxFreeBlock;
+  }
+}
+
+uint32_t metricsTakeIntervalStall() {
+  uint32_t stall = metrics.intervalMaxLoopUs;
+  metrics.intervalMaxLoopUs = 0;
+  return stall;
+}
+
+size_t metricsFormatJson(char* buffer, size_t size) {
+  uint32_t averageLatency = metrics.commandCount ? (uint32_t)(metrics.commandLatencyTotalUs / metrics.commandCount) : 0;
+  // Average current weighs idle time at the sleep figure and the rest at the active one
+  uint64_t uptimeUs = (uint64_t)millis() * 1000;
+  uint64_t idleUs = metrics.idleUs < uptimeUs ? metrics.idleUs : uptimeUs;
+  uint32_t idlePermille = uptimeUs ? (uint32_t)(idleUs * 1000 / uptimeUs) : 0;
+  uint32_t currentTenthsMa = (metrics.activeCurrentMa * (1000 - idlePermille) + metrics.idleCurrentMa * idlePermille) / 100;
+  const uint32_t* h = metrics.loopHistogram;
+  int length = snprintf(buffer, size,
+    "{\"uptime\":%lu,"
+    "\"loop\":{\"count\":%u,\"max_stall_us\":%u,\"histogram\":[%u,%u,%u,%u,%u,%u,%u,%u]},"
+    "\"heap\":{\"free\":%u,\"min_free\":%u,\"fragmentation\":%u,\"max_free_block\":%u,\"min_max_free_block\":%u,\"tls_connects\":%u,\"tls_min_block\":%u},"
+    "\"mqtt\":{\"attempts\":%u,\"connects\":%u,\"failures\":%u},"
+    "\"publish\":{\"sent\":%u,\"dropped\":%u,\"spooled\":%u},"
+    "\"command\":{\"count\":%u,\"last_us\":%u,\"avg_us\":%u,\"max_us\":%u},"
+    "\"power\":{\"mode\":\"%s\",\"listen_interval\":%u,\"idle_permille\":%u,\"est_current_ma\":%u.%u}}",
+    millis() / 1000,
+    metrics.loopCount, metrics.maxLoopStallUs, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+    ESP.getFreeHeap(), metrics.minFreeHeap, ESP.getHeapFragmentation(), ESP.getMaxFreeBlockSize(), metrics.minMaxFreeBlock,
+    metrics.tlsConnects, metrics.tlsMinBlock,
+    metrics.mqttConnectAttempts, metrics.mqttConnects, metrics.mqttConnectFailures,
+    metrics.publishSent, metrics.publishDropped, metrics.publishSpooled,
+    metrics.commandCount, metrics.commandLatencyLastUs, averageLatency, metrics.commandLatencyMaxUs,
+    metrics.powerMode, metrics.listenInterval, idlePermille, currentTenthsMa / 10, currentTenthsMa % 10);
+  if (length < 0) {
+    return 0;
+  }
+  return (size_t)length < size ? length : size - 1;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Loop iteration time histogram: bucket i counts iterations shorter than
+// LOOP_HISTOGRAM_BOUNDS_US[i]; the last bucket collects everything longer
+const size_t LOOP_HISTOGRAM_BUCKETS = 8;
+extern const uint32_t LOOP_HISTOGRAM_BOUNDS_US[LOOP_HISTOGRAM_BUCKETS - 1];
+
+struct Metrics {
+  uint32_t loopHistogram[LOOP_HISTOGRAM_BUCKETS] = {};
+  uint32_t loopCount = 0;
+  uint32_t maxLoopStallUs = 0;
+  uint32_t minFreeHeap = UINT32_MAX;
+  uint32_t minMaxFreeBlock = UINT32_MAX;
+  uint32_t mqttConnectAttempts = 0;
+  uint32_t mqttConnects = 0;
+  uint32_t mqttConnectFailures = 0;
+  uint32_t publishSent = 0;
+  uint32_t publishDropped = 0;  // Evicted from the outbound queue or rejected by the spool
+  uint32_t publishSpooled = 0;  // Spilled to LittleFS while offline
+  uint32_t commandCount = 0;
+  uint32_t commandLatencyLastUs = 0;
+  uint32_t commandLatencyMaxUs = 0;
+  uint64_t commandLatencyTotalUs = 0;
+  const char* powerMode = "normal";
+  uint8_t listenInterval = 0;
+  uint16_t activeCurrentMa = 0; // Estimate inputs; the board has no current sensor
+  uint16_t idleCurrentMa = 0;
+  uint64_t idleUs = 0;          // Time yielded to the SDK so it can sleep
+  uint32_t intervalMaxLoopUs = 0; // Longest iteration since metricsTakeIntervalStall()
+  uint32_t tlsConnects = 0;
+  uint32_t tlsMinBlock = UINT32_MAX; // Smallest max free block seen right before a TLS handshake
+};
+
+extern Metrics metrics;
+
+// Call once at the top of every loop(); measures the time since the previous call
+void metricsLoopTick();
+
+// Latency from MQTT receipt to ac.sendAc() completion
+void metricsRecordCommandLatency(uint32_t latencyUs);
+
+// Records the power mode that command latency and idle time are measured under
+void metricsSetPowerMode(const char* mode, uint8_t listenInterval, uint16_t activeCurrentMa, uint16_t idleCurrentMa);
+
+// Time spent in a power-saving delay(); excluded from the loop histogram
+void metricsRecordIdle(uint32_t idleUs);
+
+// Samples the largest free block before a TLS handshake allocates its buffers
+void metricsRecordTlsConnect();
+
+// Longest loop iteration since the previous call, for the telemetry batch sampler
+uint32_t metricsTakeIntervalStall();
+
+// Writes a compact JSON snapshot into buffer and returns its length
+size_t metricsFormatJson(char* buffer, size_t size);
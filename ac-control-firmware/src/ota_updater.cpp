@@ -0,0 +1,225 @@
+#include "ota_updater.h"
+
+#include <Updater.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "tls_pool.h"
+
+const size_t OTA_CHUNK_SIZE = 1024;              // Bytes moved from the socket to flash per loop()
+const unsigned long OTA_STALL_TIMEOUT = 15000;   // No data for this long counts as a dropped connection
+const unsigned long OTA_RETRY_DELAY = 5000;      // Pause before resuming with a Range request
+const uint8_t OTA_MAX_RETRIES = 5;
+const uint16_t OTA_TIMEOUT = 10000;              // Connect and header timeout of each request
+const uint16_t OTA_TLS_FRAGMENT = 1024;          // Smaller TLS buffers when the server supports MFLN
+
+namespace {
+// True if a 206 response carries exactly the bytes from offset to the end of
+// an image of total bytes: "bytes <first>-<last>/<length>", length may be "*"
+bool contentRangeMatches(const String& header, size_t offset, size_t total) {
+  unsigned long first = 0;
+  unsigned long last = 0;
+  unsigned long length = 0;
+  int fields = sscanf(header.c_str(), "bytes %lu-%lu/%lu", &first, &last, &length);
+  if (fields < 2 || (fields == 2 && header.indexOf("/*") < 0)) {
+    return false;
+  }
+  return first == offset && last + 1 == total && (fields == 2 || length == total);
+}
+}
+
+bool OtaUpdater::start(const String& url, const String& version, unsigned long delayMs) {
+  if (busy()) {
+    return false;
+  }
+  _url = url;
+  _version = version;
+  _error = "";
+  _written = 0;
+  _total = 0;
+  _retries = 0;
+  _state = State::Scheduled;
+  _stateSince = millis();
+  _waitMs = delayMs;
+  LOG_INFO("OTA", "Update to %s scheduled in %lu ms", version.c_str(), delayMs);
+  return true;
+}
+
+void OtaUpdater::reset() {
+  disconnect();
+  if (Update.isRunning()) {
+    Update.end(false); // Discards the partial image; it is never activated
+  }
+  _state = State::Idle;
+}
+
+void OtaUpdater::loop() {
+  switch (_state) {
+    case State::Scheduled:
+    case State::Retrying:
+      if (millis() - _stateSince >= _waitMs && connect()) {
+        _state = State::Downloading;
+        _lastData = millis();
+      }
+      break;
+
+    case State::Downloading: {
+      if (_stream == nullptr || (!_stream->connected() && _stream->available() == 0)) {
+        interrupted("connection closed");
+        break;
+      }
+      size_t available = _stream->available();
+      if (available == 0) {
+        if (millis() - _lastData >= OTA_STALL_TIMEOUT) {
+          interrupted("stalled");
+        }
+        break;
+      }
+      uint8_t chunk[OTA_CHUNK_SIZE];
+      size_t length = _stream->readBytes(chunk, min(available, min(sizeof(chunk), _total - _written)));
+      if (length == 0) {
+        break;
+      }
+      if (Update.write(chunk, length) != length) {
+        fail(String("Flash write failed: ") + Update.getErrorString());
+        break;
+      }
+      _written += length;
+      _lastData = millis();
+      if (_written >= _total) {
+        disconnect();
+        if (Update.end()) {
+          LOG_INFO("OTA", "Image of %u bytes written and verified", (unsigned)_total);
+          _state = State::Succeeded;
+        } else {
+          fail(String("Image verification failed: ") + Update.getErrorString());
+        }
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+// Issues the GET (with Range when resuming) and prepares the Updater.
+// This blocks for the TLS handshake and the response headers only.
+bool OtaUpdater::connect() {
+  WiFiClient* client = &_plainClient;
+  if (_url.startsWith("https://")) {
+    BearSSL::WiFiClientSecure* secureClient = tlsPool.acquire(SecureClientPool::Owner::Ota);
+    if (secureClient == nullptr) {
+      interrupted("waiting for the TLS client");
+      return false;
+    }
+    // MQTT holds a TLS session too, so ask for small record buffers when possible
+    int hostStart = strlen("https://");
+    int hostEnd = _url.indexOf('/', hostStart);
+    String host = _url.substring(hostStart, hostEnd < 0 ? _url.length() : hostEnd);
+    uint16_t port = 443;
+    int colon = host.indexOf(':');
+    if (colon >= 0) {
+      port = host.substring(colon + 1).toInt();
+      host.remove(colon);
+    }
+    if (secureClient->probeMaxFragmentLength(host.c_str(), port, OTA_TLS_FRAGMENT)) {
+      secureClient->setBufferSizes(OTA_TLS_FRAGMENT, OTA_TLS_FRAGMENT);
+    }
+    metricsRecordTlsConnect();
+    client = secureClient;
+  }
+  _http.setReuse(false);
+  _http.setTimeout(OTA_TIMEOUT);
+  _http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+  if (!_http.begin(*client, _url)) {
+    fail("Invalid update URL");
+    return false;
+  }
+  const char* headers[] = {"x-MD5", "Content-Range"};
+  _http.collectHeaders(headers, 2);
+  if (_written > 0) {
+    _http.addHeader("Range", "bytes=" + String(_written) + "-");
+  }
+
+  int httpCode = _http.GET();
+  if (_written > 0 && httpCode == HTTP_CODE_PARTIAL_CONTENT) {
+    String range = _http.header("Content-Range");
+    if (!contentRangeMatches(range, _written, _total)) {
+      // Appending these bytes would corrupt the image; the retry starts over
+      LOG_WARN("OTA", "Unexpected Content-Range \"%s\" at %u of %u bytes", range.c_str(), (unsigned)_written, (unsigned)_total);
+      _written = 0;
+      interrupted("resumed at the wrong offset");
+      return false;
+    }
+    LOG_INFO("OTA", "Resuming at %u of %u bytes", (unsigned)_written, (unsigned)_total);
+  } else if (_written > 0 && httpCode == HTTP_CODE_OK) {
+    // The server ignored the Range header; start over
+    LOG_WARN("OTA", "Server does not support resume, restarting download");
+    _written = 0;
+  } else if (httpCode <= 0 || httpCode == HTTP_CODE_SERVICE_UNAVAILABLE || httpCode == HTTP_CODE_TOO_MANY_REQUESTS) {
+    interrupted(httpCode <= 0 ? "request failed" : "refused by busy server");
+    return false;
+  } else if (httpCode != HTTP_CODE_OK) {
+    fail("HTTP " + String(httpCode));
+    return false;
+  }
+
+  if (_written == 0) {
+    if (Update.isRunning()) {
+      Update.end(false); // Left over from an attempt that never received data
+    }
+    int length = _http.getSize();
+    if (length <= 0) {
+      _http.end();
+      fail("Missing Content-Length");
+      return false;
+    }
+    _total = length;
+    // Gzip images are accepted as-is; the bootloader inflates them on reboot
+    if (!Update.begin(_total)) {
+      _http.end();
+      fail(String("Not enough space: ") + Update.getErrorString());
+      return false;
+    }
+    String md5 = _http.header("x-MD5");
+    if (md5.length() == 32) {
+      Update.setMD5(md5.c_str());
+    }
+    LOG_INFO("OTA", "Downloading %u bytes", (unsigned)_total);
+  }
+  _stream = _http.getStreamPtr();
+  return _stream != nullptr;
+}
+
+void OtaUpdater::disconnect() {
+  _stream = nullptr;
+  _http.end();
+  tlsPool.release(SecureClientPool::Owner::Ota);
+}
+
+void OtaUpdater::interrupted(const char* reason) {
+  disconnect();
+  if (_state == State::Failed) {
+    return;
+  }
+  if (_retries >= OTA_MAX_RETRIES) {
+    fail(String("Download ") + reason + " after " + String((unsigned)_retries) + " retries");
+    return;
+  }
+  _retries++;
+  LOG_WARN("OTA", "Download %s at %u bytes, retry %u", reason, (unsigned)_written, (unsigned)_retries);
+  _state = State::Retrying;
+  _stateSince = millis();
+  _waitMs = OTA_RETRY_DELAY * _retries;
+}
+
+void OtaUpdater::fail(const String& reason) {
+  disconnect();
+  if (Update.isRunning()) {
+    Update.end(false);
+  }
+  _error = reason;
+  _state = State::Failed;
+  LOG_ERROR("OTA", "Update failed: %s", reason.c_str());
+}
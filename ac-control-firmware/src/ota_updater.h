@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+
+// Background firmware download, advanced a chunk at a time from loop().
+// Uses its own HTTP client and the shared TLS client from tlsPool, so MQTT
+// stays connected, writes straight into the Updater (gzip images are inflated
+// by the bootloader), and resumes an interrupted download with an HTTP Range
+// request.
+class OtaUpdater {
+ public:
+  enum class State : uint8_t {
+    Idle,
+    Scheduled,   // Waiting for the start delay
+    Downloading,
+    Retrying,    // Connection lost; waiting before the Range request
+    Succeeded,   // Image written and verified; the caller reboots
+    Failed
+  };
+
+  // Starts a download after delayMs; false if a job is already running
+  bool start(const String& url, const String& version, unsigned long delayMs);
+
+  // Advances the job; call from every loop() iteration
+  void loop();
+
+  // Returns to Idle after the caller has reported a final state
+  void reset();
+
+  State state() const { return _state; }
+  bool busy() const { return _state != State::Idle && _state != State::Succeeded && _state != State::Failed; }
+  size_t written() const { return _written; }
+  size_t total() const { return _total; }
+  uint8_t progress() const { return _total ? (uint8_t)((uint64_t)_written * 100 / _total) : 0; }
+  uint8_t retries() const { return _retries; }
+  const String& version() const { return _version; }
+  const String& error() const { return _error; }
+
+ private:
+  bool connect();
+  void disconnect();
+  void interrupted(const char* reason);
+  void fail(const String& reason);
+
+  State _state = State::Idle;
+  String _url;
+  String _version;
+  String _error;
+  size_t _written = 0;
+  size_t _total = 0;
+  uint8_t _retries = 0;
+  unsigned long _stateSince = 0;
+  unsigned long _waitMs = 0;
+  unsigned long _lastData = 0;
+  HTTPClient _http;
+  WiFiClient _plainClient;
+  WiFiClient* _stream = nullptr;
+};
@@ -0,0 +1,149 @@
+#include "command_driver.h"
+
+#include <ArduinoJson.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+const uint64_t DRIVER_RECONNECT_INTERVAL = 1000;
+const uint64_t COMMAND_TIMEOUT = 10000;   // An ack later than this counts as lost
+const double MAX_COMMAND_BURST = 100;     // Credit kept across a stall, so a pause does not turn into a flood
+const uint16_t DRIVER_KEEPALIVE = 30;
+
+CommandDriver::CommandDriver(const SimConfig& config, FleetStats& stats, std::vector<std::unique_ptr<VirtualDevice>>& devices,
+                             double commandsPerSecond)
+  : _config(config), _stats(stats), _devices(devices), _targets(devices.size()), _link(*this),
+    _commandsPerSecond(commandsPerSecond) {
+  _clientId = "sim-driver-" + std::to_string(getpid());
+  _ackFilter = std::string("node/") + config.customerId + "/+/ack";
+  for (size_t i = 0; i < devices.size(); i++) {
+    _ackTopics[devices[i]->topics().ack] = i;
+  }
+}
+
+void CommandDriver::loop(uint64_t now) {
+  if (_commandsPerSecond <= 0) {
+    return;
+  }
+  if (_link.state() == MqttLink::State::Closed && !_config.outage &&
+      (!_started || now - _lastConnectAttempt >= DRIVER_RECONNECT_INTERVAL)) {
+    _started = true;
+    _lastConnectAttempt = now;
+    MqttLink::Options options = {_clientId.c_str(), _config.username, _config.password, nullptr, nullptr, DRIVER_KEEPALIVE};
+    _link.connect(_config.address, _config.addressLength, _config.tls, _config.serverName, options, now);
+  }
+
+  uint64_t elapsed = _lastLoop ? now - _lastLoop : 0;
+  _lastLoop = now;
+  if (_link.connected()) {
+    _credit += _commandsPerSecond * elapsed / 1000.0;
+    _credit = _credit < MAX_COMMAND_BURST ? _credit : MAX_COMMAND_BURST;
+    while (_credit >= 1) {
+      _credit -= 1;
+      sendCommand(now);
+    }
+  } else {
+    _credit = 0;
+  }
+  expire(now);
+}
+
+void CommandDriver::onConnected(uint64_t now) {
+  (void)now;
+  _link.subscribe(_ackFilter.c_str());
+}
+
+void CommandDriver::onConnectFailed(int returnCode, uint64_t now) {
+  (void)now;
+  fprintf(stderr, "Command driver connection failed, rc %d\n", returnCode);
+}
+
+void CommandDriver::onDisconnected(uint64_t now) {
+  (void)now;
+  fprintf(stderr, "Command driver disconnected\n");
+}
+
+void CommandDriver::onMessage(const char* topic, char* payload, size_t length, uint64_t now) {
+  (void)now;
+  auto found = _ackTopics.find(topic);
+  if (found == _ackTopics.end()) {
+    return;
+  }
+  StaticJsonDocument<256> doc;
+  if (deserializeJson(doc, payload, length)) {
+    return;
+  }
+  uint32_t sequence = doc["seq"] | 0UL;
+  uint8_t channel = doc["channel"] | 0;
+  if (channel >= AC_MAX_CHANNELS) {
+    return;
+  }
+  uint64_t nowUs = monotonicMicros();
+  std::deque<Outstanding>& pending = _targets[found->second].pending[channel];
+  while (!pending.empty() && pending.front().sequence <= sequence) {
+    _stats.counters.commandsAcked++;
+    _stats.recordRtt((uint32_t)(nowUs - pending.front().sentAtUs));
+    pending.pop_front();
+  }
+}
+
+// Half field commands, which the device coalesces for COMMAND_COALESCE_WINDOW
+// before acking, and half state commands, which it applies at once
+void CommandDriver::sendCommand(uint64_t now) {
+  size_t online = 0;
+  for (const auto& device : _devices) {
+    online += device->online() ? 1 : 0;
+  }
+  if (online == 0) {
+    return;
+  }
+  size_t pick = random(online);
+  size_t index = 0;
+  for (; index < _devices.size(); index++) {
+    if (_devices[index]->online() && pick-- == 0) {
+      break;
+    }
+  }
+  Target& target = _targets[index];
+  uint8_t channel = random(_config.channels);
+  uint32_t sequence = target.nextSequence++;
+  int degrees = 16 + (int)random(15);
+
+  char topic[MQTT_TOPIC_SIZE];
+  char payload[128];
+  bool built;
+  if (random(2) == 0) {
+    built = buildChannelTopic(topic, sizeof(topic), _devices[index]->topics(), channel, "/command/temperature");
+    snprintf(payload, sizeof(payload), "{\"seq\":%lu,\"value\":\"%d\"}", (unsigned long)sequence, degrees);
+  } else {
+    built = buildChannelTopic(topic, sizeof(topic), _devices[index]->topics(), channel, "/command/state");
+    snprintf(payload, sizeof(payload), "{\"seq\":%lu,\"power\":true,\"mode\":\"cool\",\"temperature\":%d,\"fanspeed\":\"auto\"}",
+             (unsigned long)sequence, degrees);
+  }
+  if (!built) {
+    return;
+  }
+  uint64_t sentAtUs = monotonicMicros();
+  if (_link.publish(topic, payload, strlen(payload), false)) {
+    _stats.counters.commandsSent++;
+    target.pending[channel].push_back({sequence, sentAtUs, now});
+  }
+}
+
+void CommandDriver::expire(uint64_t now) {
+  for (Target& target : _targets) {
+    for (auto& pending : target.pending) {
+      while (!pending.empty() && now - pending.front().sentAt >= COMMAND_TIMEOUT) {
+        _stats.counters.commandsLost++;
+        pending.pop_front();
+      }
+    }
+  }
+}
+
+uint32_t CommandDriver::random(uint32_t range) {
+  _randomState ^= _randomState << 13;
+  _randomState ^= _randomState >> 17;
+  _randomState ^= _randomState << 5;
+  return range ? _randomState % range : 0;
+}
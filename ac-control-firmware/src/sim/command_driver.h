@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fleet_stats.h"
+#include "mqtt_link.h"
+#include "virtual_device.h"
+
+// Plays the backend: sends sequenced commands to random online devices over
+// its own broker connection and matches the acks. Acks are cumulative per
+// channel, so an ack for seq N resolves every outstanding command up to N on
+// that channel, as coalescing answers a burst with one ack.
+class CommandDriver : public MqttLink::Handler {
+ public:
+  CommandDriver(const SimConfig& config, FleetStats& stats, std::vector<std::unique_ptr<VirtualDevice>>& devices,
+                double commandsPerSecond);
+
+  // Connects, sends due commands and expires lost ones
+  void loop(uint64_t now);
+
+  MqttLink& link() { return _link; }
+
+  void onConnected(uint64_t now) override;
+  void onConnectFailed(int returnCode, uint64_t now) override;
+  void onDisconnected(uint64_t now) override;
+  void onMessage(const char* topic, char* payload, size_t length, uint64_t now) override;
+
+ private:
+  struct Outstanding {
+    uint32_t sequence;
+    uint64_t sentAtUs;
+    uint64_t sentAt;
+  };
+
+  // Sequence numbers are per device, as the firmware keeps one counter
+  struct Target {
+    uint32_t nextSequence = 1;
+    std::deque<Outstanding> pending[AC_MAX_CHANNELS];
+  };
+
+  void sendCommand(uint64_t now);
+  void expire(uint64_t now);
+  uint32_t random(uint32_t range);
+
+  const SimConfig& _config;
+  FleetStats& _stats;
+  std::vector<std::unique_ptr<VirtualDevice>>& _devices;
+  std::vector<Target> _targets;
+  std::unordered_map<std::string, size_t> _ackTopics; // Ack topic to device index
+  std::string _clientId;
+  std::string _ackFilter;
+  MqttLink _link;
+  double _commandsPerSecond;
+  double _credit = 0;
+  uint64_t _lastLoop = 0;
+  uint64_t _lastConnectAttempt = 0;
+  bool _started = false;
+  uint32_t _randomState = 0x2545F491;
+};
@@ -0,0 +1,58 @@
+#include "fleet_stats.h"
+
+#include <algorithm>
+#include <math.h>
+#include <time.h>
+
+const char* publishKindName(PublishKind kind) {
+  switch (kind) {
+    case PublishKind::Status: return "status";
+    case PublishKind::Telemetry: return "telemetry";
+    case PublishKind::State: return "state";
+    case PublishKind::Heartbeat: return "heartbeat";
+    case PublishKind::Batch: return "batch";
+    case PublishKind::Ack: return "ack";
+    case PublishKind::Error: return "error";
+    default: return "unknown";
+  }
+}
+
+void FleetStats::recordAttempt(uint64_t now) {
+  counters.connectAttempts++;
+  size_t second = now / 1000;
+  if (second >= _attemptsPerSecond.size()) {
+    _attemptsPerSecond.resize(second + 1, 0);
+  }
+  _attemptsPerSecond[second]++;
+}
+
+std::vector<uint32_t> FleetStats::takeRtt(size_t& cursor) const {
+  std::vector<uint32_t> samples(_rttUs.begin() + cursor, _rttUs.end());
+  cursor = _rttUs.size();
+  return samples;
+}
+
+std::vector<uint32_t> FleetStats::takeConnectTimes(size_t& cursor) const {
+  std::vector<uint32_t> samples(_connectMs.begin() + cursor, _connectMs.end());
+  cursor = _connectMs.size();
+  return samples;
+}
+
+uint64_t monotonicMicros() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint32_t percentile(std::vector<uint32_t>& samples, double fraction) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t rank = (size_t)ceil(fraction * samples.size());
+  size_t index = rank > 0 ? rank - 1 : 0;
+  if (index >= samples.size()) {
+    index = samples.size() - 1;
+  }
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
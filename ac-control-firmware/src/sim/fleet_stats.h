@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Outbound message kinds, counted separately in the publish rates
+enum class PublishKind : uint8_t {
+  Status,
+  Telemetry,
+  State,
+  Heartbeat,
+  Batch,
+  Ack,
+  Error,
+  Count
+};
+
+const char* publishKindName(PublishKind kind);
+
+struct FleetCounters {
+  uint64_t connectAttempts = 0;
+  uint64_t connects = 0;
+  uint64_t connectFailures = 0; // Transport failures and refused CONNACKs
+  uint64_t connectRefused = 0;  // CONNACK "server unavailable"
+  uint64_t drops = 0;           // Established connections lost
+  uint64_t published[(size_t)PublishKind::Count] = {};
+  uint64_t publishFailed = 0;
+  uint64_t commandsReceived = 0;
+  uint64_t commandsIgnored = 0; // Schedule, channel, local API and OTA messages
+  uint64_t irFrames = 0;
+  uint64_t irFailures = 0;
+  uint64_t commandsSent = 0;    // By the command driver
+  uint64_t commandsAcked = 0;
+  uint64_t commandsLost = 0;    // No ack within the driver's timeout
+};
+
+// Shared by every virtual device and the command driver. Counters only grow;
+// reports print the difference between two snapshots.
+class FleetStats {
+ public:
+  FleetCounters counters;
+
+  void recordAttempt(uint64_t now);
+  void recordConnectTime(uint32_t ms) { _connectMs.push_back(ms); }
+  void recordRtt(uint32_t us) { _rttUs.push_back(us); }
+  void recordPublish(PublishKind kind) { counters.published[(size_t)kind]++; }
+
+  // Connect attempts started in each second of the run: a reconnect storm
+  // shows up as a tall, narrow peak
+  const std::vector<uint32_t>& attemptsPerSecond() const { return _attemptsPerSecond; }
+
+  // Samples recorded since the previous take, for per-interval percentiles;
+  // all samples stay available for the final summary
+  std::vector<uint32_t> takeRtt(size_t& cursor) const;
+  std::vector<uint32_t> takeConnectTimes(size_t& cursor) const;
+  const std::vector<uint32_t>& rtt() const { return _rttUs; }
+  const std::vector<uint32_t>& connectTimes() const { return _connectMs; }
+
+ private:
+  std::vector<uint32_t> _attemptsPerSecond;
+  std::vector<uint32_t> _rttUs;
+  std::vector<uint32_t> _connectMs;
+};
+
+// CLOCK_MONOTONIC in microseconds; the simulator's millis() is this / 1000
+uint64_t monotonicMicros();
+
+// Nearest-rank percentile, 0 for no samples; reorders samples
+uint32_t percentile(std::vector<uint32_t>& samples, double fraction);
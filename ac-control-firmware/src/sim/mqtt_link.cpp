@@ -0,0 +1,428 @@
+#include "mqtt_link.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+const uint64_t CONNECT_TIMEOUT = 15000;       // TCP, TLS and CONNACK together, like the firmware's socket timeout
+const size_t SEND_BUFFER_LIMIT = 64 * 1024;   // Publishes fail beyond this, as a full lwIP send buffer would
+const size_t READ_CHUNK = 4096;
+
+const uint8_t PACKET_CONNECT = 0x10;
+const uint8_t PACKET_CONNACK = 0x20;
+const uint8_t PACKET_PUBLISH = 0x30;
+const uint8_t PACKET_PUBACK = 0x40;
+const uint8_t PACKET_SUBSCRIBE = 0x82; // Reserved flag bits are 0010
+const uint8_t PACKET_SUBACK = 0x90;
+const uint8_t PACKET_PINGREQ = 0xC0;
+const uint8_t PACKET_PINGRESP = 0xD0;
+
+bool MqttLink::connect(const sockaddr_storage& address, socklen_t addressLength, SSL_CTX* tls, const char* serverName,
+                       const Options& options, uint64_t now) {
+  closeSocket();
+  _options = options;
+  _attemptStartedAt = now;
+  _now = now;
+  _fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_fd < 0) {
+    return false;
+  }
+  int on = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (tls != nullptr) {
+    _ssl = SSL_new(tls);
+    SSL_set_fd(_ssl, _fd);
+    SSL_set_tlsext_host_name(_ssl, serverName);
+    if (SSL_CTX_get_verify_mode(tls) != SSL_VERIFY_NONE) {
+      SSL_set1_host(_ssl, serverName);
+    }
+  }
+  if (::connect(_fd, reinterpret_cast<const sockaddr*>(&address), addressLength) == 0) {
+    startTls(now);
+  } else if (errno == EINPROGRESS) {
+    _state = State::TcpConnecting;
+  } else {
+    closeSocket();
+    return false;
+  }
+  return true;
+}
+
+void MqttLink::startTls(uint64_t now) {
+  if (_ssl == nullptr) {
+    sendConnect();
+    flush(now);
+    return;
+  }
+  _state = State::TlsHandshake;
+  continueHandshake(now);
+}
+
+void MqttLink::continueHandshake(uint64_t now) {
+  int result = SSL_connect(_ssl);
+  if (result == 1) {
+    _wantWrite = false;
+    sendConnect();
+    flush(now);
+    return;
+  }
+  int error = SSL_get_error(_ssl, result);
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+    _wantWrite = error == SSL_ERROR_WANT_WRITE;
+    return;
+  }
+  ERR_clear_error();
+  lost(now);
+}
+
+void MqttLink::sendConnect() {
+  uint8_t flags = 0x02; // Clean session, as PubSubClient always asks for
+  if (_options.willTopic != nullptr) {
+    flags |= 0x04 | 0x08 | 0x20; // Will, QoS 1, retained
+  }
+  if (_options.username != nullptr) {
+    flags |= 0x80;
+    if (_options.password != nullptr) {
+      flags |= 0x40;
+    }
+  }
+  _scratch.clear();
+  _scratch.append("\x00\x04MQTT\x04", 7);
+  _scratch.push_back((char)flags);
+  _scratch.push_back((char)(_options.keepAlive >> 8));
+  _scratch.push_back((char)(_options.keepAlive & 0xFF));
+  appendString(_options.clientId);
+  if (_options.willTopic != nullptr) {
+    appendString(_options.willTopic);
+    appendString(_options.willPayload);
+  }
+  if (_options.username != nullptr) {
+    appendString(_options.username);
+    if (_options.password != nullptr) {
+      appendString(_options.password);
+    }
+  }
+  appendPacket(PACKET_CONNECT, _scratch);
+  _state = State::MqttConnecting;
+}
+
+bool MqttLink::publish(const char* topic, const char* payload, size_t length, bool retain) {
+  if (_state != State::Connected || _out.size() > SEND_BUFFER_LIMIT) {
+    return false;
+  }
+  _scratch.clear();
+  appendString(topic);
+  _scratch.append(payload, length);
+  appendPacket(PACKET_PUBLISH | (retain ? 0x01 : 0x00), _scratch);
+  flush(_now);
+  return _fd >= 0;
+}
+
+bool MqttLink::subscribe(const char* topic) {
+  if (_state != State::Connected) {
+    return false;
+  }
+  uint16_t packetId = _nextPacketId++;
+  if (_nextPacketId == 0) {
+    _nextPacketId = 1;
+  }
+  _scratch.clear();
+  _scratch.push_back((char)(packetId >> 8));
+  _scratch.push_back((char)(packetId & 0xFF));
+  appendString(topic);
+  _scratch.push_back(0); // QoS 0, as the firmware subscribes
+  appendPacket(PACKET_SUBSCRIBE, _scratch);
+  flush(_now);
+  return _fd >= 0;
+}
+
+void MqttLink::drop(uint64_t now) {
+  if (_fd >= 0) {
+    lost(now);
+  }
+}
+
+short MqttLink::events() const {
+  if (_fd < 0) {
+    return 0;
+  }
+  if (_state == State::TcpConnecting) {
+    return POLLOUT;
+  }
+  return POLLIN | ((!_out.empty() || _wantWrite) ? POLLOUT : 0);
+}
+
+void MqttLink::service(short revents, uint64_t now) {
+  _now = now;
+  if (_fd < 0) {
+    return;
+  }
+  if (_state == State::TcpConnecting) {
+    if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (error != 0) {
+        lost(now);
+        return;
+      }
+      _lastReceived = now;
+      startTls(now);
+    }
+  } else if (_state == State::TlsHandshake) {
+    if (revents != 0) {
+      continueHandshake(now);
+    }
+  } else {
+    if (revents & (POLLIN | POLLERR | POLLHUP)) {
+      readAvailable(now);
+    }
+    if (_fd >= 0 && (revents & POLLOUT)) {
+      flush(now);
+    }
+  }
+  if (_fd < 0) {
+    return;
+  }
+
+  if (_state != State::Connected) {
+    if (now - _attemptStartedAt >= CONNECT_TIMEOUT) {
+      lost(now);
+    }
+    return;
+  }
+  // PubSubClient pings after a keepalive without traffic and gives up when the
+  // ping is not answered within another one
+  uint64_t keepAlive = (uint64_t)_options.keepAlive * 1000;
+  if (keepAlive == 0) {
+    return;
+  }
+  if (now - _lastReceived >= keepAlive || now - _lastSent >= keepAlive) {
+    if (_pingOutstanding) {
+      lost(now);
+      return;
+    }
+    _scratch.clear();
+    appendPacket(PACKET_PINGREQ, _scratch);
+    _pingOutstanding = true;
+    _lastReceived = now; // Measures the ping timeout from here
+    flush(now);
+  }
+}
+
+void MqttLink::readAvailable(uint64_t now) {
+  uint8_t chunk[READ_CHUNK];
+  while (_fd >= 0) {
+    long length = rawRead(chunk, sizeof(chunk));
+    if (length < 0) {
+      lost(now);
+      return;
+    }
+    if (length == 0) {
+      break;
+    }
+    _in.append(reinterpret_cast<const char*>(chunk), length);
+  }
+
+  size_t offset = 0;
+  while (_fd >= 0) {
+    // Fixed header: type byte, then a 1-4 byte variable-length remaining length
+    size_t available = _in.size() - offset;
+    if (available < 2) {
+      break;
+    }
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(_in.data()) + offset;
+    size_t remaining = 0;
+    size_t headerLength = 1;
+    bool complete = false;
+    for (size_t shift = 0; headerLength < available && headerLength <= 4; shift += 7) {
+      uint8_t digit = data[headerLength++];
+      remaining |= (size_t)(digit & 0x7F) << shift;
+      if ((digit & 0x80) == 0) {
+        complete = true;
+        break;
+      }
+    }
+    if (!complete) {
+      if (headerLength > 4) {
+        lost(now); // Malformed length
+        return;
+      }
+      break;
+    }
+    if (available < headerLength + remaining) {
+      break;
+    }
+    _lastReceived = now;
+    // The handler may drop the link, which clears _in, so the packet is consumed first
+    std::string packet(reinterpret_cast<const char*>(data + headerLength), remaining);
+    offset += headerLength + remaining;
+    if (!handlePacket(data[0], reinterpret_cast<const uint8_t*>(packet.data()), packet.size(), now)) {
+      return;
+    }
+  }
+  if (_fd >= 0) {
+    _in.erase(0, offset);
+  }
+}
+
+// False when the link was closed while handling the packet
+bool MqttLink::handlePacket(uint8_t header, const uint8_t* body, size_t length, uint64_t now) {
+  switch (header & 0xF0) {
+    case PACKET_CONNACK: {
+      if (_state != State::MqttConnecting || length < 2) {
+        lost(now);
+        return false;
+      }
+      int returnCode = body[1];
+      if (returnCode != 0) {
+        closeSocket();
+        _handler.onConnectFailed(returnCode, now);
+        return false;
+      }
+      _state = State::Connected;
+      _pingOutstanding = false;
+      _handler.onConnected(now);
+      return _fd >= 0;
+    }
+    case PACKET_PUBLISH: {
+      if (length < 2) {
+        lost(now);
+        return false;
+      }
+      uint8_t qos = (header >> 1) & 0x03;
+      size_t topicLength = ((size_t)body[0] << 8) | body[1];
+      size_t payloadStart = 2 + topicLength + (qos > 0 ? 2 : 0);
+      if (payloadStart > length) {
+        lost(now);
+        return false;
+      }
+      if (qos == 1) {
+        _scratch.assign(reinterpret_cast<const char*>(body + 2 + topicLength), 2);
+        appendPacket(PACKET_PUBACK, _scratch);
+      }
+      std::string topic(reinterpret_cast<const char*>(body + 2), topicLength);
+      _message.assign(reinterpret_cast<const char*>(body + payloadStart), length - payloadStart);
+      _handler.onMessage(topic.c_str(), &_message[0], _message.size(), now);
+      if (_fd >= 0 && !_out.empty()) {
+        flush(now);
+      }
+      return _fd >= 0;
+    }
+    case PACKET_PINGRESP:
+      _pingOutstanding = false;
+      return true;
+    case PACKET_SUBACK:
+    case PACKET_PUBACK:
+    default:
+      return true;
+  }
+}
+
+void MqttLink::flush(uint64_t now) {
+  while (_fd >= 0 && !_out.empty()) {
+    long length = rawWrite(reinterpret_cast<const uint8_t*>(_out.data()), _out.size());
+    if (length < 0) {
+      lost(now);
+      return;
+    }
+    if (length == 0) {
+      return;
+    }
+    _out.erase(0, length);
+    _lastSent = now;
+  }
+}
+
+void MqttLink::lost(uint64_t now) {
+  bool wasConnected = _state == State::Connected;
+  closeSocket();
+  if (wasConnected) {
+    _handler.onDisconnected(now);
+  } else {
+    _handler.onConnectFailed(-1, now);
+  }
+}
+
+void MqttLink::closeSocket() {
+  if (_ssl != nullptr) {
+    SSL_free(_ssl);
+    _ssl = nullptr;
+  }
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _state = State::Closed;
+  _wantWrite = false;
+  _pingOutstanding = false;
+  _in.clear();
+  _out.clear();
+}
+
+long MqttLink::rawRead(uint8_t* buffer, size_t size) {
+  if (_ssl != nullptr) {
+    int length = SSL_read(_ssl, buffer, (int)size);
+    if (length > 0) {
+      return length;
+    }
+    int error = SSL_get_error(_ssl, length);
+    _wantWrite = error == SSL_ERROR_WANT_WRITE;
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      return 0;
+    }
+    ERR_clear_error();
+    return -1;
+  }
+  ssize_t length = recv(_fd, buffer, size, 0);
+  if (length > 0) {
+    return length;
+  }
+  if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  return -1; // 0 is an orderly close
+}
+
+long MqttLink::rawWrite(const uint8_t* buffer, size_t size) {
+  if (_ssl != nullptr) {
+    int length = SSL_write(_ssl, buffer, (int)size);
+    if (length > 0) {
+      return length;
+    }
+    int error = SSL_get_error(_ssl, length);
+    _wantWrite = error == SSL_ERROR_WANT_WRITE;
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      return 0;
+    }
+    ERR_clear_error();
+    return -1;
+  }
+  ssize_t length = send(_fd, buffer, size, MSG_NOSIGNAL);
+  if (length >= 0) {
+    return length;
+  }
+  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+void MqttLink::appendString(const char* value) {
+  size_t length = strlen(value);
+  _scratch.push_back((char)(length >> 8));
+  _scratch.push_back((char)(length & 0xFF));
+  _scratch.append(value, length);
+}
+
+void MqttLink::appendPacket(uint8_t header, const std::string& body) {
+  _out.push_back((char)header);
+  size_t remaining = body.size();
+  do {
+    uint8_t digit = remaining & 0x7F;
+    remaining >>= 7;
+    _out.push_back((char)(remaining > 0 ? digit | 0x80 : digit));
+  } while (remaining > 0);
+  _out.append(body);
+}
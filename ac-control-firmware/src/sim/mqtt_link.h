@@ -0,0 +1,111 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+
+// Minimal non-blocking MQTT 3.1.1 client for the fleet simulator. It speaks
+// the subset the firmware's PubSubClient uses: CONNECT with credentials and a
+// retained QoS 1 will, QoS 0 publish and subscribe, inbound QoS 0/1
+// publishes and keepalive pings. Every virtual device owns one; the fleet
+// polls all sockets from a single thread.
+class MqttLink {
+ public:
+  enum class State : uint8_t {
+    Closed,
+    TcpConnecting,
+    TlsHandshake,
+    MqttConnecting, // CONNECT sent, waiting for the CONNACK
+    Connected
+  };
+
+  // Pointers must stay valid until the link is closed
+  struct Options {
+    const char* clientId;
+    const char* username; // nullptr to connect without credentials
+    const char* password;
+    const char* willTopic; // nullptr for no will
+    const char* willPayload;
+    uint16_t keepAlive;    // Seconds
+  };
+
+  class Handler {
+   public:
+    virtual ~Handler() {}
+    virtual void onConnected(uint64_t now) = 0;
+    // returnCode is the CONNACK code, or -1 when the transport failed first
+    virtual void onConnectFailed(int returnCode, uint64_t now) = 0;
+    virtual void onDisconnected(uint64_t now) = 0;
+    // The payload is writable and terminated, like PubSubClient's buffer.
+    // Callbacks may publish or drop the link but must not reconnect it.
+    virtual void onMessage(const char* topic, char* payload, size_t length, uint64_t now) = 0;
+  };
+
+  explicit MqttLink(Handler& handler) : _handler(handler) {}
+  ~MqttLink() { closeSocket(); }
+
+  MqttLink(const MqttLink&) = delete;
+  MqttLink& operator=(const MqttLink&) = delete;
+
+  // Starts a connection; the outcome is reported through the handler.
+  // tls may be nullptr for plain TCP. False if no socket could be opened.
+  bool connect(const sockaddr_storage& address, socklen_t addressLength, SSL_CTX* tls, const char* serverName,
+               const Options& options, uint64_t now);
+
+  // False when not connected or the send buffer is full, as PubSubClient
+  // reports a failed write
+  bool publish(const char* topic, const char* payload, size_t length, bool retain);
+  bool subscribe(const char* topic);
+
+  // Closes without a DISCONNECT, so the broker publishes the will
+  void drop(uint64_t now);
+
+  int fd() const { return _fd; }
+  short events() const;
+
+  // Handles poll() results and the connect and keepalive timers; call for
+  // every link on each pass, with revents 0 when the socket was not ready
+  void service(short revents, uint64_t now);
+
+  State state() const { return _state; }
+  bool connected() const { return _state == State::Connected; }
+  // When the current or last connection attempt started
+  uint64_t attemptStartedAt() const { return _attemptStartedAt; }
+
+ private:
+  void startTls(uint64_t now);
+  void continueHandshake(uint64_t now);
+  void sendConnect();
+  void readAvailable(uint64_t now);
+  bool handlePacket(uint8_t header, const uint8_t* body, size_t length, uint64_t now);
+  void flush(uint64_t now);
+  void lost(uint64_t now);
+  void closeSocket();
+
+  // Transport reads and writes: > 0 bytes moved, 0 would block, < 0 closed or failed
+  long rawRead(uint8_t* buffer, size_t size);
+  long rawWrite(const uint8_t* buffer, size_t size);
+
+  void appendString(const char* value);
+  void appendPacket(uint8_t header, const std::string& body);
+
+  Handler& _handler;
+  Options _options = {};
+  State _state = State::Closed;
+  int _fd = -1;
+  SSL* _ssl = nullptr;
+  bool _wantWrite = false;      // TLS needs a writable socket to make progress
+  std::string _in;
+  std::string _out;
+  std::string _scratch;         // Packet body being built
+  std::string _message;         // Last inbound payload, terminated
+  uint16_t _nextPacketId = 1;
+  uint64_t _now = 0;            // Time of the last service() pass, for writes made between passes
+  uint64_t _attemptStartedAt = 0;
+  uint64_t _lastSent = 0;
+  uint64_t _lastReceived = 0;
+  bool _pingOutstanding = false;
+};
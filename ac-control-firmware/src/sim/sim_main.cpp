@@ -0,0 +1,447 @@
+// Host-side fleet simulator: N virtual controllers in one process, each with
+// its own MAC and broker connection, running the firmware's MQTT behaviour on
+// the portable core. A command driver plays the backend and measures the ack
+// round trip. Used to load-test the broker and the backend before a rollout.
+//
+//   pio run -e sim
+//   .pio/build/sim/program --host broker.local --devices 2000 --command-rate 50
+//   .pio/build/sim/program --host broker.local --tls --devices 500 --outage-at 120 --outage-for 30
+//
+// Every --report seconds it prints the fleet state; at the end it prints the
+// totals, latency percentiles and the reconnect storm profile.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "command_driver.h"
+#include "fleet_stats.h"
+#include "virtual_device.h"
+
+const int POLL_TIMEOUT = 5;              // ms; bounds the error of every device timer
+const uint32_t STORM_THRESHOLD_PERCENT = 5; // A second with attempts from more than this share of the fleet is part of a storm
+
+struct Options {
+  const char* host = "localhost";
+  int port = 0;
+  bool tls = false;
+  bool insecure = false;
+  const char* username = nullptr;
+  const char* password = nullptr;
+  unsigned devices = 100;
+  const char* customer = "sim";
+  unsigned zones = 4;
+  unsigned channels = 1;
+  unsigned duration = 300;      // Seconds; 0 runs until interrupted
+  double commandRate = 10;      // Commands per second across the fleet
+  unsigned report = 10;         // Seconds between interval reports
+  unsigned outageAt = 0;        // Seconds into the run; 0 for no outage
+  unsigned outageFor = 30;
+  unsigned irFailPermille = 0;
+  uint32_t macPrefix = 0x02AC00; // Locally administered, so it never collides with a real unit
+  unsigned heartbeat = 60;
+  bool periodic = false;        // telemetry_on_change off: full telemetry every 30 s
+  unsigned startupSpread = 10;
+  const char* csv = nullptr;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+  stopRequested = 1;
+}
+
+static void usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --host NAME          Broker host (localhost)\n"
+          "  --port N             Broker port (1883, 8883 with --tls)\n"
+          "  --tls                Connect over TLS\n"
+          "  --insecure           Do not verify the broker certificate\n"
+          "  --username NAME      MQTT username\n"
+          "  --password SECRET    MQTT password\n"
+          "  --devices N          Virtual devices (100)\n"
+          "  --customer ID        customer_id of every device (sim)\n"
+          "  --zones N            Zones the devices are spread over (4)\n"
+          "  --channels N         AC channels per device, 1 to %u (1)\n"
+          "  --duration S         Run time in seconds, 0 until interrupted (300)\n"
+          "  --command-rate N     Commands per second from the driver, 0 for none (10)\n"
+          "  --report S           Seconds between reports (10)\n"
+          "  --outage-at S        Start a broker outage S seconds in (none)\n"
+          "  --outage-for S       Outage length in seconds (30)\n"
+          "  --ir-fail N          IR send failures per thousand frames (0)\n"
+          "  --mac-prefix HEX     First three MAC bytes, e.g. 02AC00 (02AC00)\n"
+          "  --heartbeat S        Heartbeat interval in seconds (60)\n"
+          "  --periodic           Periodic full telemetry instead of on-change\n"
+          "  --startup-spread S   Window for the first connect after power-on (10)\n"
+          "  --csv FILE           Write connect attempts per second to FILE\n",
+          program, (unsigned)AC_MAX_CHANNELS);
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+  enum {
+    OPT_HOST = 256, OPT_PORT, OPT_TLS, OPT_INSECURE, OPT_USERNAME, OPT_PASSWORD, OPT_DEVICES, OPT_CUSTOMER,
+    OPT_ZONES, OPT_CHANNELS, OPT_DURATION, OPT_COMMAND_RATE, OPT_REPORT, OPT_OUTAGE_AT, OPT_OUTAGE_FOR,
+    OPT_IR_FAIL, OPT_MAC_PREFIX, OPT_HEARTBEAT, OPT_PERIODIC, OPT_STARTUP_SPREAD, OPT_CSV, OPT_HELP
+  };
+  static const option longOptions[] = {
+    {"host", required_argument, nullptr, OPT_HOST},
+    {"port", required_argument, nullptr, OPT_PORT},
+    {"tls", no_argument, nullptr, OPT_TLS},
+    {"insecure", no_argument, nullptr, OPT_INSECURE},
+    {"username", required_argument, nullptr, OPT_USERNAME},
+    {"password", required_argument, nullptr, OPT_PASSWORD},
+    {"devices", required_argument, nullptr, OPT_DEVICES},
+    {"customer", required_argument, nullptr, OPT_CUSTOMER},
+    {"zones", required_argument, nullptr, OPT_ZONES},
+    {"channels", required_argument, nullptr, OPT_CHANNELS},
+    {"duration", required_argument, nullptr, OPT_DURATION},
+    {"command-rate", required_argument, nullptr, OPT_COMMAND_RATE},
+    {"report", required_argument, nullptr, OPT_REPORT},
+    {"outage-at", required_argument, nullptr, OPT_OUTAGE_AT},
+    {"outage-for", required_argument, nullptr, OPT_OUTAGE_FOR},
+    {"ir-fail", required_argument, nullptr, OPT_IR_FAIL},
+    {"mac-prefix", required_argument, nullptr, OPT_MAC_PREFIX},
+    {"heartbeat", required_argument, nullptr, OPT_HEARTBEAT},
+    {"periodic", no_argument, nullptr, OPT_PERIODIC},
+    {"startup-spread", required_argument, nullptr, OPT_STARTUP_SPREAD},
+    {"csv", required_argument, nullptr, OPT_CSV},
+    {"help", no_argument, nullptr, OPT_HELP},
+    {nullptr, 0, nullptr, 0}
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+    switch (option) {
+      case OPT_HOST: options.host = optarg; break;
+      case OPT_PORT: options.port = atoi(optarg); break;
+      case OPT_TLS: options.tls = true; break;
+      case OPT_INSECURE: options.insecure = true; break;
+      case OPT_USERNAME: options.username = optarg; break;
+      case OPT_PASSWORD: options.password = optarg; break;
+      case OPT_DEVICES: options.devices = strtoul(optarg, nullptr, 10); break;
+      case OPT_CUSTOMER: options.customer = optarg; break;
+      case OPT_ZONES: options.zones = strtoul(optarg, nullptr, 10); break;
+      case OPT_CHANNELS: options.channels = strtoul(optarg, nullptr, 10); break;
+      case OPT_DURATION: options.duration = strtoul(optarg, nullptr, 10); break;
+      case OPT_COMMAND_RATE: options.commandRate = atof(optarg); break;
+      case OPT_REPORT: options.report = strtoul(optarg, nullptr, 10); break;
+      case OPT_OUTAGE_AT: options.outageAt = strtoul(optarg, nullptr, 10); break;
+      case OPT_OUTAGE_FOR: options.outageFor = strtoul(optarg, nullptr, 10); break;
+      case OPT_IR_FAIL: options.irFailPermille = strtoul(optarg, nullptr, 10); break;
+      case OPT_MAC_PREFIX: options.macPrefix = strtoul(optarg, nullptr, 16); break;
+      case OPT_HEARTBEAT: options.heartbeat = strtoul(optarg, nullptr, 10); break;
+      case OPT_PERIODIC: options.periodic = true; break;
+      case OPT_STARTUP_SPREAD: options.startupSpread = strtoul(optarg, nullptr, 10); break;
+      case OPT_CSV: options.csv = optarg; break;
+      default:
+        usage(argv[0]);
+        return false;
+    }
+  }
+  if (options.devices == 0 || options.devices > 0xFFFFFF || options.zones == 0 || options.channels == 0 ||
+      options.channels > AC_MAX_CHANNELS || options.report == 0 || options.irFailPermille > 1000 ||
+      options.macPrefix > 0xFFFFFF) {
+    usage(argv[0]);
+    return false;
+  }
+  if (options.port == 0) {
+    options.port = options.tls ? 8883 : 1883;
+  }
+  return true;
+}
+
+// Resolved once; thousands of devices must not each hit the resolver on a reconnect
+static bool resolveBroker(const Options& options, SimConfig& config) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result = nullptr;
+  std::string port = std::to_string(options.port);
+  int error = getaddrinfo(options.host, port.c_str(), &hints, &result);
+  if (error != 0) {
+    fprintf(stderr, "Cannot resolve %s: %s\n", options.host, gai_strerror(error));
+    return false;
+  }
+  memcpy(&config.address, result->ai_addr, result->ai_addrlen);
+  config.addressLength = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+static SSL_CTX* createTlsContext(bool insecure) {
+  SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+  if (context == nullptr) {
+    return nullptr;
+  }
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  if (insecure) {
+    SSL_CTX_set_verify(context, SSL_VERIFY_NONE, nullptr);
+  } else {
+    SSL_CTX_set_default_verify_paths(context);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+  }
+  return context;
+}
+
+// One socket per device plus the driver, stdio and the resolver
+static void raiseFileLimit(unsigned devices) {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return;
+  }
+  rlim_t wanted = devices + 64;
+  if (limit.rlim_cur < wanted) {
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (limit.rlim_cur < wanted) {
+    fprintf(stderr, "Warning: open file limit %lu is below the %lu sockets this run needs\n",
+            (unsigned long)limit.rlim_cur, (unsigned long)wanted);
+  }
+}
+
+static void printPercentiles(const char* label, std::vector<uint32_t> samples, double scale, const char* unit) {
+  if (samples.empty()) {
+    printf("  %-10s no samples\n", label);
+    return;
+  }
+  size_t count = samples.size();
+  double p50 = percentile(samples, 0.50) * scale;
+  double p90 = percentile(samples, 0.90) * scale;
+  double p99 = percentile(samples, 0.99) * scale;
+  double max = percentile(samples, 1.0) * scale;
+  printf("  %-10s n=%zu p50=%.1f%s p90=%.1f%s p99=%.1f%s max=%.1f%s\n", label, count, p50, unit, p90, unit, p99, unit,
+         max, unit);
+}
+
+static void printReport(uint64_t elapsed, uint64_t interval, size_t online, size_t devices, const FleetCounters& now,
+                        const FleetCounters& previous, const FleetStats& stats, size_t& rttCursor, size_t& connectCursor) {
+  double seconds = interval / 1000.0;
+  printf("[%6.1fs] online %zu/%zu  attempts %.1f/s  connects %llu  failures %llu  refused %llu  drops %llu\n",
+         elapsed / 1000.0, online, devices, (now.connectAttempts - previous.connectAttempts) / seconds,
+         (unsigned long long)(now.connects - previous.connects),
+         (unsigned long long)(now.connectFailures - previous.connectFailures),
+         (unsigned long long)(now.connectRefused - previous.connectRefused),
+         (unsigned long long)(now.drops - previous.drops));
+  printf("  publish/s");
+  uint64_t total = 0;
+  for (size_t i = 0; i < (size_t)PublishKind::Count; i++) {
+    uint64_t count = now.published[i] - previous.published[i];
+    total += count;
+    printf(" %s %.1f", publishKindName((PublishKind)i), count / seconds);
+  }
+  printf("  total %.1f  failed %llu\n", total / seconds, (unsigned long long)(now.publishFailed - previous.publishFailed));
+  printf("  commands sent %llu  acked %llu  lost %llu  received %llu  ir frames %llu  ir failures %llu\n",
+         (unsigned long long)(now.commandsSent - previous.commandsSent),
+         (unsigned long long)(now.commandsAcked - previous.commandsAcked),
+         (unsigned long long)(now.commandsLost - previous.commandsLost),
+         (unsigned long long)(now.commandsReceived - previous.commandsReceived),
+         (unsigned long long)(now.irFrames - previous.irFrames),
+         (unsigned long long)(now.irFailures - previous.irFailures));
+  printPercentiles("rtt", stats.takeRtt(rttCursor), 0.001, "ms");
+  printPercentiles("connect", stats.takeConnectTimes(connectCursor), 1.0, "ms");
+  fflush(stdout);
+}
+
+// The storm profile: how high the attempt rate peaked, how long it stayed
+// above the threshold and how long the fleet took to come back after the outage
+static void printSummary(const Options& options, const FleetStats& stats, uint64_t elapsed, uint64_t recoveredAt,
+                         uint64_t outageEnd) {
+  const FleetCounters& totals = stats.counters;
+  double seconds = elapsed / 1000.0;
+  printf("\nSummary after %.1fs, %u devices\n", seconds, options.devices);
+  printf("  connect attempts %llu  connects %llu  failures %llu  refused %llu  drops %llu\n",
+         (unsigned long long)totals.connectAttempts, (unsigned long long)totals.connects,
+         (unsigned long long)totals.connectFailures, (unsigned long long)totals.connectRefused,
+         (unsigned long long)totals.drops);
+  printf("  published");
+  uint64_t total = 0;
+  for (size_t i = 0; i < (size_t)PublishKind::Count; i++) {
+    total += totals.published[i];
+    printf(" %s %llu", publishKindName((PublishKind)i), (unsigned long long)totals.published[i]);
+  }
+  printf("  total %llu (%.1f/s)  failed %llu\n", (unsigned long long)total, total / seconds,
+         (unsigned long long)totals.publishFailed);
+  printf("  commands sent %llu  acked %llu  lost %llu  ignored %llu\n", (unsigned long long)totals.commandsSent,
+         (unsigned long long)totals.commandsAcked, (unsigned long long)totals.commandsLost,
+         (unsigned long long)totals.commandsIgnored);
+  printPercentiles("rtt", stats.rtt(), 0.001, "ms");
+  printPercentiles("connect", stats.connectTimes(), 1.0, "ms");
+
+  const std::vector<uint32_t>& attempts = stats.attemptsPerSecond();
+  uint32_t threshold = options.devices * STORM_THRESHOLD_PERCENT / 100;
+  threshold = threshold > 0 ? threshold : 1;
+  uint32_t peak = 0;
+  size_t peakSecond = 0;
+  size_t stormSeconds = 0;
+  for (size_t i = 0; i < attempts.size(); i++) {
+    if (attempts[i] > peak) {
+      peak = attempts[i];
+      peakSecond = i;
+    }
+    stormSeconds += attempts[i] > threshold ? 1 : 0;
+  }
+  printf("  reconnect storm: peak %u attempts/s at %zus (%.1f%% of the fleet), %zu s above %u attempts/s\n", peak,
+         peakSecond, 100.0 * peak / options.devices, stormSeconds, threshold);
+  if (outageEnd > 0) {
+    if (recoveredAt > 0) {
+      printf("  outage recovery: whole fleet online %.1fs after the broker came back\n", (recoveredAt - outageEnd) / 1000.0);
+    } else {
+      printf("  outage recovery: fleet not fully online by the end of the run\n");
+    }
+  }
+
+  if (options.csv != nullptr) {
+    FILE* file = fopen(options.csv, "w");
+    if (file == nullptr) {
+      fprintf(stderr, "Cannot write %s\n", options.csv);
+      return;
+    }
+    fprintf(file, "second,attempts\n");
+    for (size_t i = 0; i < attempts.size(); i++) {
+      fprintf(file, "%zu,%u\n", i, attempts[i]);
+    }
+    fclose(file);
+  }
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    return 2;
+  }
+
+  SimConfig config;
+  if (!resolveBroker(options, config)) {
+    return 1;
+  }
+  if (options.tls) {
+    config.tls = createTlsContext(options.insecure);
+    if (config.tls == nullptr) {
+      fprintf(stderr, "Cannot create the TLS context\n");
+      return 1;
+    }
+  }
+  config.serverName = options.host;
+  config.username = options.username;
+  config.password = options.password;
+  config.customerId = options.customer;
+  config.channels = options.channels;
+  config.telemetryOnChange = !options.periodic;
+  config.heartbeatInterval = options.heartbeat * 1000;
+  config.startupSpread = options.startupSpread * 1000;
+  config.irFailPermille = options.irFailPermille;
+
+  raiseFileLimit(options.devices);
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  FleetStats stats;
+  std::vector<std::unique_ptr<VirtualDevice>> devices;
+  devices.reserve(options.devices);
+  for (unsigned i = 0; i < options.devices; i++) {
+    uint8_t mac[6] = {
+      (uint8_t)(options.macPrefix >> 16), (uint8_t)(options.macPrefix >> 8), (uint8_t)options.macPrefix,
+      (uint8_t)(i >> 16), (uint8_t)(i >> 8), (uint8_t)i
+    };
+    std::string zone = "zone-" + std::to_string(i % options.zones);
+    devices.emplace_back(new VirtualDevice(config, stats, mac, zone.c_str()));
+  }
+  CommandDriver driver(config, stats, devices, options.commandRate);
+
+  uint64_t startedAt = monotonicMicros() / 1000;
+  for (auto& device : devices) {
+    device->start(0);
+  }
+  printf("Simulating %u devices against %s:%d%s, customer %s\n", options.devices, options.host, options.port,
+         options.tls ? " (TLS)" : "", options.customer);
+  fflush(stdout);
+
+  uint64_t outageStart = options.outageAt * 1000ULL;
+  uint64_t outageEnd = options.outageAt > 0 ? outageStart + options.outageFor * 1000ULL : 0;
+  uint64_t recoveredAt = 0;
+  uint64_t lastReport = 0;
+  FleetCounters previous = stats.counters;
+  size_t rttCursor = 0;
+  size_t connectCursor = 0;
+  std::vector<pollfd> fds;
+  std::vector<MqttLink*> links;
+  uint64_t now = 0;
+
+  while (!stopRequested && (options.duration == 0 || now < options.duration * 1000ULL)) {
+    // Only links with a socket are polled; the rest still get a service() pass for their timers
+    fds.clear();
+    links.clear();
+    for (auto& device : devices) {
+      links.push_back(&device->link());
+    }
+    links.push_back(&driver.link());
+    for (MqttLink* link : links) {
+      if (link->fd() >= 0) {
+        fds.push_back({link->fd(), link->events(), 0});
+      }
+    }
+    if (poll(fds.data(), fds.size(), POLL_TIMEOUT) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    now = monotonicMicros() / 1000 - startedAt;
+
+    size_t next = 0;
+    for (MqttLink* link : links) {
+      short revents = 0;
+      if (link->fd() >= 0 && next < fds.size() && fds[next].fd == link->fd()) {
+        revents = fds[next++].revents;
+      }
+      link->service(revents, now);
+    }
+
+    bool outage = outageEnd > 0 && now >= outageStart && now < outageEnd;
+    if (outage && !config.outage) {
+      printf("[%6.1fs] broker outage for %us\n", now / 1000.0, options.outageFor);
+      for (MqttLink* link : links) {
+        link->drop(now);
+      }
+    } else if (!outage && config.outage) {
+      printf("[%6.1fs] broker back\n", now / 1000.0);
+    }
+    config.outage = outage;
+
+    size_t online = 0;
+    for (auto& device : devices) {
+      device->loop(now);
+      online += device->online() ? 1 : 0;
+    }
+    driver.loop(now);
+    if (outageEnd > 0 && recoveredAt == 0 && now >= outageEnd && online == devices.size()) {
+      recoveredAt = now;
+    }
+
+    if (now - lastReport >= options.report * 1000ULL) {
+      FleetCounters current = stats.counters;
+      printReport(now, now - lastReport, online, devices.size(), current, previous, stats, rttCursor, connectCursor);
+      previous = current;
+      lastReport = now;
+    }
+  }
+
+  printSummary(options, stats, now, recoveredAt, outageEnd);
+  devices.clear();
+  if (config.tls != nullptr) {
+    SSL_CTX_free(config.tls);
+  }
+  return 0;
+}
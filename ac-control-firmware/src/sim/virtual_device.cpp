@@ -0,0 +1,468 @@
+#include "virtual_device.h"
+
+#include <ArduinoJson.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core/telemetry_format.h"
+
+// Firmware values from main.cpp, so each virtual device keeps the real cadence
+const uint32_t RECONNECT_INTERVAL = 5000;
+const uint32_t MAX_RECONNECT_INTERVAL = 30000;
+const uint32_t MAX_RETRY_AFTER = 3600;          // Seconds
+const uint32_t TELEMETRY_INTERVAL = 30000;      // Periodic full telemetry when telemetry_on_change is off
+const uint32_t COMMAND_COALESCE_WINDOW = 200;
+const uint32_t BATCH_SAMPLE_INTERVAL = 1000;
+const uint32_t BATCH_INTERVAL = 300000;
+const uint32_t PUBLISH_DRAIN_INTERVAL = 50;
+const size_t PUBLISH_DRAIN_BURST = 4;
+const size_t PUBLISH_PAYLOAD_SIZE = 768;
+const size_t STATE_COMMAND_COPY_SIZE = 256;
+const uint16_t MQTT_KEEPALIVE = 15;
+const uint32_t MQTT_STABLE_KEEPALIVES = 3;
+
+const uint8_t PUBLISH_RETAINED = 0x01;
+const uint8_t SNAPSHOT_STATUS = 0x01;
+const uint8_t SNAPSHOT_TELEMETRY = 0x02;
+const uint8_t SNAPSHOT_STATE = 0x04; // Channel 0; channel n uses SNAPSHOT_STATE << n
+
+// A typical indoor link and an idle heap, so the batches look like a real unit's
+const int32_t SIM_RSSI_BASE = -55;
+const uint32_t SIM_RSSI_SPREAD = 20;
+const uint32_t SIM_FREE_HEAP = 30000;
+const uint32_t SIM_MAX_FREE_BLOCK = 20000;
+
+VirtualDevice::VirtualDevice(const SimConfig& config, FleetStats& stats, const uint8_t mac[6], const char* zoneId)
+  : _config(config), _stats(stats), _zoneId(zoneId), _link(*this), _backoff(RECONNECT_INTERVAL, MAX_RECONNECT_INTERVAL) {
+  buildTopicTable(_topics, mac, config.customerId, _zoneId.c_str(), config.broadcast);
+  _clientId = std::string("Wemos-") + _topics.deviceId;
+  _backoff.seed(mac, 6);
+  _backoff.setStableTime(MQTT_STABLE_KEEPALIVES * MQTT_KEEPALIVE * 1000);
+  // Separate from the backoff sequence so IR failures and RSSI do not shift it
+  _randomState = 0x9E3779B9u ^ ((uint32_t)mac[3] << 16 | (uint32_t)mac[4] << 8 | mac[5]);
+}
+
+void VirtualDevice::start(uint64_t now) {
+  _bootAt = now;
+  _lastReconnectAttempt = now;
+  _reconnectDelay = _backoff.initialDelay(_config.startupSpread);
+  _batchStartedAt = now;
+  _batch.begin(0);
+}
+
+void VirtualDevice::loop(uint64_t now) {
+  if (_link.state() == MqttLink::State::Closed) {
+    if (now - _lastReconnectAttempt >= _reconnectDelay) {
+      attemptConnect(now);
+    }
+  } else if (_link.connected()) {
+    _backoff.connectedFor((uint32_t)(now - _connectedAt));
+  }
+
+  for (uint8_t i = 0; i < _config.channels; i++) {
+    if (_channels[i].hasPendingState && now - _channels[i].pendingSince >= COMMAND_COALESCE_WINDOW) {
+      flushPendingCommand(i, now);
+    }
+  }
+  serviceOutbox(now);
+
+  uint64_t telemetryInterval = _config.telemetryOnChange ? _config.heartbeatInterval : TELEMETRY_INTERVAL;
+  if (now - _lastTelemetryTime >= telemetryInterval && _link.connected()) {
+    _lastTelemetryTime = now;
+    if (_config.telemetryOnChange) {
+      char payload[48];
+      formatHeartbeat(payload, sizeof(payload), SIM_RSSI_BASE - (int)random(SIM_RSSI_SPREAD), (unsigned long)((now - _bootAt) / 1000));
+      enqueue(PublishKind::Heartbeat, payload, 0);
+    } else {
+      publishTelemetry();
+    }
+  }
+
+  if (now - _lastBatchSample >= BATCH_SAMPLE_INTERVAL) {
+    _lastBatchSample = now;
+    _batch.sample(SIM_RSSI_BASE - (int32_t)random(SIM_RSSI_SPREAD), SIM_FREE_HEAP, SIM_MAX_FREE_BLOCK, 0);
+  }
+  if (now - _batchStartedAt >= BATCH_INTERVAL) {
+    char payload[PUBLISH_PAYLOAD_SIZE];
+    uint32_t uptime = (uint32_t)((now - _bootAt) / 1000);
+    _batch.format(payload, sizeof(payload), uptime);
+    enqueue(PublishKind::Batch, payload, 0);
+    _batchStartedAt = now;
+    _batch.begin(uptime);
+  }
+}
+
+void VirtualDevice::attemptConnect(uint64_t now) {
+  _lastReconnectAttempt = now;
+  _stats.recordAttempt(now);
+  for (uint8_t i = 0; i < _config.channels; i++) {
+    flushPendingCommand(i, now);
+  }
+  if (_config.outage) {
+    _stats.counters.connectFailures++;
+  } else {
+    MqttLink::Options options = {
+      _clientId.c_str(), _config.username, _config.password, _topics.status, "offline", MQTT_KEEPALIVE
+    };
+    if (!_link.connect(_config.address, _config.addressLength, _config.tls, _config.serverName, options, now)) {
+      _stats.counters.connectFailures++;
+    }
+  }
+  _reconnectDelay = _backoff.next();
+}
+
+void VirtualDevice::onConnected(uint64_t now) {
+  _stats.counters.connects++;
+  _stats.recordConnectTime((uint32_t)(now - _link.attemptStartedAt()));
+  char topic[MQTT_TOPIC_SIZE];
+  for (size_t i = 0; i < TOPIC_ROUTE_COUNT; i++) {
+    if (buildTopic(topic, sizeof(topic), _topics.base, topicRoutes[i].suffix)) {
+      _link.subscribe(topic);
+    }
+  }
+  _link.subscribe(_topics.backpressure);
+  for (uint8_t i = 1; i < _config.channels; i++) {
+    if (buildChannelTopic(topic, sizeof(topic), _topics, i, "/command/+")) {
+      _link.subscribe(topic);
+    }
+  }
+  if (_topics.zoneBaseLength > 0 && buildTopic(topic, sizeof(topic), _topics.zoneBase, "/command/+")) {
+    _link.subscribe(topic);
+  }
+  if (_topics.broadcastBaseLength > 0 && buildTopic(topic, sizeof(topic), _topics.broadcastBase, "/command/+")) {
+    _link.subscribe(topic);
+  }
+  _pendingSnapshots |= SNAPSHOT_STATUS;
+  publishTelemetry();
+  _connectedAt = now;
+}
+
+void VirtualDevice::onConnectFailed(int returnCode, uint64_t now) {
+  (void)now;
+  _stats.counters.connectFailures++;
+  if (returnCode == 3) {
+    // CONNACK "server unavailable"; the delay still counts from this attempt
+    _stats.counters.connectRefused++;
+    _reconnectDelay = _backoff.serverBusy();
+  }
+}
+
+void VirtualDevice::onDisconnected(uint64_t now) {
+  _stats.counters.drops++;
+  _batch.recordMqttDrop();
+  // A broker outage drops the whole fleet at once, so even the first retry waits
+  _lastReconnectAttempt = now;
+  _reconnectDelay = _backoff.next();
+}
+
+// Same dispatch as mqttCallback(); only the AC commands are executed
+void VirtualDevice::onMessage(const char* topic, char* payload, size_t length, uint64_t now) {
+  _stats.counters.commandsReceived++;
+  if (strcmp(topic, _topics.backpressure) == 0) {
+    applyBackpressureHint(payload, length);
+    return;
+  }
+  bool group = false;
+  uint8_t channel = 0;
+  const TopicRoute* route = findTopicRoute(_topics, topic, group, channel);
+  if (route == nullptr || (channel != AC_ALL_CHANNELS && channel >= _config.channels)) {
+    _stats.counters.commandsIgnored++;
+    return;
+  }
+  switch (route->command) {
+    case CommandType::State:
+      if (channel != AC_ALL_CHANNELS) {
+        applyStateCommand(channel, payload, length, group, now);
+      } else if (_config.channels == 1 || length < STATE_COMMAND_COPY_SIZE) {
+        // Decoded in place, so all but the last channel work on a copy
+        char copy[STATE_COMMAND_COPY_SIZE];
+        for (uint8_t i = 0; i + 1 < _config.channels; i++) {
+          memcpy(copy, payload, length);
+          applyStateCommand(i, copy, length, true, now);
+        }
+        applyStateCommand(_config.channels - 1, payload, length, true, now);
+      } else {
+        publishError("IR", "Group state command too long");
+      }
+      return;
+    case CommandType::Power:
+    case CommandType::Mode:
+    case CommandType::Temperature:
+    case CommandType::FanSpeed:
+      break;
+    default:
+      _stats.counters.commandsIgnored++;
+      return;
+  }
+  uint32_t sequence = 0;
+  size_t valueLength = length;
+  const char* value = unwrapCommandEnvelope(payload, valueLength, sequence);
+  if (value == nullptr) {
+    publishError("IR", "Invalid command envelope");
+    return;
+  }
+  if (channel == AC_ALL_CHANNELS) {
+    for (uint8_t i = 0; i < _config.channels; i++) {
+      sendIRSignal(i, route->command, value, valueLength, 0, now);
+    }
+  } else {
+    sendIRSignal(channel, route->command, value, valueLength, sequence, now);
+  }
+}
+
+void VirtualDevice::applyBackpressureHint(char* payload, size_t length) {
+  uint32_t retryAfter = 0;
+  uint32_t spread = 0;
+  if (length > 0) {
+    StaticJsonDocument<96> doc;
+    if (deserializeJson(doc, payload, length)) {
+      return;
+    }
+    retryAfter = doc["retry_after"] | (uint32_t)0;
+    retryAfter = retryAfter < MAX_RETRY_AFTER ? retryAfter : MAX_RETRY_AFTER;
+    spread = doc["spread"] | retryAfter;
+    spread = spread < MAX_RETRY_AFTER ? spread : MAX_RETRY_AFTER;
+  }
+  _backoff.setRetryAfter(retryAfter * 1000, spread * 1000);
+}
+
+bool VirtualDevice::acceptCommandSequence(uint8_t channel, uint32_t sequence) {
+  if (sequence == 0) {
+    return true;
+  }
+  if (sequence <= _lastCommandSequence) {
+    if (_channels[channel].hasPendingState && sequence <= _channels[channel].pendingSequence) {
+      return false; // The flush acks it
+    }
+    publishCommandAck(channel, sequence, sequence == _lastCommandSequence ? "duplicate" : "stale");
+    return false;
+  }
+  _lastCommandSequence = sequence;
+  return true;
+}
+
+bool VirtualDevice::sendIRSignal(uint8_t channel, CommandType command, const char* value, size_t length, uint32_t sequence,
+                                 uint64_t now) {
+  if (!acceptCommandSequence(channel, sequence)) {
+    return false;
+  }
+  Channel& unit = _channels[channel];
+  ACState next = unit.hasPendingState ? unit.pendingState : unit.state;
+  if (!applyFieldCommand(command, value, length, next)) {
+    publishError("IR", "Invalid command value");
+    publishCommandAck(channel, sequence, "invalid");
+    return false;
+  }
+  unit.pendingState = next;
+  unit.pendingSequence = sequence > unit.pendingSequence ? sequence : unit.pendingSequence;
+  if (!unit.hasPendingState) {
+    unit.hasPendingState = true;
+    unit.pendingSince = now;
+  }
+  return true;
+}
+
+bool VirtualDevice::flushPendingCommand(uint8_t channel, uint64_t now) {
+  Channel& unit = _channels[channel];
+  if (!unit.hasPendingState) {
+    return true;
+  }
+  unit.hasPendingState = false;
+  uint32_t sequence = unit.pendingSequence;
+  unit.pendingSequence = 0;
+  if (transmitACState(channel, unit.pendingState, now)) {
+    publishCommandAck(channel, sequence, "ok");
+    if (!_config.telemetryOnChange) {
+      _pendingSnapshots |= SNAPSHOT_STATUS;
+    }
+    publishStateTelemetry(channel);
+    return true;
+  }
+  publishCommandAck(channel, sequence, "ir_failed");
+  return false;
+}
+
+bool VirtualDevice::applyStateCommand(uint8_t channel, char* payload, size_t length, bool group, uint64_t now) {
+  Channel& unit = _channels[channel];
+  ACState next = unit.hasPendingState ? unit.pendingState : unit.state;
+  uint32_t sequence = 0;
+  StateCommandResult result = decodeStateCommand(payload, length, next, sequence);
+  if (result == StateCommandResult::Malformed) {
+    publishError("IR", "Invalid state command payload");
+    return false;
+  }
+  if (group) {
+    sequence = 0;
+  }
+  if (!acceptCommandSequence(channel, sequence)) {
+    return false;
+  }
+  if (result != StateCommandResult::Ok) {
+    publishError("IR", result == StateCommandResult::Empty ? "Empty state command" : "Invalid value in state command");
+    publishCommandAck(channel, sequence, "invalid");
+    return false;
+  }
+  unit.hasPendingState = false;
+  sequence = sequence > unit.pendingSequence ? sequence : unit.pendingSequence;
+  unit.pendingSequence = 0;
+  if (transmitACState(channel, next, now)) {
+    publishCommandAck(channel, sequence, "ok");
+    publishStateTelemetry(channel);
+    return true;
+  }
+  publishCommandAck(channel, sequence, "ir_failed");
+  return false;
+}
+
+// Stub IR emitter: the frame is counted and fails at the configured rate
+bool VirtualDevice::transmitACState(uint8_t channel, const ACState& next, uint64_t now) {
+  _stats.counters.irFrames++;
+  if (random(1000) < _config.irFailPermille) {
+    _stats.counters.irFailures++;
+    publishError("IR", "Failed to send IR signal");
+    return false;
+  }
+  _channels[channel].state = next;
+  _batch.recordState((uint32_t)((now - _bootAt) / 1000), channel, next);
+  return true;
+}
+
+void VirtualDevice::publishCommandAck(uint8_t channel, uint32_t sequence, const char* result) {
+  if (sequence == 0) {
+    return;
+  }
+  char payload[160];
+  formatCommandAck(payload, sizeof(payload), sequence, result, channel, _channels[channel].state);
+  enqueue(PublishKind::Ack, payload, 0);
+}
+
+void VirtualDevice::publishError(const char* type, const char* message) {
+  char payload[256];
+  snprintf(payload, sizeof(payload), "{\"type\":\"%s\",\"message\":\"%s\",\"origin\":\"firmware\"}", type, message);
+  enqueue(PublishKind::Error, payload, PUBLISH_RETAINED);
+}
+
+void VirtualDevice::publishTelemetry() {
+  _pendingSnapshots |= SNAPSHOT_TELEMETRY;
+  _pendingSnapshots &= ~SNAPSHOT_STATE;
+  for (uint8_t i = 1; i < _config.channels; i++) {
+    _pendingSnapshots |= SNAPSHOT_STATE << i;
+  }
+}
+
+void VirtualDevice::publishStateTelemetry(uint8_t channel) {
+  const Channel& unit = _channels[channel];
+  if (!_config.telemetryOnChange) {
+    publishTelemetry();
+    return;
+  }
+  if (unit.stateTelemetryPublished && unit.state.power == unit.lastPublishedState.power &&
+      unit.state.mode == unit.lastPublishedState.mode && unit.state.degrees == unit.lastPublishedState.degrees &&
+      unit.state.fanspeed == unit.lastPublishedState.fanspeed) {
+    return;
+  }
+  if (channel > 0 || !(_pendingSnapshots & SNAPSHOT_TELEMETRY)) {
+    _pendingSnapshots |= SNAPSHOT_STATE << channel;
+  }
+}
+
+// The firmware's ring: the oldest records are evicted when it is full
+void VirtualDevice::enqueue(PublishKind kind, const char* payload, uint8_t flags) {
+  size_t length = strlen(payload);
+  while (!_queue.fits(length) && !_queue.empty()) {
+    _queue.pop();
+    _stats.counters.publishFailed++;
+  }
+  _queue.push((uint8_t)kind, flags, payload, length);
+}
+
+void VirtualDevice::serviceOutbox(uint64_t now) {
+  if (!_link.connected() || now - _lastPublishDrain < PUBLISH_DRAIN_INTERVAL) {
+    return;
+  }
+  size_t sent = 0;
+  char payload[PUBLISH_PAYLOAD_SIZE];
+  while (sent < PUBLISH_DRAIN_BURST && _link.connected()) {
+    if (_pendingSnapshots != 0) {
+      uint8_t snapshot = _pendingSnapshots & -_pendingSnapshots;
+      if (!sendSnapshot(snapshot, now)) {
+        break;
+      }
+      _pendingSnapshots &= ~snapshot;
+    } else if (!_queue.empty()) {
+      PublishQueue::Header header;
+      _queue.peek(header);
+      size_t length = _queue.read(payload, sizeof(payload));
+      PublishKind kind = (PublishKind)header.topic;
+      const char* topic = kind == PublishKind::Heartbeat ? _topics.heartbeat
+                        : kind == PublishKind::Batch     ? _topics.batch
+                        : kind == PublishKind::Ack       ? _topics.ack
+                                                         : _topics.error;
+      if (!_link.publish(topic, payload, length, header.flags & PUBLISH_RETAINED)) {
+        _stats.counters.publishFailed++;
+        break;
+      }
+      _stats.recordPublish(kind);
+      _queue.pop();
+    } else {
+      break;
+    }
+    sent++;
+  }
+  if (sent == PUBLISH_DRAIN_BURST) {
+    _lastPublishDrain = now; // More may be waiting; pace the rest
+  }
+}
+
+bool VirtualDevice::sendSnapshot(uint8_t snapshot, uint64_t now) {
+  char payload[PUBLISH_PAYLOAD_SIZE];
+  uint8_t channel = 0;
+  bool sent;
+  if (snapshot == SNAPSHOT_STATUS) {
+    sent = _link.publish(_topics.status, "online", 6, true);
+    if (sent) {
+      _stats.recordPublish(PublishKind::Status);
+    }
+  } else if (snapshot == SNAPSHOT_TELEMETRY) {
+    DeviceDescriptor device = {
+      _topics.deviceId, _config.customerId, _zoneId.c_str(), _config.brand,
+      _config.protocol, _config.firmwareVersion, _config.wifiSsid, SIM_RSSI_BASE - (int)random(SIM_RSSI_SPREAD)
+    };
+    size_t length = formatTelemetry(payload, sizeof(payload), device, _channels[0].state);
+    sent = _link.publish(_topics.telemetry, payload, length, true);
+    if (sent) {
+      _stats.recordPublish(PublishKind::Telemetry);
+    }
+  } else {
+    while ((SNAPSHOT_STATE << channel) != snapshot) {
+      channel++;
+    }
+    char topic[MQTT_TOPIC_SIZE];
+    if (!buildChannelTopic(topic, sizeof(topic), _topics, channel, "/telemetry/state")) {
+      return true;
+    }
+    size_t length = formatStateTelemetry(payload, sizeof(payload), _channels[channel].state);
+    sent = _link.publish(topic, payload, length, true);
+    if (sent) {
+      _stats.recordPublish(PublishKind::State);
+    }
+  }
+  if (!sent) {
+    _stats.counters.publishFailed++;
+    return false;
+  }
+  if (snapshot != SNAPSHOT_STATUS) {
+    _lastTelemetryTime = now;
+    _channels[channel].lastPublishedState = _channels[channel].state;
+    _channels[channel].stateTelemetryPublished = true;
+  }
+  return true;
+}
+
+// xorshift32, the same generator as the backoff but on its own state
+uint32_t VirtualDevice::random(uint32_t range) {
+  _randomState ^= _randomState << 13;
+  _randomState ^= _randomState >> 17;
+  _randomState ^= _randomState << 5;
+  return range ? _randomState % range : 0;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+
+#include "core/ac_state.h"
+#include "core/command_codec.h"
+#include "core/publish_queue.h"
+#include "core/reconnect_backoff.h"
+#include "core/telemetry_batch.h"
+#include "core/topics.h"
+#include "fleet_stats.h"
+#include "mqtt_link.h"
+
+// Broker and device settings shared by every device in a run
+struct SimConfig {
+  sockaddr_storage address = {};
+  socklen_t addressLength = 0;
+  SSL_CTX* tls = nullptr;           // nullptr for plain MQTT
+  const char* serverName = "";
+  const char* username = nullptr;
+  const char* password = nullptr;
+  const char* customerId = "sim";
+  const char* brand = "DAIKIN";
+  const char* protocol = "16";      // decode_type_t, as config.ac_protocol stores it
+  const char* firmwareVersion = "1.0.2";
+  const char* wifiSsid = "sim";
+  uint8_t channels = 1;
+  bool broadcast = true;            // MQTT_CUSTOMER_BROADCAST
+  bool telemetryOnChange = true;
+  uint32_t heartbeatInterval = 60000;
+  uint32_t startupSpread = 10000;   // MQTT_STARTUP_SPREAD, as after a power-on reset
+  uint16_t irFailPermille = 0;
+  bool outage = false;              // Simulated broker outage: every attempt fails at once
+};
+
+// One simulated controller. It follows the firmware's loop(): the same topic
+// table, will, subscriptions, jittered reconnects, command coalescing,
+// cumulative acks, retained snapshots and telemetry cadence, built on the
+// same core code. The IR emitter is a stub that only counts frames, and
+// there is no flash, metrics topic, schedule, OTA or LAN API.
+class VirtualDevice : public MqttLink::Handler {
+ public:
+  VirtualDevice(const SimConfig& config, FleetStats& stats, const uint8_t mac[6], const char* zoneId);
+
+  // Power-on: the first connect waits a random part of the startup spread
+  void start(uint64_t now);
+
+  // One firmware loop() pass; service the link first
+  void loop(uint64_t now);
+
+  MqttLink& link() { return _link; }
+  bool online() const { return _link.connected(); }
+  const TopicTable& topics() const { return _topics; }
+
+  void onConnected(uint64_t now) override;
+  void onConnectFailed(int returnCode, uint64_t now) override;
+  void onDisconnected(uint64_t now) override;
+  void onMessage(const char* topic, char* payload, size_t length, uint64_t now) override;
+
+ private:
+  // Per-channel state, as ACChannel in main.cpp
+  struct Channel {
+    ACState state;
+    ACState pendingState;
+    bool hasPendingState = false;
+    uint64_t pendingSince = 0;
+    uint32_t pendingSequence = 0;
+    ACState lastPublishedState;
+    bool stateTelemetryPublished = false;
+  };
+
+  void attemptConnect(uint64_t now);
+  void applyBackpressureHint(char* payload, size_t length);
+  bool acceptCommandSequence(uint8_t channel, uint32_t sequence);
+  bool sendIRSignal(uint8_t channel, CommandType command, const char* value, size_t length, uint32_t sequence, uint64_t now);
+  bool applyStateCommand(uint8_t channel, char* payload, size_t length, bool group, uint64_t now);
+  bool flushPendingCommand(uint8_t channel, uint64_t now);
+  bool transmitACState(uint8_t channel, const ACState& next, uint64_t now);
+  void publishCommandAck(uint8_t channel, uint32_t sequence, const char* result);
+  void publishError(const char* type, const char* message);
+  void publishTelemetry();
+  void publishStateTelemetry(uint8_t channel);
+  void enqueue(PublishKind kind, const char* payload, uint8_t flags);
+  void serviceOutbox(uint64_t now);
+  bool sendSnapshot(uint8_t snapshot, uint64_t now);
+  uint32_t random(uint32_t range);
+
+  const SimConfig& _config;
+  FleetStats& _stats;
+  std::string _zoneId;
+  std::string _clientId;
+  TopicTable _topics;
+  MqttLink _link;
+  ReconnectBackoff _backoff;
+  Channel _channels[AC_MAX_CHANNELS];
+  uint32_t _lastCommandSequence = 0;
+  uint8_t _pendingSnapshots = 0;
+  PublishQueue _queue;
+  TelemetryBatch _batch;
+  uint64_t _bootAt = 0;
+  uint64_t _lastReconnectAttempt = 0;
+  uint64_t _connectedAt = 0;
+  uint64_t _reconnectDelay = 0;
+  uint64_t _lastTelemetryTime = 0;
+  uint64_t _lastBatchSample = 0;
+  uint64_t _batchStartedAt = 0;
+  uint64_t _lastPublishDrain = 0;
+  uint32_t _randomState;
+};
@@ -0,0 +1,31 @@
+#include "tls_pool.h"
+
+#include "log.h"
+
+// BearSSL's defaults; an owner may shrink them after an MFLN probe
+const uint16_t TLS_DEFAULT_RX_BUFFER = 16384;
+const uint16_t TLS_DEFAULT_TX_BUFFER = 512;
+
+SecureClientPool tlsPool;
+
+BearSSL::WiFiClientSecure* SecureClientPool::acquire(Owner owner) {
+  if (_holder == owner) {
+    return &_client;
+  }
+  if (_holder != Owner::None) {
+    LOG_WARN("TLS", "Secure client busy with owner %u", (unsigned)_holder);
+    return nullptr;
+  }
+  _holder = owner;
+  _client.setBufferSizes(TLS_DEFAULT_RX_BUFFER, TLS_DEFAULT_TX_BUFFER);
+  _client.setInsecure();
+  return &_client;
+}
+
+void SecureClientPool::release(Owner owner) {
+  if (_holder != owner) {
+    return;
+  }
+  _client.stop();
+  _holder = Owner::None;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+// The one TLS client shared by the provisioning API and the OTA download.
+// It is constructed once at boot and handed to one owner at a time, so the
+// two never hold record buffers at once. MQTT keeps its own client because
+// its connection stays open.
+//
+// Trust is set here for both owners. No CA bundle ships with the firmware,
+// so, as on the MQTT connection, the server certificate is not verified.
+// A firmware image is therefore only checked against the x-MD5 header of
+// the download server, and the update URL must come from a trusted broker.
+class SecureClientPool {
+ public:
+  enum class Owner : uint8_t {
+    None,
+    Api,
+    Ota
+  };
+
+  // The client for owner, or nullptr while another owner holds it.
+  // A new holder starts with the default record buffer sizes.
+  BearSSL::WiFiClientSecure* acquire(Owner owner);
+
+  // Closes the connection, which frees the record buffers; ignored unless owner holds it
+  void release(Owner owner);
+
+  Owner holder() const { return _holder; }
+
+ private:
+  BearSSL::WiFiClientSecure _client;
+  Owner _holder = Owner::None;
+};
+
+extern SecureClientPool tlsPool;
@@ -0,0 +1,376 @@
+// Host unit tests for the portable firmware core: wire formats, command
+// decoding, topic routing and the retry and discovery logic.
+//
+//   pio test -e native
+
+#include <string.h>
+#include <unity.h>
+
+#include "core/ac_codec.h"
+#include "core/ac_state.h"
+#include "core/command_codec.h"
+#include "core/protocol_search.h"
+#include "core/publish_queue.h"
+#include "core/reconnect_backoff.h"
+#include "core/telemetry_batch.h"
+#include "core/telemetry_format.h"
+#include "core/topics.h"
+
+void setUp() {}
+
+void tearDown() {}
+
+// Commands are decoded in place, as in the PubSubClient buffer
+static bool decodeFieldCommand(const char* text, CommandType command, ACState& state, uint32_t& sequence) {
+  char buffer[256];
+  strcpy(buffer, text);
+  size_t length = strlen(buffer);
+  const char* value = unwrapCommandEnvelope(buffer, length, sequence);
+  return value != nullptr && applyFieldCommand(command, value, length, state);
+}
+
+static void test_field_command_bare() {
+  ACState state;
+  uint32_t sequence = 1;
+  TEST_ASSERT_TRUE(decodeFieldCommand("heat", CommandType::Mode, state, sequence));
+  TEST_ASSERT_EQUAL_UINT32(0, sequence);
+  TEST_ASSERT_TRUE(state.mode == stdAc::opmode_t::kHeat);
+  TEST_ASSERT_TRUE_MESSAGE(state.power, "setting a field must turn the unit on");
+}
+
+// MQTT payloads are length-delimited and may contain NUL bytes
+static void test_field_command_embedded_nul() {
+  const char power[] = {'o', 'n', '\0', '\0', '\0', '\0', '\0', '\0'};
+  bool on = false;
+  TEST_ASSERT_FALSE(parsePowerValue(power, sizeof(power), false, on));
+  TEST_ASSERT_TRUE(parsePowerValue(power, 2, false, on) && on);
+  const char fanspeed[] = {'m', 'a', 'x', '\0', '\0', '\0'};
+  stdAc::fanspeed_t value = stdAc::fanspeed_t::kAuto;
+  TEST_ASSERT_FALSE(parseFanSpeedValue(fanspeed, sizeof(fanspeed), value));
+  stdAc::opmode_t mode = stdAc::opmode_t::kCool;
+  TEST_ASSERT_FALSE(parseModeValue("dry\0\0", 5, mode));
+}
+
+static void test_field_command_envelope() {
+  ACState state;
+  uint32_t sequence = 0;
+  TEST_ASSERT_TRUE(decodeFieldCommand("{\"seq\":42,\"value\":\"22\"}", CommandType::Temperature, state, sequence));
+  TEST_ASSERT_EQUAL_UINT32(42, sequence);
+  TEST_ASSERT_EQUAL_INT(22, state.degrees);
+  TEST_ASSERT_TRUE(state.power);
+  TEST_ASSERT_FALSE(decodeFieldCommand("{\"seq\":43,\"value\":\"31\"}", CommandType::Temperature, state, sequence));
+}
+
+static void test_state_command() {
+  char buffer[] = "{\"seq\":7,\"power\":\"on\",\"mode\":\"dry\",\"temperature\":21,\"fanspeed\":\"high\"}";
+  ACState state;
+  uint32_t sequence = 0;
+  TEST_ASSERT_TRUE(decodeStateCommand(buffer, strlen(buffer), state, sequence) == StateCommandResult::Ok);
+  TEST_ASSERT_EQUAL_UINT32(7, sequence);
+  TEST_ASSERT_TRUE(state.power);
+  TEST_ASSERT_TRUE(state.mode == stdAc::opmode_t::kDry);
+  TEST_ASSERT_EQUAL_INT(21, state.degrees);
+  TEST_ASSERT_TRUE(state.fanspeed == stdAc::fanspeed_t::kMax);
+
+  char outOfRange[] = "{\"seq\":8,\"temperature\":31}";
+  TEST_ASSERT_TRUE(decodeStateCommand(outOfRange, strlen(outOfRange), state, sequence) == StateCommandResult::Invalid);
+  char unknownOnly[] = "{\"seq\":9,\"foo\":1}";
+  TEST_ASSERT_TRUE_MESSAGE(decodeStateCommand(unknownOnly, strlen(unknownOnly), state, sequence) == StateCommandResult::Invalid,
+                           "unknown keys alone must not apply");
+}
+
+static void test_codec() {
+  stdAc::fanspeed_t fanspeed = stdAc::fanspeed_t::kAuto;
+  TEST_ASSERT_EQUAL_STRING_MESSAGE("max", fanSpeedName(stdAc::fanspeed_t::kMax), "name the dashboard maps");
+  TEST_ASSERT_EQUAL_STRING("min", fanSpeedName(stdAc::fanspeed_t::kMin));
+  TEST_ASSERT_TRUE_MESSAGE(parseFanSpeedValue("high", 4, fanspeed) && fanspeed == stdAc::fanspeed_t::kMax, "command alias");
+  TEST_ASSERT_TRUE(parseFanSpeedValue("low", 3, fanspeed) && fanspeed == stdAc::fanspeed_t::kMin);
+  TEST_ASSERT_FALSE(parseFanSpeedValue("hig", 3, fanspeed));
+  TEST_ASSERT_FALSE(decodeFanSpeedCode(0xFF, fanspeed));
+  stdAc::opmode_t mode = stdAc::opmode_t::kCool;
+  TEST_ASSERT_TRUE(decodeModeCode(modeCode(stdAc::opmode_t::kDry), mode) && mode == stdAc::opmode_t::kDry);
+}
+
+static void test_state_record() {
+  ACState state;
+  state.power = true;
+  state.mode = stdAc::opmode_t::kHeat;
+  state.degrees = 19;
+  state.fanspeed = stdAc::fanspeed_t::kMin;
+
+  ACStateRecord record;
+  encodeStateRecord(state, 42, record);
+  ACState decoded;
+  TEST_ASSERT_TRUE(decodeStateRecord(record, decoded));
+  TEST_ASSERT_EQUAL_UINT32(42, record.sequence);
+  TEST_ASSERT_TRUE(decoded.power && decoded.mode == state.mode && decoded.fanspeed == state.fanspeed);
+  TEST_ASSERT_EQUAL_INT(19, decoded.degrees);
+
+  ACStateRecord corrupt = record;
+  corrupt.degrees++;
+  TEST_ASSERT_FALSE_MESSAGE(decodeStateRecord(corrupt, decoded), "corrupt record accepted");
+}
+
+static void test_telemetry_formats() {
+  ACState state;
+  state.power = true;
+  char output[640];
+
+  formatStateTelemetry(output, sizeof(output), state);
+  TEST_ASSERT_EQUAL_STRING("{\"ac_power\":true,\"ac_mode\":\"cool\",\"ac_temperature\":25,\"ac_fanspeed\":\"medium\"}", output);
+  formatHeartbeat(output, sizeof(output), -61, 123456);
+  TEST_ASSERT_EQUAL_STRING("{\"rssi\":-61,\"uptime\":123456}", output);
+  formatCommandAck(output, sizeof(output), 9, "ok", 0, state);
+  TEST_ASSERT_EQUAL_STRING("{\"seq\":9,\"result\":\"ok\",\"ac_power\":true,\"ac_mode\":\"cool\",\"ac_temperature\":25,"
+                           "\"ac_fanspeed\":\"medium\"}", output);
+  formatCommandAck(output, sizeof(output), 9, "ok", 2, state);
+  TEST_ASSERT_EQUAL_STRING("{\"seq\":9,\"result\":\"ok\",\"channel\":2,\"ac_power\":true,\"ac_mode\":\"cool\","
+                           "\"ac_temperature\":25,\"ac_fanspeed\":\"medium\"}", output);
+
+  // Every member must survive, on 64-bit hosts too
+  DeviceDescriptor device = {
+    "AA:BB:CC:DD:EE:FF", "customer-1", "zone-1", "Daikin", "DAIKIN", "1.0.2", "office-wifi", -61
+  };
+  size_t length = formatTelemetry(output, sizeof(output), device, state);
+  TEST_ASSERT_EQUAL_STRING("{\"device_id\":\"AA:BB:CC:DD:EE:FF\",\"customer_id\":\"customer-1\",\"zone_id\":\"zone-1\","
+                           "\"ac_brand\":\"Daikin\",\"ac_protocol\":\"DAIKIN\",\"firmware_version\":\"1.0.2\","
+                           "\"wifi_ssid\":\"office-wifi\",\"rssi\":-61,\"ac_power\":true,\"ac_mode\":\"cool\","
+                           "\"ac_temperature\":25,\"ac_fanspeed\":\"medium\"}", output);
+  TEST_ASSERT_EQUAL_UINT32(strlen(output), length);
+}
+
+static void test_telemetry_batch() {
+  static TelemetryBatch batch;
+  char output[768]; // PUBLISH_PAYLOAD_SIZE
+  ACState state;
+  state.power = true;
+
+  batch.begin(100);
+  batch.sample(-60, 30000, 20000, 1500);
+  batch.sample(-72, 28000, 18000, 90000);
+  batch.recordState(112, 1, state);
+  batch.recordWiFiDrop();
+  size_t length = batch.format(output, sizeof(output), 400);
+  TEST_ASSERT_EQUAL_STRING("{\"start\":100,\"span\":300,\"samples\":2,\"rssi\":[-72,-66,-60],\"heap\":[28000,29000,30000],"
+                           "\"max_block\":[18000,19000,20000],\"stall_us\":[1500,45750,90000],\"wifi_drops\":1,\"mqtt_drops\":0,"
+                           "\"events\":[[12,1,1,1,25,3]],\"events_dropped\":0}", output);
+  TEST_ASSERT_EQUAL_UINT32(strlen(output), length);
+}
+
+// A full event ring of the widest values must fit one queued publish
+static void test_telemetry_batch_worst_case() {
+  static TelemetryBatch batch;
+  char output[768]; // PUBLISH_PAYLOAD_SIZE
+  ACState state;
+  state.power = true;
+  state.degrees = -100;
+
+  batch.begin(UINT32_MAX - 70000);
+  for (size_t i = 0; i < TelemetryBatch::MAX_EVENTS + 3; i++) {
+    batch.sample(-100, UINT32_MAX / 2, UINT32_MAX / 2, UINT32_MAX);
+    batch.recordState(UINT32_MAX, AC_MAX_CHANNELS - 1, state);
+  }
+  size_t length = batch.format(output, sizeof(output), UINT32_MAX);
+  TEST_ASSERT_EQUAL_UINT32(TelemetryBatch::MAX_EVENTS, batch.eventCount());
+  TEST_ASSERT_NOT_NULL(strstr(output, "\"events_dropped\":3}"));
+  TEST_ASSERT_TRUE_MESSAGE(length + 1 < sizeof(output) && output[length - 1] == '}', "worst case exceeds the publish payload");
+}
+
+static void test_topic_table() {
+  const uint8_t mac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+  TopicTable topics;
+  TEST_ASSERT_TRUE(buildTopicTable(topics, mac, "customer-1", "zone-1", true));
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/AA:BB:CC:DD:EE:FF", topics.base);
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/AA:BB:CC:DD:EE:FF/telemetry/heartbeat", topics.heartbeat);
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/zone/zone-1", topics.zoneBase);
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/broadcast", topics.broadcastBase);
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/backpressure", topics.backpressure);
+
+  char topic[MQTT_TOPIC_SIZE];
+  TEST_ASSERT_TRUE(buildChannelTopic(topic, sizeof(topic), topics, 2, "/telemetry/state"));
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/AA:BB:CC:DD:EE:FF/ac/2/telemetry/state", topic);
+  TEST_ASSERT_TRUE(buildChannelTopic(topic, sizeof(topic), topics, 0, "/telemetry/state"));
+  TEST_ASSERT_EQUAL_STRING("node/customer-1/AA:BB:CC:DD:EE:FF/telemetry/state", topic);
+  TEST_ASSERT_FALSE_MESSAGE(buildTopic(topic, 16, topics.base, "/status"), "truncation not reported");
+}
+
+static void test_topic_table_limits() {
+  const uint8_t mac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+  char customer[MQTT_TOPIC_SIZE];
+  memset(customer, 'c', sizeof(customer) - 1);
+  customer[sizeof(customer) - 1] = '\0';
+  TopicTable topics;
+  TEST_ASSERT_FALSE(buildTopicTable(topics, mac, customer, "zone-1", true));
+  TEST_ASSERT_EQUAL_UINT32(0, topics.baseLength);
+
+  char zone[MQTT_TOPIC_SIZE];
+  memset(zone, 'z', sizeof(zone) - 1);
+  zone[sizeof(zone) - 1] = '\0';
+  TEST_ASSERT_TRUE_MESSAGE(buildTopicTable(topics, mac, "customer-1", zone, false), "a long zone only drops the zone topic");
+  TEST_ASSERT_EQUAL_UINT32(0, topics.zoneBaseLength);
+  TEST_ASSERT_EQUAL_UINT32(0, topics.broadcastBaseLength);
+}
+
+static void test_topic_route() {
+  const uint8_t mac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+  TopicTable topics;
+  buildTopicTable(topics, mac, "customer-1", "zone-1", true);
+  bool group = true;
+  uint8_t channel = AC_ALL_CHANNELS;
+
+  const TopicRoute* route = findTopicRoute(topics, "node/customer-1/AA:BB:CC:DD:EE:FF/command/state", group, channel);
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_TRUE(route->command == CommandType::State && !group && channel == 0);
+  route = findTopicRoute(topics, "node/customer-1/zone/zone-1/command/fanspeed", group, channel);
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_TRUE(route->command == CommandType::FanSpeed && group && channel == AC_ALL_CHANNELS);
+  route = findTopicRoute(topics, "node/customer-1/AA:BB:CC:DD:EE:FF/ac/2/command/mode", group, channel);
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_TRUE(route->command == CommandType::Mode && !group && channel == 2);
+
+  TEST_ASSERT_NULL_MESSAGE(findTopicRoute(topics, "node/customer-1/AA:BB:CC:DD:EE:FF/ac/2/command/schedule", group, channel),
+                           "schedules are per device");
+  TEST_ASSERT_NULL_MESSAGE(findTopicRoute(topics, "node/customer-1/AA:BB:CC:DD:EE:FF/ac/9/command/mode", group, channel),
+                           "channel out of range");
+  TEST_ASSERT_NULL_MESSAGE(findTopicRoute(topics, "node/customer-1/zone/zone-1/ota/update", group, channel),
+                           "OTA must not be a group command");
+  TEST_ASSERT_NULL_MESSAGE(findTopicRoute(topics, "node/customer-2/11:22:33:44:55:66/command/state", group, channel),
+                           "foreign topic");
+}
+
+static void test_publish_queue() {
+  static PublishQueue queue;
+  const char* payload = "{\"rssi\":-61,\"uptime\":123456}";
+  size_t length = strlen(payload);
+  char output[64];
+
+  TEST_ASSERT_TRUE(queue.push(3, 1, payload, length));
+  PublishQueue::Header header;
+  TEST_ASSERT_TRUE(queue.peek(header));
+  TEST_ASSERT_TRUE(header.topic == 3 && header.flags == 1 && header.length == length);
+  TEST_ASSERT_EQUAL_UINT32(length, queue.read(output, sizeof(output)));
+  TEST_ASSERT_EQUAL_STRING(payload, output);
+  queue.pop();
+  TEST_ASSERT_TRUE(queue.empty());
+  TEST_ASSERT_EQUAL_UINT32(0, queue.used());
+}
+
+// Simulated installer: answers yes when the group contains the target
+static int16_t runProtocolSearch(const int16_t* candidates, size_t count, int16_t target, int16_t hint, size_t& answers) {
+  ProtocolSearch search;
+  search.begin(candidates, count, hint);
+  answers = 0;
+  while (search.result() == ProtocolSearch::Result::Pending) {
+    bool responded = false;
+    for (size_t i = search.groupBegin(); i < search.groupEnd(); i++) {
+      responded = responded || search.candidate(i) == target;
+    }
+    search.answer(responded);
+    answers++;
+  }
+  return search.result() == ProtocolSearch::Result::Found ? search.winner() : (int16_t)-1;
+}
+
+static void test_protocol_search() {
+  const size_t count = 10; // Daikin, the largest brand
+  int16_t candidates[count];
+  for (size_t i = 0; i < count; i++) {
+    candidates[i] = (int16_t)(100 + i);
+  }
+  size_t answers = 0;
+  size_t worst = 0;
+  for (size_t i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL_INT(candidates[i], runProtocolSearch(candidates, count, candidates[i], -1, answers));
+    worst = answers > worst ? answers : worst;
+  }
+  TEST_ASSERT_TRUE_MESSAGE(worst <= 5, "more than log2(n) + 1 answers");
+  TEST_ASSERT_EQUAL_INT(candidates[7], runProtocolSearch(candidates, count, candidates[7], candidates[7], answers));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, answers, "hint not confirmed first");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(-1, runProtocolSearch(candidates, count, -1, -1, answers), "no protocol must exhaust the search");
+}
+
+static const uint32_t BACKOFF_BASE = 5000;
+static const uint32_t BACKOFF_CAP = 30000;
+static const uint8_t MAC_A[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x01};
+static const uint8_t MAC_B[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x02};
+
+static void test_reconnect_backoff_jitter() {
+  ReconnectBackoff a(BACKOFF_BASE, BACKOFF_CAP);
+  ReconnectBackoff b(BACKOFF_BASE, BACKOFF_CAP);
+  a.seed(MAC_A, sizeof(MAC_A));
+  b.seed(MAC_B, sizeof(MAC_B));
+
+  uint32_t first = a.next();
+  TEST_ASSERT_LESS_THAN_UINT32(BACKOFF_BASE, first);
+  size_t inStep = a.initialDelay(10000) == b.initialDelay(10000) ? 1 : 0;
+  b.next();
+  for (int i = 0; i < 50; i++) {
+    uint32_t delayA = a.next();
+    uint32_t delayB = b.next();
+    TEST_ASSERT_TRUE_MESSAGE(delayA >= BACKOFF_BASE && delayA < BACKOFF_CAP && delayB >= BACKOFF_BASE && delayB < BACKOFF_CAP,
+                             "delay outside [base, cap)");
+    inStep += delayA == delayB ? 1 : 0;
+  }
+  TEST_ASSERT_TRUE_MESSAGE(inStep < 3, "neighbouring MACs retry in step");
+
+  ReconnectBackoff replay(BACKOFF_BASE, BACKOFF_CAP);
+  replay.seed(MAC_A, sizeof(MAC_A));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(first, replay.next(), "same MAC must replay the same sequence");
+}
+
+static void test_reconnect_backoff_hints() {
+  ReconnectBackoff backoff(BACKOFF_BASE, BACKOFF_CAP);
+  backoff.seed(MAC_A, sizeof(MAC_A));
+
+  backoff.setRetryAfter(120000, 60000);
+  uint32_t hinted = backoff.next();
+  uint32_t after = backoff.next();
+  TEST_ASSERT_TRUE_MESSAGE(hinted >= 120000 && hinted < 180000, "retry-after hint");
+  TEST_ASSERT_TRUE_MESSAGE(after >= BACKOFF_BASE && after < BACKOFF_CAP, "hint applies to the first retry only");
+  backoff.setRetryAfter(0, 60000);
+  backoff.reset();
+  TEST_ASSERT_LESS_THAN_UINT32_MESSAGE(BACKOFF_BASE, backoff.next(), "cleared hint");
+  uint32_t busy = backoff.serverBusy();
+  TEST_ASSERT_TRUE_MESSAGE(busy >= BACKOFF_CAP / 2 && busy < BACKOFF_CAP, "server busy");
+}
+
+// A broker that accepts connections and drops them again must not put the
+// device back into the first window on every cycle
+static void test_reconnect_backoff_flapping() {
+  const uint32_t stable = 45000;
+  ReconnectBackoff backoff(BACKOFF_BASE, BACKOFF_CAP);
+  backoff.seed(MAC_A, sizeof(MAC_A));
+  backoff.setStableTime(stable);
+
+  TEST_ASSERT_LESS_THAN_UINT32(BACKOFF_BASE, backoff.next());
+  for (int i = 0; i < 20; i++) {
+    backoff.connectedFor(0);
+    backoff.connectedFor(stable - 1);
+    uint32_t delay = backoff.next();
+    TEST_ASSERT_TRUE_MESSAGE(delay >= BACKOFF_BASE && delay < BACKOFF_CAP, "short-lived connection restarted the backoff");
+  }
+  backoff.connectedFor(stable);
+  TEST_ASSERT_LESS_THAN_UINT32_MESSAGE(BACKOFF_BASE, backoff.next(), "stable connection must restart the backoff");
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_field_command_bare);
+  RUN_TEST(test_field_command_embedded_nul);
+  RUN_TEST(test_field_command_envelope);
+  RUN_TEST(test_state_command);
+  RUN_TEST(test_codec);
+  RUN_TEST(test_state_record);
+  RUN_TEST(test_telemetry_formats);
+  RUN_TEST(test_telemetry_batch);
+  RUN_TEST(test_telemetry_batch_worst_case);
+  RUN_TEST(test_topic_table);
+  RUN_TEST(test_topic_table_limits);
+  RUN_TEST(test_topic_route);
+  RUN_TEST(test_publish_queue);
+  RUN_TEST(test_protocol_search);
+  RUN_TEST(test_reconnect_backoff_jitter);
+  RUN_TEST(test_reconnect_backoff_hints);
+  RUN_TEST(test_reconnect_backoff_flapping);
+  return UNITY_END();
+}
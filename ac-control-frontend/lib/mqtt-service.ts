@@ -279,8 +279,10 @@ export class MQTTService {
       }
     }
 
-    // Handle device telemetry messages (JSON with AC state)
-    const telemetryMatch = topic.match(/^node\/([^/]+)\/([^/]+)\/telemetry$/)
+    // Handle device telemetry messages (JSON with AC state). With change-driven
+    // telemetry the full descriptor is sent once per connection and state
+    // changes arrive on telemetry/state with the same ac_* fields.
+    const telemetryMatch = topic.match(/^node\/([^/]+)\/([^/]+)\/telemetry(?:\/state)?$/)
     if (telemetryMatch) {
       const [, customerId, deviceId] = telemetryMatch
 
@@ -448,6 +450,7 @@ export class MQTTService {
     if (this.isConnected) {
       this.subscribe(`node/${customerId}/${deviceId}/status`).catch(console.error)
       this.subscribe(`node/${customerId}/${deviceId}/telemetry`).catch(console.error)
+      this.subscribe(`node/${customerId}/${deviceId}/telemetry/state`).catch(console.error)
       this.subscribe(`node/${customerId}/${deviceId}/error`).catch(console.error)
     } else {
       console.log(`MQTT not connected, will subscribe to device ${deviceId} when connected`)
@@ -458,6 +461,7 @@ export class MQTTService {
     this.statusHandlers.delete(deviceId)
     this.unsubscribe(`node/${customerId}/${deviceId}/status`).catch(console.error)
     this.unsubscribe(`node/${customerId}/${deviceId}/telemetry`).catch(console.error)
+    this.unsubscribe(`node/${customerId}/${deviceId}/telemetry/state`).catch(console.error)
     this.unsubscribe(`node/${customerId}/${deviceId}/error`).catch(console.error)
   }
 
@@ -503,7 +507,12 @@ export class MQTTService {
     for (const [deviceId, callback] of this.statusHandlers) {
       // Extract customer ID from the first status handler (assuming all devices belong to same customer)
       // This is a simplified approach - in production you might want to store customer ID separately
-      const topics = [`node/+/${deviceId}/status`, `node/+/${deviceId}/telemetry`, `node/+/${deviceId}/error`]
+      const topics = [
+        `node/+/${deviceId}/status`,
+        `node/+/${deviceId}/telemetry`,
+        `node/+/${deviceId}/telemetry/state`,
+        `node/+/${deviceId}/error`,
+      ]
 
       topics.forEach((topic) => {
         this.subscribe(topic).catch(console.error)